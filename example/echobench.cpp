@@ -0,0 +1,385 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include <getopt.h>
+#include <time.h>
+#include <vector>
+#include "lev.h"
+#include "levthread.h"
+#include "levpool.h"
+
+using namespace lev;
+
+//
+// Echo throughput and round trip latency over localhost.  Each connection keeps 'depth'
+// messages of 'size' bytes in flight; every echoed message is timed and replaced (MB/s counts
+// one direction).  By default an in-process echo server (EvConnectionPool, like sockcliserv -s)
+// is started on its own loop threads; -a benchmarks an external one instead.
+//
+
+struct BenchConfig
+{
+    IpAddr addr;
+    int conns;
+    int size;
+    int depth;
+    int secs;
+    int warmup;
+    int clientThreads;
+    int serverThreads;
+};
+
+static BenchConfig gConf;
+static std::atomic<bool> gRecording(false);
+static std::vector<char> gPayload;
+
+static
+double nowSecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Server
+//
+
+struct EchoState
+{
+};
+
+typedef EvConnectionPool<EchoState> EchoPool;
+
+struct ServerLoop
+{
+    EvConnListener listener;
+    EchoPool pool;
+};
+
+static
+void onServEcho(EvConnection<EchoState>* conn, void* cbarg)
+{
+    conn->output().append(conn->input());
+}
+
+static
+void onServThreadInit(EvLoopThread* thread, void* arg)
+{
+    ServerLoop* sl = new ServerLoop();
+    int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT;
+
+    sl->pool.setCallbacks(onServEcho, NULL, NULL, NULL);
+    if (!sl->listener.newListener(gConf.addr, EchoPool::onAccept, &sl->pool, thread->loop(), flags))
+    {
+        printf("Error: Failed to listen on %s\n", gConf.addr.toStringFull().c_str());
+    }
+    thread->setUserData(sl);
+}
+
+static
+void onServThreadExit(EvLoopThread* thread, void* arg)
+{
+    delete (ServerLoop*)thread->userData();
+}
+
+//
+// Client
+//
+
+struct ClientLoop;
+
+struct ClientConn
+{
+    ClientConn() :
+        loop(NULL),
+        head(0),
+        inflight(0),
+        connected(false)
+    {
+    }
+
+    ClientLoop* loop;
+    EvBufferEvent bev;
+    std::vector<uint64_t> sentAt;       // Ring of send times of the messages in flight
+    int head;
+    int inflight;
+    bool connected;
+};
+
+struct ClientLoop
+{
+    ClientLoop() :
+        msgs(0),
+        errors(0)
+    {
+    }
+    ~ClientLoop()
+    {
+        for (size_t i = 0; i < conns.size(); i++)
+        {
+            delete conns[i];
+        }
+    }
+
+    std::vector<ClientConn*> conns;
+    EvHistogram rtt;                    // Microseconds
+    uint64_t msgs;
+    uint64_t errors;
+};
+
+static
+void sendMessage(ClientConn* c)
+{
+    int tail = (c->head + c->inflight) % gConf.depth;
+    c->sentAt[tail] = EvMetrics::nowUsecs();
+    c->inflight++;
+    c->bev.output().append(&gPayload[0], gConf.size);
+}
+
+static
+void onClientRead(struct bufferevent* bev, void* cbarg)
+{
+    ClientConn* c = (ClientConn*)cbarg;
+    EvBuffer input = c->bev.input();
+    size_t avail = input.length();
+    size_t done = avail / gConf.size;
+
+    if (done == 0)
+    {
+        return;
+    }
+    input.drain(done * gConf.size);
+
+    uint64_t now = EvMetrics::nowUsecs();
+    bool recording = gRecording.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < done && c->inflight > 0; i++)
+    {
+        if (recording)
+        {
+            c->loop->rtt.record(now - c->sentAt[c->head]);
+            c->loop->msgs++;
+        }
+        c->head = (c->head + 1) % gConf.depth;
+        c->inflight--;
+        sendMessage(c);
+    }
+}
+
+static
+void onClientEvent(struct bufferevent* bev, short events, void* cbarg)
+{
+    ClientConn* c = (ClientConn*)cbarg;
+
+    if (events & BEV_EVENT_CONNECTED)
+    {
+        c->connected = true;
+        c->bev.setTcpNoDelay();
+        for (int i = 0; i < gConf.depth; i++)
+        {
+            sendMessage(c);
+        }
+    }
+    else if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF))
+    {
+        c->loop->errors++;
+        c->bev.disable(EV_READ | EV_WRITE);
+    }
+}
+
+static
+void onClientThreadInit(EvLoopThread* thread, void* arg)
+{
+    std::vector<ClientLoop*>* loops = (std::vector<ClientLoop*>*)arg;
+    ClientLoop* cl = (*loops)[thread->index()];
+
+    // Spread the connections over the client threads
+    int count = gConf.conns / gConf.clientThreads;
+    if (thread->index() < gConf.conns % gConf.clientThreads)
+    {
+        count++;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        ClientConn* c = new ClientConn();
+        c->loop = cl;
+        c->sentAt.resize(gConf.depth);
+        cl->conns.push_back(c);
+
+        if (!c->bev.newForSocket(-1, onClientRead, NULL, onClientEvent, c, thread->loop()))
+        {
+            cl->errors++;
+            continue;
+        }
+        c->bev.enable(EV_READ | EV_WRITE);
+        if (!c->bev.connect(gConf.addr))
+        {
+            cl->errors++;
+        }
+    }
+}
+
+static
+void onClientThreadExit(EvLoopThread* thread, void* arg)
+{
+    // Bufferevents go before their loop; the stats stay for the report
+    std::vector<ClientLoop*>* loops = (std::vector<ClientLoop*>*)arg;
+    ClientLoop* cl = (*loops)[thread->index()];
+    for (size_t i = 0; i < cl->conns.size(); i++)
+    {
+        cl->conns[i]->bev.free();
+    }
+}
+
+static
+void waitSecs(double secs)
+{
+    double end = nowSecs() + secs;
+    double left;
+    while ((left = end - nowSecs()) > 0)
+    {
+        usleep((useconds_t)(left * 1e6));
+    }
+}
+
+static
+void runBench()
+{
+    EvServerGroup servers;
+    EvServerGroup clients;
+    std::vector<ClientLoop*> loops;
+
+    gPayload.assign(gConf.size, 'x');
+
+    if (gConf.serverThreads > 0)
+    {
+        if (!servers.start(gConf.serverThreads, onServThreadInit, onServThreadExit, NULL))
+        {
+            printf("Error: Failed to start server threads\n");
+            return;
+        }
+    }
+
+    for (int i = 0; i < gConf.clientThreads; i++)
+    {
+        loops.push_back(new ClientLoop());
+    }
+    clients.start(gConf.clientThreads, onClientThreadInit, onClientThreadExit, &loops);
+
+    // Connections ramp up during the warmup; only the measured window is recorded
+    waitSecs(gConf.warmup);
+    gRecording.store(true);
+    double start = nowSecs();
+    waitSecs(gConf.secs);
+    gRecording.store(false);
+    double elapsed = nowSecs() - start;
+
+    clients.stop();
+    clients.join();
+    servers.stop();
+    servers.join();
+
+    EvHistogram rtt;
+    uint64_t msgs = 0;
+    uint64_t errors = 0;
+    int connected = 0;
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        rtt.merge(loops[i]->rtt);
+        msgs += loops[i]->msgs;
+        errors += loops[i]->errors;
+        for (size_t c = 0; c < loops[i]->conns.size(); c++)
+        {
+            connected += loops[i]->conns[c]->connected ? 1 : 0;
+        }
+        delete loops[i];
+    }
+
+    printf("echobench %s: %d conns (%d connected), %dB messages, depth %d, %d client / %d server threads, %.1fs\n",
+        gConf.addr.toStringFull().c_str(), gConf.conns, connected, gConf.size, gConf.depth, gConf.clientThreads,
+        gConf.serverThreads, elapsed);
+    printf("%12s %10s %10s %10s %10s %10s %10s\n", "msgs/s", "MB/s", "mean us", "p50 us", "p99 us", "p99.9 us",
+        "max us");
+    printf("%12.0f %10.2f %10.1f %10lu %10lu %10lu %10lu\n", msgs / elapsed,
+        (double)msgs * gConf.size / elapsed / (1024 * 1024), rtt.mean(), (unsigned long)rtt.percentile(50),
+        (unsigned long)rtt.percentile(99), (unsigned long)rtt.percentile(99.9), (unsigned long)rtt.max());
+    if (errors)
+    {
+        printf("%lu connection errors\n", (unsigned long)errors);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt = 0;
+    const char* addr = NULL;
+
+    gConf.conns = 64;
+    gConf.size = 64;
+    gConf.depth = 1;
+    gConf.secs = 5;
+    gConf.warmup = 1;
+    gConf.clientThreads = 1;
+    gConf.serverThreads = 1;
+
+    while ((opt = getopt(argc, argv, "a:c:s:p:d:w:t:T:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                addr = optarg;
+                gConf.serverThreads = 0;
+                break;
+            case 'c':
+                gConf.conns = atoi(optarg);
+                break;
+            case 's':
+                gConf.size = atoi(optarg);
+                break;
+            case 'p':
+                gConf.depth = atoi(optarg);
+                break;
+            case 'd':
+                gConf.secs = atoi(optarg);
+                break;
+            case 'w':
+                gConf.warmup = atoi(optarg);
+                break;
+            case 't':
+                gConf.clientThreads = atoi(optarg);
+                break;
+            case 'T':
+                gConf.serverThreads = atoi(optarg);
+                break;
+            default:
+                printf("echobench [-a host:port] [-c conns] [-s size] [-p depth] [-d secs] [-w secs] [-t N] [-T N]\n");
+                printf("   -a     benchmark an external echo server (ie sockcliserv -s) instead of an in-process one\n");
+                printf("   -c N   connections (64)\n");
+                printf("   -s N   message size in bytes (64)\n");
+                printf("   -p N   messages in flight per connection (1)\n");
+                printf("   -d N   measured seconds (5)\n");
+                printf("   -w N   warmup seconds before measuring (1)\n");
+                printf("   -t N   client loop threads (1)\n");
+                printf("   -T N   in-process server loop threads (1)\n");
+                return 1;
+        }
+    }
+    if (gConf.conns <= 0 || gConf.size <= 0 || gConf.depth <= 0 || gConf.secs <= 0 || gConf.clientThreads <= 0)
+    {
+        printf("Error: counts must be positive\n");
+        return 1;
+    }
+    if (gConf.warmup < 0)
+    {
+        gConf.warmup = 0;
+    }
+
+    gConf.addr.assign(addr ? addr : "127.0.0.1:6060");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    runBench();
+    return 0;
+}
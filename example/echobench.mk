@@ -0,0 +1,9 @@
+TYPE = exe
+SOURCES = echobench.cpp
+INCLUDES = -I. -I/usr/local/include -I../include
+INSLIBS = -L/usr/lib/x86_64-linux-gnu -levent -levent_pthreads -lpthread -lrt
+OUT = echobench
+
+#-----------------------------------------------------------------
+include ../build.mk
+
@@ -0,0 +1,514 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include <getopt.h>
+#include <time.h>
+#include <vector>
+#include "lev.h"
+#include "levhttp.h"
+#include "levthread.h"
+
+using namespace lev;
+
+//
+// HTTP load generator built on EvHttpClient.  Closed loop by default: every keep-alive
+// connection sends its next request as soon as the previous response is in.  With -r the
+// requests are sent at a fixed total rate instead (open loop) and latency is measured from
+// when each request was due, not when it was sent, so a stalled server can't hide its
+// queueing delay (coordinated omission).  By default an in-process EvHttpServer is started on
+// its own loop threads; -a benchmarks an external one (ie httpserv).
+//
+
+struct MixEntry
+{
+    // One kind of request: -m METHOD:PATH[:BODYBYTES[:WEIGHT]]
+    enum evhttp_cmd_type method;
+    std::string methodName;
+    std::string path;
+    int bodySize;
+    int weight;
+};
+
+struct BenchConfig
+{
+    IpAddr addr;
+    int conns;
+    int secs;
+    int warmup;
+    int rate;
+    int clientThreads;
+    int serverThreads;
+    std::vector<MixEntry> mix;
+    std::vector<int> schedule;          // Mix indexes repeated by weight
+};
+
+static BenchConfig gConf;
+static std::atomic<bool> gRecording(false);
+static std::vector<char> gBody;
+
+static
+double nowSecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Server
+//
+
+static const char gHello[] = "<html><body>Hello from lev</body></html>";
+
+static
+void onHello(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    EvHttpRequest evreq(req);
+    evreq.output().addReference(gHello, sizeof(gHello) - 1, NULL, NULL);
+    evreq.sendReply(200, "OK");
+}
+
+static
+void onEcho(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    EvHttpRequest evreq(req);
+    EvBuffer out = evreq.output();
+    out.append(evreq.input());
+    evreq.sendReply(200, "OK");
+}
+
+static
+void onUser(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    EvHttpRequest evreq(req);
+    EvStrView id = params.find("id");
+    evreq.output().printf("{\"id\":\"%.*s\"}", (int)id.length(), id.data());
+    evreq.sendReply(200, "OK");
+}
+
+static
+void onServThreadInit(EvLoopThread* thread, void* arg)
+{
+    EvHttpRouter* router = (EvHttpRouter*)arg;
+    EvHttpServer* http = new EvHttpServer(thread->loop());
+    router->attach(*http);
+    if (!http->bindReusePort(gConf.addr))
+    {
+        printf("Error: Failed to listen on %s\n", gConf.addr.toStringFull().c_str());
+    }
+    thread->setUserData(http);
+}
+
+static
+void onServThreadExit(EvLoopThread* thread, void* arg)
+{
+    delete (EvHttpServer*)thread->userData();
+}
+
+//
+// Client
+//
+
+struct ClientLoop
+{
+    ClientLoop() :
+        client(NULL),
+        next(0),
+        issued(0),
+        startUsecs(0),
+        ok(0),
+        non2xx(0),
+        errors(0)
+    {
+    }
+    ~ClientLoop()
+    {
+        for (size_t i = 0; i < perMix.size(); i++)
+        {
+            delete perMix[i];
+        }
+    }
+
+    EvHttpClient* client;
+    EvEvent pacer;                      // Open loop: issues the requests that are due
+    size_t next;                        // Position in the mix schedule
+    uint64_t issued;
+    uint64_t startUsecs;
+    double rate;                        // This thread's share, requests per second
+    EvHistogram latency;                // Microseconds
+    std::vector<EvHistogram*> perMix;
+    uint64_t ok;
+    uint64_t non2xx;
+    uint64_t errors;
+};
+
+struct RequestCtx
+{
+    ClientLoop* loop;
+    int mix;
+    uint64_t dueUsecs;                  // When it was sent (closed loop) or due (open loop)
+};
+
+static void sendRequest(ClientLoop* cl, uint64_t due);
+
+static
+void onResponse(EvHttpRequest& resp, int error, void* arg)
+{
+    RequestCtx* ctx = (RequestCtx*)arg;
+    ClientLoop* cl = ctx->loop;
+
+    if (gRecording.load(std::memory_order_relaxed))
+    {
+        uint64_t took = EvMetrics::nowUsecs() - ctx->dueUsecs;
+        cl->latency.record(took);
+        cl->perMix[ctx->mix]->record(took);
+        if (error)
+        {
+            cl->errors++;
+        }
+        else if (resp.responseCode() / 100 == 2)
+        {
+            cl->ok++;
+        }
+        else
+        {
+            cl->non2xx++;
+        }
+    }
+    delete ctx;
+
+    if (gConf.rate == 0)
+    {
+        sendRequest(cl, EvMetrics::nowUsecs());
+    }
+}
+
+static
+void sendRequest(ClientLoop* cl, uint64_t due)
+{
+    RequestCtx* ctx = new RequestCtx();
+    ctx->loop = cl;
+    ctx->mix = gConf.schedule[cl->next];
+    ctx->dueUsecs = due;
+    cl->next = (cl->next + 1) % gConf.schedule.size();
+    cl->issued++;
+
+    const MixEntry& m = gConf.mix[ctx->mix];
+    EvBuffer body;
+    if (m.bodySize > 0)
+    {
+        body.newBuffer();
+        body.addReference(&gBody[0], m.bodySize, NULL, NULL);
+    }
+    if (!cl->client->request(gConf.addr, m.method, m.path.c_str(), onResponse, ctx,
+        (m.bodySize > 0) ? &body : NULL))
+    {
+        cl->errors++;
+        delete ctx;
+    }
+}
+
+static
+void onPace(evutil_socket_t fd, short what, void* arg)
+{
+    // Sends every request due by now, each stamped with its due time
+    EvEvent* ev = (EvEvent*)arg;
+    ClientLoop* cl = (ClientLoop*)ev->userData();
+
+    uint64_t now = EvMetrics::nowUsecs();
+    uint64_t due = (uint64_t)((now - cl->startUsecs) / 1e6 * cl->rate);
+    while (cl->issued < due)
+    {
+        sendRequest(cl, cl->startUsecs + (uint64_t)(cl->issued * 1e6 / cl->rate));
+    }
+}
+
+static
+int shareOf(int total, int index)
+{
+    int n = total / gConf.clientThreads;
+    return n + ((index < total % gConf.clientThreads) ? 1 : 0);
+}
+
+static
+void onClientThreadInit(EvLoopThread* thread, void* arg)
+{
+    std::vector<ClientLoop*>* loops = (std::vector<ClientLoop*>*)arg;
+    ClientLoop* cl = (*loops)[thread->index()];
+
+    int conns = shareOf(gConf.conns, thread->index());
+    if (conns <= 0)
+    {
+        return;
+    }
+    cl->client = new EvHttpClient(thread->loop(), conns);
+    cl->next = thread->index() % gConf.schedule.size();
+
+    if (gConf.rate == 0)
+    {
+        // Closed loop: one request in flight per connection
+        for (int i = 0; i < conns; i++)
+        {
+            sendRequest(cl, EvMetrics::nowUsecs());
+        }
+    }
+    else
+    {
+        cl->rate = (double)gConf.rate * conns / gConf.conns;
+        cl->startUsecs = EvMetrics::nowUsecs();
+        cl->pacer.newTimer(onPace, thread->loop());
+        cl->pacer.setUserData(cl);
+        cl->pacer.start(1);
+    }
+}
+
+static
+void onClientThreadExit(EvLoopThread* thread, void* arg)
+{
+    // Requests still in flight are dropped with the client
+    std::vector<ClientLoop*>* loops = (std::vector<ClientLoop*>*)arg;
+    ClientLoop* cl = (*loops)[thread->index()];
+    cl->pacer.free();
+    delete cl->client;
+    cl->client = NULL;
+}
+
+static
+void waitSecs(double secs)
+{
+    double end = nowSecs() + secs;
+    double left;
+    while ((left = end - nowSecs()) > 0)
+    {
+        usleep((useconds_t)(left * 1e6));
+    }
+}
+
+static
+void runBench()
+{
+    EvHttpRouter router;
+    EvServerGroup servers;
+    EvServerGroup clients;
+    std::vector<ClientLoop*> loops;
+
+    router.add(EVHTTP_REQ_GET | EVHTTP_REQ_HEAD, "/hello", onHello);
+    router.add(EVHTTP_REQ_POST | EVHTTP_REQ_PUT, "/echo", onEcho);
+    router.add(EVHTTP_REQ_GET, "/users/:id", onUser);
+
+    int maxbody = 0;
+    for (size_t i = 0; i < gConf.mix.size(); i++)
+    {
+        maxbody = (gConf.mix[i].bodySize > maxbody) ? gConf.mix[i].bodySize : maxbody;
+    }
+    gBody.assign(maxbody + 1, 'x');
+
+    if (gConf.serverThreads > 0)
+    {
+        if (!servers.start(gConf.serverThreads, onServThreadInit, onServThreadExit, &router))
+        {
+            printf("Error: Failed to start server threads\n");
+            return;
+        }
+    }
+
+    for (int i = 0; i < gConf.clientThreads; i++)
+    {
+        ClientLoop* cl = new ClientLoop();
+        for (size_t m = 0; m < gConf.mix.size(); m++)
+        {
+            cl->perMix.push_back(new EvHistogram());
+        }
+        loops.push_back(cl);
+    }
+    clients.start(gConf.clientThreads, onClientThreadInit, onClientThreadExit, &loops);
+
+    waitSecs(gConf.warmup);
+    gRecording.store(true);
+    double start = nowSecs();
+    waitSecs(gConf.secs);
+    gRecording.store(false);
+    double elapsed = nowSecs() - start;
+
+    clients.stop();
+    clients.join();
+    servers.stop();
+    servers.join();
+
+    EvHistogram latency;
+    std::vector<EvHistogram*> perMix;
+    uint64_t ok = 0;
+    uint64_t non2xx = 0;
+    uint64_t errors = 0;
+    for (size_t m = 0; m < gConf.mix.size(); m++)
+    {
+        perMix.push_back(new EvHistogram());
+    }
+    for (size_t i = 0; i < loops.size(); i++)
+    {
+        latency.merge(loops[i]->latency);
+        for (size_t m = 0; m < gConf.mix.size(); m++)
+        {
+            perMix[m]->merge(*loops[i]->perMix[m]);
+        }
+        ok += loops[i]->ok;
+        non2xx += loops[i]->non2xx;
+        errors += loops[i]->errors;
+        delete loops[i];
+    }
+
+    printf("httpbench %s: %d conns, %d client / %d server threads, %s, %.1fs\n",
+        gConf.addr.toStringFull().c_str(), gConf.conns, gConf.clientThreads, gConf.serverThreads,
+        gConf.rate ? "open loop" : "closed loop", elapsed);
+    if (gConf.rate)
+    {
+        printf("target %d req/s, latency from when each request was due\n", gConf.rate);
+    }
+    printf("%-24s %10s %9s %9s %9s %9s %9s %9s\n", "request", "req/s", "mean us", "p50 us", "p90 us", "p99 us",
+        "p99.9 us", "max us");
+    for (size_t m = 0; m < gConf.mix.size(); m++)
+    {
+        std::string name = gConf.mix[m].methodName + " " + gConf.mix[m].path;
+        printf("%-24.24s %10.0f %9.0f %9lu %9lu %9lu %9lu %9lu\n", name.c_str(), perMix[m]->count() / elapsed,
+            perMix[m]->mean(), (unsigned long)perMix[m]->percentile(50), (unsigned long)perMix[m]->percentile(90),
+            (unsigned long)perMix[m]->percentile(99), (unsigned long)perMix[m]->percentile(99.9),
+            (unsigned long)perMix[m]->max());
+        delete perMix[m];
+    }
+    printf("%-24s %10.0f %9.0f %9lu %9lu %9lu %9lu %9lu\n", "all", latency.count() / elapsed, latency.mean(),
+        (unsigned long)latency.percentile(50), (unsigned long)latency.percentile(90),
+        (unsigned long)latency.percentile(99), (unsigned long)latency.percentile(99.9),
+        (unsigned long)latency.max());
+    printf("%lu 2xx, %lu other status, %lu errors\n", (unsigned long)ok, (unsigned long)non2xx,
+        (unsigned long)errors);
+}
+
+static
+bool parseMix(const char* spec, MixEntry& m)
+{
+    // METHOD:PATH[:BODYBYTES[:WEIGHT]]
+    char method[16];
+    char path[1024];
+    int body = 0;
+    int weight = 1;
+    if (sscanf(spec, "%15[^:]:%1023[^:]:%d:%d", method, path, &body, &weight) < 2 || path[0] != '/')
+    {
+        return false;
+    }
+
+    static const struct { const char* name; enum evhttp_cmd_type cmd; } methods[] =
+    {
+        { "GET", EVHTTP_REQ_GET },
+        { "POST", EVHTTP_REQ_POST },
+        { "PUT", EVHTTP_REQ_PUT },
+        { "DELETE", EVHTTP_REQ_DELETE },
+        { "HEAD", EVHTTP_REQ_HEAD },
+        { "PATCH", EVHTTP_REQ_PATCH }
+    };
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    {
+        if (evutil_ascii_strcasecmp(method, methods[i].name) == 0)
+        {
+            m.method = methods[i].cmd;
+            m.methodName = methods[i].name;
+            m.path = path;
+            m.bodySize = (body > 0) ? body : 0;
+            m.weight = (weight > 0) ? weight : 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt = 0;
+    const char* addr = NULL;
+
+    gConf.conns = 32;
+    gConf.secs = 5;
+    gConf.warmup = 1;
+    gConf.rate = 0;
+    gConf.clientThreads = 1;
+    gConf.serverThreads = 1;
+
+    while ((opt = getopt(argc, argv, "a:c:d:w:r:m:t:T:")) != -1)
+    {
+        MixEntry m;
+        switch (opt)
+        {
+            case 'a':
+                addr = optarg;
+                gConf.serverThreads = 0;
+                break;
+            case 'c':
+                gConf.conns = atoi(optarg);
+                break;
+            case 'd':
+                gConf.secs = atoi(optarg);
+                break;
+            case 'w':
+                gConf.warmup = atoi(optarg);
+                break;
+            case 'r':
+                gConf.rate = atoi(optarg);
+                break;
+            case 'm':
+                if (!parseMix(optarg, m))
+                {
+                    printf("Error: Bad request spec %s\n", optarg);
+                    return 1;
+                }
+                gConf.mix.push_back(m);
+                break;
+            case 't':
+                gConf.clientThreads = atoi(optarg);
+                break;
+            case 'T':
+                gConf.serverThreads = atoi(optarg);
+                break;
+            default:
+                printf("httpbench [-a host:port] [-c conns] [-d secs] [-w secs] [-r rate] [-m spec]... [-t N] [-T N]\n");
+                printf("   -a     benchmark an external server (ie httpserv) instead of an in-process one\n");
+                printf("   -c N   keep-alive connections (32)\n");
+                printf("   -d N   measured seconds (5)\n");
+                printf("   -w N   warmup seconds before measuring (1)\n");
+                printf("   -r N   open loop at N requests/s in total (default closed loop)\n");
+                printf("   -m S   add METHOD:PATH[:BODYBYTES[:WEIGHT]] to the request mix (GET:/hello)\n");
+                printf("          the in-process server has GET /hello, POST /echo, GET /users/:id\n");
+                printf("   -t N   client loop threads (1)\n");
+                printf("   -T N   in-process server loop threads (1)\n");
+                return 1;
+        }
+    }
+    if (gConf.conns <= 0 || gConf.secs <= 0 || gConf.clientThreads <= 0 || gConf.rate < 0)
+    {
+        printf("Error: counts must be positive\n");
+        return 1;
+    }
+    if (gConf.warmup < 0)
+    {
+        gConf.warmup = 0;
+    }
+    if (gConf.mix.empty())
+    {
+        MixEntry m;
+        parseMix("GET:/hello", m);
+        gConf.mix.push_back(m);
+    }
+    for (size_t i = 0; i < gConf.mix.size(); i++)
+    {
+        for (int w = 0; w < gConf.mix[i].weight; w++)
+        {
+            gConf.schedule.push_back((int)i);
+        }
+    }
+
+    gConf.addr.assign(addr ? addr : "127.0.0.1:8090");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    runBench();
+    return 0;
+}
@@ -1,11 +1,29 @@
 // Copyright (c) 2014 Yasser Asmi
 // Released under the MIT License (http://opensource.org/licenses/MIT)
 
+#include <getopt.h>
+#include <map>
 #include "lev.h"
 #include "levhttp.h"
+#include "levthread.h"
+#include "levalloc.h"
+#include "levmonitor.h"
+#include "levstatic.h"
+#include "levcache.h"
+#include "levzip.h"
 
 using namespace lev;
 
+// Replies of 1KB or more are gzipped for clients that accept it
+static EvHttpCompressor gZip(1024, 6);
+
+// Largest request body any route takes (/upload).  With libevent 2.1 the whole body is buffered
+// before the route runs, so this server limit is what bounds memory.
+static const ssize_t gMaxBody = 64 * 1024 * 1024;
+
+// Bytes received so far per upload in progress, on this loop thread
+static thread_local std::map<struct evhttp_request*, uint64_t> gUploads;
+
 static
 void onCtrlC(evutil_socket_t fd, short what, void* arg)
 {
@@ -15,15 +33,110 @@ void onCtrlC(evutil_socket_t fd, short what, void* arg)
 }
 
 static
-void onHttpHello(struct evhttp_request* req, void* arg)
+void onHttpHello(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    static const char hello[] = "<html><body><center><h1>Hello World!</h1></center></body></html>";
+    EvHttpRequest evreq(req);
+
+    // Static body: reference it instead of copying it into the reply
+    evreq.output().addReference(hello, sizeof(hello) - 1, NULL, NULL);
+
+    evreq.sendReply(200, "OK");
+}
+
+struct StreamState
+{
+    StreamState() :
+        zr(gZip)
+    {
+    }
+    struct evhttp_request* req;
+    EvCompressedReply zr;
+    int remaining;
+};
+
+static
+void onStreamClose(struct evhttp_connection* conn, void* arg)
+{
+    // Client went away mid-stream
+    delete (StreamState*)arg;
+}
+
+static
+void onStreamDrained(struct evhttp_connection* conn, void* arg)
+{
+    StreamState* st = (StreamState*)arg;
+    EvHttpRequest evreq(st->req);
+
+    if (st->remaining == 0)
+    {
+        evreq.setCloseCallback(NULL, NULL);
+        st->zr.end();
+        delete st;
+        return;
+    }
+
+    // Generate the next chunk only once the previous ones have mostly been written
+    EvBuffer chunk;
+    chunk.newBuffer();
+    for (int i = 0; i < 1000; i++)
+    {
+        chunk.printf("chunk %d line %d\n", st->remaining, i);
+    }
+    st->remaining--;
+
+    st->zr.chunk(chunk, onStreamDrained, st, 16 * 1024);
+}
+
+static
+void onHttpStream(struct evhttp_request* req, const EvRouteParams& params, void* arg)
 {
     EvHttpRequest evreq(req);
+    StreamState* st = new StreamState;
+    st->req = req;
+    st->remaining = 100;
+
+    evreq.setCloseCallback(onStreamClose, st);
+    evhttp_add_header(evreq.outputHdrs(), "Content-Type", "text/plain");
+    st->zr.start(req, 200, "OK");
+    onStreamDrained(evreq.connection(), st);
+}
 
-    evreq.output().printf("<html><body><center><h1>Hello World!</h1></center></body></html>");
+static
+void onHttpUser(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    // Shows up in the -m report if it ever takes over 50ms
+    EvLoopMonitor::Timed timed((const void*)onHttpUser);
+    EvHttpRequest evreq(req);
+    EvStrView id = params.find("id");
 
+    evreq.output().printf("<html><body>user=%.*s</body></html>", (int)id.length(), id.data());
     evreq.sendReply(200, "OK");
 }
 
+static
+void onHttpItems(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    // JSON list, gzipped when the client accepts it: /items?n=500
+    EvHttpRequest evreq(req);
+    EvStrView n = evreq.query().find("n");
+    int count = n.empty() ? 100 : atoi(n.str().c_str());
+    count = (count < 0) ? 0 : (count > 100000) ? 100000 : count;
+
+    EvBuffer body;
+    body.newBuffer();
+    body.printf("[");
+    for (int i = 0; i < count; i++)
+    {
+        body.printf("%s{\"id\":%d,\"name\":\"item %d\",\"price\":%d.%02d,\"stock\":%d}", i ? "," : "", i, i,
+            (i * 37) % 500, i % 100, (i * 7919) % 1000);
+    }
+    body.printf("]");
+
+    evhttp_add_header(evreq.outputHdrs(), "Content-Type", "application/json");
+    gZip.sendReply(req, 200, "OK", body);
+}
+
 static
 void onHttpDefault(struct evhttp_request* req, void* arg)
 {
@@ -40,23 +153,195 @@ void onHttpDefault(struct evhttp_request* req, void* arg)
     evreq.sendReply(200, "OK");
 }
 
+static
+void onUploadChunk(struct evhttp_request* req, const EvRouteParams& params, EvBuffer& chunk, void* arg)
+{
+    // Called as the body arrives (libevent 2.2+): a real handler would write the chunk out,
+    // pausing the request's input while the write is pending
+    gUploads[req] += chunk.length();
+    chunk.drain(chunk.length());
+}
+
+static
+void onUploadDone(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    uint64_t received = 0;
+    std::map<struct evhttp_request*, uint64_t>::iterator it = gUploads.find(req);
+    if (it != gUploads.end())
+    {
+        received = it->second;
+        gUploads.erase(it);
+    }
+
+    EvHttpRequest evreq(req);
+    evreq.output().printf("<html><body>received %lu bytes</body></html>", (unsigned long)received);
+    evreq.sendReply(200, "OK");
+}
+
+static
+int renderReport(struct evhttp_request* req, const EvRouteParams& params, EvBuffer& body, void* arg)
+{
+    // Expensive to build, identical for a few seconds: served from the response cache
+    EvStrView id = params.find("id");
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/html");
+    body.printf("<html><body><h1>Report %.*s</h1><table>", (int)id.length(), id.data());
+    for (int i = 0; i < 1000; i++)
+    {
+        body.printf("<tr><td>%d</td><td>%d</td></tr>", i, (i * 7919) % 1000);
+    }
+    body.printf("</table></body></html>");
+    return HTTP_OK;
+}
+
+static
+void setupRoutes(EvHttpRouter& router, EvStaticFiles* files, EvResponseCache& cache)
+{
+    router.add(EVHTTP_REQ_GET | EVHTTP_REQ_HEAD, "/hello", onHttpHello);
+    router.add(EVHTTP_REQ_GET, "/stream", onHttpStream);
+    router.add(EVHTTP_REQ_GET, "/users/:id", onHttpUser);
+    router.add(EVHTTP_REQ_GET, "/items", onHttpItems);
+    router.addStreaming(EVHTTP_REQ_PUT | EVHTTP_REQ_POST, "/upload", onUploadChunk, onUploadDone, NULL,
+        gMaxBody);
+    cache.add(router, EVHTTP_REQ_GET, "/reports/:id", renderReport, NULL, 5000);
+    router.addMetrics("/metrics");
+    if (files)
+    {
+        router.add(EVHTTP_REQ_GET | EVHTTP_REQ_HEAD, "/static/*path", EvStaticFiles::onRoute, files);
+    }
+    router.setNotFound(onHttpDefault);
+}
+
+static bool gMonitor = false;
+
+struct HttpLoop
+{
+    HttpLoop(EvBaseLoop& base) :
+        http(base)
+    {
+    }
+    EvHttpServer http;
+    EvLoopMonitor monitor;
+};
+
+static
+void onHttpThreadInit(EvLoopThread* thread, void* arg)
+{
+    // The router is only read after setup so all the threads share it
+    EvHttpRouter* router = (EvHttpRouter*)arg;
+    HttpLoop* hl = new HttpLoop(thread->loop());
+    hl->http.setMaxBodySize(gMaxBody);
+    router->attach(hl->http);
+    if (gMonitor)
+    {
+        hl->monitor.start(thread->loop());
+    }
+
+    hl->http.bindReusePort(IpAddr("127.0.0.1", 8080));
+    thread->setUserData(hl);
+}
+
+static
+void onHttpThreadExit(EvLoopThread* thread, void* arg)
+{
+    HttpLoop* hl = (HttpLoop*)thread->userData();
+    if (gMonitor)
+    {
+        printf("Thread %d: ", thread->index());
+        hl->monitor.printSlow(stdout);
+    }
+    delete hl;
+}
+
 int main(int argc, char** argv)
 {
     //EvBaseLoop::enableDebug();
 
+    int opt = 0;
+    int threads = 1;
+    bool arena = false;
+    const char* docroot = NULL;
+    while ((opt = getopt(argc, argv, "amd:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                // Must happen before libevent allocates anything
+                EvArena::install();
+                arena = true;
+                break;
+            case 'm':
+                gMonitor = true;
+                break;
+            case 'd':
+                docroot = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0)
+                {
+                    threads = EvLoopThread::cpuCount();
+                }
+                break;
+            default:
+                printf("httpserv [-a] [-m] [-d dir] [-t N]\n");
+                printf("   -a     use per-thread arenas for libevent memory, print stats on exit\n");
+                printf("   -m     monitor loop lag and slow callbacks, print them on exit\n");
+                printf("   -d dir serve the files under dir as /static/...\n");
+                printf("   -t N   loop threads (0 = one per cpu)\n");
+                return 1;
+        }
+    }
+
+    // The static files and the response cache are shared by the loop threads, and their
+    // buffers are referenced from each of them: libevent needs its locks for that
+    EvBaseLoop::enableThreads();
+
     EvBaseLoop base;
+    EvServerGroup group;
 
     EvEvent ctrlc;
     ctrlc.newSignal(onCtrlC, SIGINT, base);
     ctrlc.start();
 
+    EvStaticFiles* files = docroot ? new EvStaticFiles(docroot) : NULL;
+    EvResponseCache cache(16 * 1024 * 1024);
+    cache.setCompressor(&gZip);
+    EvHttpRouter router;
+    setupRoutes(router, files, cache);
+
     EvHttpServer http(base);
-    http.setDefaultRoute(onHttpDefault);
-    http.addRoute("/hello", onHttpHello);
+    EvLoopMonitor monitor;
+    if (threads > 1)
+    {
+        // One http server per loop thread, all sharing port 8080 through SO_REUSEPORT
+        group.start(threads, onHttpThreadInit, onHttpThreadExit, &router, true);
+    }
+    else
+    {
+        http.setMaxBodySize(gMaxBody);
+        router.attach(http);
+        if (gMonitor)
+        {
+            monitor.start(base);
+        }
 
-    http.bind("127.0.0.1", 8080);
+        http.bind("127.0.0.1", 8080);
+    }
 
     base.loop();
 
+    group.stop();
+    group.join();
+
+    if (gMonitor && threads <= 1)
+    {
+        monitor.printSlow(stdout);
+    }
+    if (arena)
+    {
+        EvArena::printStats(stdout);
+    }
+    delete files;
+
     return 0;
 }
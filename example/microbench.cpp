@@ -0,0 +1,870 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include <getopt.h>
+#include <time.h>
+#include <vector>
+#include "lev.h"
+#include "levhttp.h"
+#include "levthread.h"
+#include "levtimer.h"
+#include "levfilter.h"
+#include "levzip.h"
+#include "levcodec.h"
+
+using namespace lev;
+
+static
+double nowSecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Cross-thread posting: N producer threads post preallocated tasks into one loop thread
+//
+
+class CountTask : public EvTask
+{
+public:
+    CountTask() :
+        mCount(NULL)
+    {
+    }
+    virtual void run()
+    {
+        (*mCount)++;
+    }
+
+    int64_t* mCount;
+};
+
+struct PostProducer
+{
+    EvLoopThread* thread;
+    CountTask* tasks;
+    int count;
+    pthread_t tid;
+};
+
+static
+void* postProducerMain(void* arg)
+{
+    PostProducer* p = (PostProducer*)arg;
+    for (int i = 0; i < p->count; i++)
+    {
+        p->thread->post(&p->tasks[i]);
+    }
+    return NULL;
+}
+
+static
+void benchPost(int maxproducers, int count)
+{
+    printf("post: %d tasks per producer\n", count);
+    printf("%10s %14s %12s\n", "producers", "posts/sec", "secs");
+
+    for (int n = 1; n <= maxproducers; n++)
+    {
+        EvLoopThread consumer;
+        int64_t runcount = 0;
+        std::atomic<bool> done(false);
+        std::vector<PostProducer> producers(n);
+        std::vector<CountTask> tasks((size_t)n * count);
+
+        consumer.start(NULL, NULL, NULL);
+
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            tasks[i].mCount = &runcount;
+        }
+
+        double start = nowSecs();
+        for (int i = 0; i < n; i++)
+        {
+            producers[i].thread = &consumer;
+            producers[i].tasks = &tasks[(size_t)i * count];
+            producers[i].count = count;
+            pthread_create(&producers[i].tid, NULL, postProducerMain, &producers[i]);
+        }
+        for (int i = 0; i < n; i++)
+        {
+            pthread_join(producers[i].tid, NULL);
+        }
+
+        // The queue is FIFO per producer so this runs after every task above has run
+        consumer.post([&done]() { done.store(true); });
+        while (!done.load())
+        {
+            sched_yield();
+        }
+        double secs = nowSecs() - start;
+
+        assert(runcount == (int64_t)n * count);
+        printf("%10d %14.0f %12.3f\n", n, (n * (double)count) / secs, secs);
+
+        consumer.stop();
+        consumer.join();
+    }
+}
+
+//
+// Line protocol parsing: evbuffer_readln() vs EvBufferView::find() + drain()
+//
+
+static
+void onFreeChain(const void* data, size_t datalen, void* arg)
+{
+    free((void*)data);
+}
+
+static
+void fillLines(EvBuffer& buf, const std::string& block, int blocks)
+{
+    // Appended block by block, like socket reads, so lines straddle chains
+    for (int i = 0; i < blocks; i++)
+    {
+        buf.append(block.data(), block.size());
+    }
+}
+
+static
+void benchLines(int count)
+{
+    std::string block;
+    int linesperblock = 0;
+    while (block.size() < 4000)
+    {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "SET key:%d some-value-%d\r\n", linesperblock, linesperblock * 7);
+        block.append(line, n);
+        linesperblock++;
+    }
+    int blocks = count / linesperblock + 1;
+    int64_t total = (int64_t)blocks * linesperblock;
+    double secs;
+    int64_t lines;
+
+    printf("lines: %ld lines of ~%d bytes in %d byte blocks\n", total, (int)(block.size() / linesperblock),
+        (int)block.size());
+    printf("%16s %14s %12s\n", "method", "lines/sec", "secs");
+
+    // evbuffer_readln: copies each line into a malloc'd string
+    {
+        EvBuffer buf;
+        buf.newBuffer();
+        fillLines(buf, block, blocks);
+
+        lines = 0;
+        double start = nowSecs();
+        char* line;
+        size_t len;
+        while ((line = evbuffer_readln(buf.ptr(), &len, EVBUFFER_EOL_CRLF_STRICT)) != NULL)
+        {
+            lines++;
+            EvMem::free(line);
+        }
+        secs = nowSecs() - start;
+        assert(lines == total);
+        printf("%16s %14.0f %12.3f\n", "evbuffer_readln", lines / secs, secs);
+    }
+
+    // EvBufferView: scan in place, drain once per block (ie once per read callback)
+    {
+        EvBuffer buf;
+        buf.newBuffer();
+        fillLines(buf, block, blocks);
+
+        lines = 0;
+        double start = nowSecs();
+        while (buf.length() > 0)
+        {
+            EvBufferView view(buf, 64 * 1024);
+            size_t off = 0;
+            ssize_t pos;
+            while ((pos = view.find("\r\n", 2, off)) >= 0)
+            {
+                lines++;
+                off = pos + 2;
+            }
+            if (off == 0)
+            {
+                break;
+            }
+            buf.drain(off);
+        }
+        secs = nowSecs() - start;
+        assert(lines == total);
+        printf("%16s %14.0f %12.3f\n", "EvBufferView", lines / secs, secs);
+    }
+
+    // Whole buffer views (-1) past the 16 extents kept inline: 40 chains, '\n' in chain 30
+    {
+        EvBuffer buf;
+        buf.newBuffer();
+        char chain[10];
+        for (int i = 0; i < 40; i++)
+        {
+            memset(chain, 'x', sizeof(chain));
+            if (i == 30)
+            {
+                chain[5] = '\n';
+            }
+            evbuffer_add_reference(buf.ptr(), strdup(chain), sizeof(chain), onFreeChain, NULL);
+        }
+        EvBufferView view(buf);
+        if (view.count() != 40 || view.length() != 400 || buf.find("\n", 1) != 305)
+        {
+            printf("EvBufferView(-1) FAILED: count %d length %zu find %zd\n", view.count(),
+                view.length(), buf.find("\n", 1));
+        }
+    }
+}
+
+//
+// Routing: EvHttpRouter vs the evhttp_set_cb lookup (decode the path into a malloc'd copy, then
+// strcmp down the list of registered paths)
+//
+
+static
+void onBenchRoute(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+}
+
+static
+void benchRouter(int routes, int count)
+{
+    EvHttpRouter router;
+    std::vector<std::string> cbs;
+    std::vector<std::string> paths;
+    std::vector<std::string> parampaths;
+
+    for (int i = 0; i < routes; i++)
+    {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "/api/v1/resource%d/list", i);
+        cbs.push_back(buf);
+        router.add(EVHTTP_REQ_GET, buf, onBenchRoute);
+
+        snprintf(buf, sizeof(buf), "/api/v1/resource%d/:id", i);
+        router.add(EVHTTP_REQ_GET, buf, onBenchRoute);
+    }
+    for (int i = 0; i < 1024; i++)
+    {
+        int r = (i * 7919) % routes;
+        paths.push_back(cbs[r]);
+
+        char buf[128];
+        snprintf(buf, sizeof(buf), "/api/v1/resource%d/%d", r, i * 31);
+        parampaths.push_back(buf);
+    }
+
+    printf("router: %d routes, %d lookups\n", routes, count);
+    printf("%22s %14s %12s\n", "method", "lookups/sec", "secs");
+
+    int64_t found = 0;
+    double start = nowSecs();
+    for (int i = 0; i < count; i++)
+    {
+        const std::string& path = paths[i & 1023];
+        char* translated = evhttp_uridecode(path.c_str(), 0, NULL);
+        for (size_t j = 0; j < cbs.size(); j++)
+        {
+            if (strcmp(cbs[j].c_str(), translated) == 0)
+            {
+                found++;
+                break;
+            }
+        }
+        EvMem::free(translated);
+    }
+    double secs = nowSecs() - start;
+    assert(found == count);
+    printf("%22s %14.0f %12.3f\n", "evhttp_set_cb list", count / secs, secs);
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        std::vector<std::string>& lookups = (pass == 0) ? paths : parampaths;
+        EvRouteParams params;
+        found = 0;
+        start = nowSecs();
+        for (int i = 0; i < count; i++)
+        {
+            const std::string& path = lookups[i & 1023];
+            if (router.match(EVHTTP_REQ_GET, path.data(), path.size(), params))
+            {
+                found++;
+            }
+        }
+        secs = nowSecs() - start;
+        assert(found == count);
+        printf("%22s %14.0f %12.3f\n", (pass == 0) ? "EvHttpRouter static" : "EvHttpRouter :id",
+            count / secs, secs);
+    }
+}
+
+//
+// Header lookups: evhttp_find_header (walk the list with strcasecmp for each lookup) vs an
+// EvHeaderIndex built once per request
+//
+
+static
+void benchHeaders(int count)
+{
+    static const char* names[] =
+    {
+        "Host", "User-Agent", "Accept", "Accept-Language", "Accept-Encoding", "Referer", "Connection",
+        "Upgrade-Insecure-Requests", "Sec-Fetch-Dest", "Sec-Fetch-Mode", "Sec-Fetch-Site", "Sec-Fetch-User",
+        "Cache-Control", "Pragma", "DNT", "Sec-Ch-Ua", "Sec-Ch-Ua-Mobile", "Sec-Ch-Ua-Platform",
+        "X-Forwarded-For", "X-Forwarded-Proto", "X-Forwarded-Host", "X-Real-IP", "X-Request-Id",
+        "X-Correlation-Id", "Via", "Forwarded", "Origin", "Cookie", "Authorization", "Content-Type",
+        "Content-Length", "If-None-Match"
+    };
+    const int nhdrs = sizeof(names) / sizeof(names[0]);
+
+    // A handler reading 8 headers; 2 of them aren't there
+    static const char* wanted[] = { "host", "content-length", "connection", "accept-encoding", "cookie",
+        "authorization", "x-api-key", "if-modified-since" };
+    static const EvHeaderIndex::Id wantedIds[] = { EvHeaderIndex::Host, EvHeaderIndex::ContentLength,
+        EvHeaderIndex::Connection, EvHeaderIndex::AcceptEncoding, EvHeaderIndex::Cookie,
+        EvHeaderIndex::Authorization, EvHeaderIndex::Upgrade, EvHeaderIndex::IfModifiedSince };
+    const int nwanted = sizeof(wanted) / sizeof(wanted[0]);
+
+    struct evhttp_request* req = evhttp_request_new(NULL, NULL);
+    struct evkeyvalq* hdrs = evhttp_request_get_input_headers(req);
+    for (int i = 0; i < nhdrs; i++)
+    {
+        evhttp_add_header(hdrs, names[i], "some header value");
+    }
+
+    printf("headers: %d headers, %d lookups per request, %d requests\n", nhdrs, nwanted, count);
+    printf("%22s %14s %12s\n", "method", "requests/sec", "secs");
+
+    int64_t found = 0;
+    double start = nowSecs();
+    for (int i = 0; i < count; i++)
+    {
+        for (int w = 0; w < nwanted; w++)
+        {
+            found += evhttp_find_header(hdrs, wanted[w]) ? 1 : 0;
+        }
+    }
+    double secs = nowSecs() - start;
+    printf("%22s %14.0f %12.3f\n", "evhttp_find_header", count / secs, secs);
+    int64_t expect = found;
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        found = 0;
+        start = nowSecs();
+        for (int i = 0; i < count; i++)
+        {
+            EvHeaderIndex index(hdrs);
+            for (int w = 0; w < nwanted; w++)
+            {
+                const char* v = (pass == 0) ? index.find(wanted[w]) : index.find(wantedIds[w]);
+                found += v ? 1 : 0;
+            }
+        }
+        secs = nowSecs() - start;
+        assert(found == expect);
+        printf("%22s %14.0f %12.3f\n", (pass == 0) ? "EvHeaderIndex name" : "EvHeaderIndex id", count / secs,
+            secs);
+    }
+
+    evhttp_request_free(req);
+}
+
+//
+// Request URI and query parsing: evhttp_uri_parse + evhttp_parse_query_str (a malloc per part
+// and per key and value) vs EvUriView + EvQueryView
+//
+
+static
+void benchQuery(int count)
+{
+    static const char uri[] = "/api/v1/search?q=lev+http&page=3&limit=50&sort=-created&fields=id%2Cname";
+    static const char* wanted[] = { "q", "limit", "fields" };
+    const int nwanted = sizeof(wanted) / sizeof(wanted[0]);
+    char buf[256];
+
+    printf("query: '%s', %d lookups, %d requests\n", uri, nwanted, count);
+    printf("%22s %14s %12s\n", "method", "requests/sec", "secs");
+
+    int64_t bytes = 0;
+    double start = nowSecs();
+    for (int i = 0; i < count; i++)
+    {
+        struct evhttp_uri* u = evhttp_uri_parse(uri);
+        EvKeyValues kv;
+        kv.newFromUri(evhttp_uri_get_query(u));
+        bytes += strlen(evhttp_uri_get_path(u));
+        for (int w = 0; w < nwanted; w++)
+        {
+            const char* v = kv.find(wanted[w]);
+            bytes += v ? strlen(v) : 0;
+        }
+        kv.free();
+        evhttp_uri_free(u);
+    }
+    double secs = nowSecs() - start;
+    printf("%22s %14.0f %12.3f\n", "evhttp_uri_parse", count / secs, secs);
+    int64_t expect = bytes;
+
+    bytes = 0;
+    start = nowSecs();
+    for (int i = 0; i < count; i++)
+    {
+        EvUriView u;
+        u.parse(uri, sizeof(uri) - 1);
+        EvQueryView q;
+        q.assignQuery(u.query());
+        bytes += u.path().length();
+        for (int w = 0; w < nwanted; w++)
+        {
+            ssize_t n = EvQueryView::decode(q.find(wanted[w]), buf, sizeof(buf));
+            bytes += (n > 0) ? n : 0;
+        }
+    }
+    secs = nowSecs() - start;
+    assert(bytes == expect);
+    printf("%22s %14.0f %12.3f\n", "EvUriView/EvQueryView", count / secs, secs);
+}
+
+//
+// Timer re-arm cost with many live timers: EvTimerWheel vs libevent's min-heap vs libevent
+// common timeouts
+//
+
+static
+void onBenchTimer(evutil_socket_t fd, short what, void* arg)
+{
+}
+
+static
+void benchTimers(int live, int count)
+{
+    std::vector<int> picks(4096);
+    for (size_t i = 0; i < picks.size(); i++)
+    {
+        picks[i] = (int)(((uint64_t)i * 2654435761u) % live);
+    }
+
+    printf("timers: %d live timers, %d re-arms\n", live, count);
+    printf("%22s %14s %12s\n", "method", "re-arms/sec", "secs");
+
+    {
+        EvTimerWheel wheel;
+        std::vector<EvTimerNode> nodes(live);
+        for (int i = 0; i < live; i++)
+        {
+            wheel.arm(nodes[i], 1000 + (i % 60000));
+        }
+
+        double start = nowSecs();
+        for (int i = 0; i < count; i++)
+        {
+            wheel.arm(nodes[picks[i & 4095]], 30000 + (i & 8191));
+        }
+        double secs = nowSecs() - start;
+        printf("%22s %14.0f %12.3f\n", "EvTimerWheel", count / secs, secs);
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        EvBaseLoop base;
+        std::vector<struct event*> evs(live);
+        const struct timeval* common = base.commonTimeout(30000);
+        for (int i = 0; i < live; i++)
+        {
+            evs[i] = event_new(base, -1, 0, onBenchTimer, NULL);
+            struct timeval tv = EvEvent::tvMsecs(1000 + (i % 60000));
+            event_add(evs[i], (pass == 0) ? &tv : common);
+        }
+
+        double start = nowSecs();
+        for (int i = 0; i < count; i++)
+        {
+            struct timeval tv = EvEvent::tvMsecs(30000 + (i & 8191));
+            event_add(evs[picks[i & 4095]], (pass == 0) ? &tv : common);
+        }
+        double secs = nowSecs() - start;
+        printf("%22s %14.0f %12.3f\n", (pass == 0) ? "libevent min-heap" : "libevent common", count / secs,
+            secs);
+
+        for (int i = 0; i < live; i++)
+        {
+            event_free(evs[i]);
+        }
+    }
+}
+
+//
+// Reply compression: CPU per byte against bytes saved, by level and body size
+//
+
+static
+void benchDeflate(int count)
+{
+    static const int sizes[] = { 1024, 16 * 1024, 256 * 1024 };
+    static const int levels[] = { 1, 6, 9 };
+
+    printf("deflate: gzip of JSON bodies, %d bytes compressed per row\n", count);
+    printf("%9s %6s %10s %8s %12s %12s\n", "body", "level", "gzip", "ratio", "MB/s in", "us/body");
+
+    for (int s = 0; s < 3; s++)
+    {
+        EvBuffer body;
+        body.newBuffer();
+        body.printf("[");
+        for (int i = 0; body.length() < (size_t)sizes[s] - 80; i++)
+        {
+            body.printf("%s{\"id\":%d,\"name\":\"item %d\",\"price\":%d.%02d,\"stock\":%d}", i ? "," : "",
+                i, i, (i * 37) % 500, i % 100, (i * 7919) % 1000);
+        }
+        body.printf("]");
+        size_t len = body.length();
+        int reps = (count / (int)len > 0) ? count / (int)len : 1;
+
+        for (int l = 0; l < 3; l++)
+        {
+            size_t zlen = 0;
+            double start = nowSecs();
+            for (int i = 0; i < reps; i++)
+            {
+                EvBuffer z;
+                z.newBuffer();
+                EvDeflate::compress(body, z, EvDeflate::Gzip, levels[l]);
+                zlen = z.length();
+            }
+            double secs = nowSecs() - start;
+            printf("%9zu %6d %10zu %7.1f%% %12.1f %12.1f\n", len, levels[l], zlen, 100.0 * zlen / len,
+                reps * len / secs / 1e6, secs * 1e6 / reps);
+        }
+    }
+}
+
+//
+// Layered stream stages over a socketpair: EvFilterStack stages that move chains vs
+// hand-coded stages in the read callback that copy through a temporary, as protocol code does
+// without filters
+//
+
+struct FilterBench
+{
+    std::vector<char> block;
+    std::vector<char> tmp;
+    std::vector<EvBuffer*> stages;      // Hand-coded stages' buffers
+    size_t sent;
+    size_t received;
+    size_t total;
+};
+
+static
+void onFilterBenchWrite(struct bufferevent* bev, void* arg)
+{
+    FilterBench* fb = (FilterBench*)arg;
+    EvBuffer out(bufferevent_get_output(bev));
+    while (out.length() < 4 * fb->block.size() && fb->sent < fb->total)
+    {
+        out.append(&fb->block[0], fb->block.size());
+        fb->sent += fb->block.size();
+    }
+}
+
+static
+void onFilterBenchRead(struct bufferevent* bev, void* arg)
+{
+    FilterBench* fb = (FilterBench*)arg;
+    struct evbuffer* cur = bufferevent_get_input(bev);
+    for (size_t i = 0; i < fb->stages.size(); i++)
+    {
+        struct evbuffer* next = fb->stages[i]->ptr();
+        int n;
+        while ((n = evbuffer_remove(cur, &fb->tmp[0], fb->tmp.size())) > 0)
+        {
+            evbuffer_add(next, &fb->tmp[0], n);
+        }
+        cur = next;
+    }
+    fb->received += evbuffer_get_length(cur);
+    evbuffer_drain(cur, evbuffer_get_length(cur));
+    if (fb->received >= fb->total)
+    {
+        event_base_loopbreak(bufferevent_get_base(bev));
+    }
+}
+
+static
+void runFilterBench(const char* method, int stages, bool stack, bool deflate, size_t total)
+{
+    EvBaseLoop base;
+    FilterBench fb;
+    fb.block.reserve(64 * 1024);
+    for (int i = 0; fb.block.size() < 64 * 1024 - 80; i++)
+    {
+        char item[96];
+        int n = snprintf(item, sizeof(item), "{\"id\":%d,\"name\":\"item %d\",\"price\":%d.%02d,\"stock\":%d},",
+            i, i, (i * 37) % 500, i % 100, (i * 7919) % 1000);
+        fb.block.insert(fb.block.end(), item, item + n);
+    }
+    fb.tmp.resize(16 * 1024);
+    fb.sent = 0;
+    fb.received = 0;
+    fb.total = total;
+
+    EvFilterStack wstack;
+    EvFilterStack rstack;
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    evutil_make_socket_nonblocking(fds[0]);
+    evutil_make_socket_nonblocking(fds[1]);
+    EvBufferEvent writer;
+    EvBufferEvent reader;
+    writer.newForSocket(fds[0], NULL, onFilterBenchWrite, NULL, &fb, base);
+    reader.newForSocket(fds[1], onFilterBenchRead, NULL, NULL, &fb, base);
+    bufferevent_set_max_single_read(reader.ptr(), 64 * 1024);
+    writer.enable(EV_WRITE);
+    reader.enable(EV_READ);
+
+    for (int i = 0; i < stages; i++)
+    {
+        if (stack)
+        {
+            rstack.push(new EvFilter());
+        }
+        else
+        {
+            fb.stages.push_back(new EvBuffer());
+            fb.stages.back()->newBuffer();
+        }
+    }
+    if (deflate)
+    {
+        wstack.push(new EvDeflateFilter(1));
+        rstack.push(new EvDeflateFilter(1));
+        wstack.attach(writer);
+    }
+    rstack.attach(reader);
+
+    double start = nowSecs();
+    onFilterBenchWrite(writer.ptr(), &fb);
+    base.loop();
+    double secs = nowSecs() - start;
+    printf("%6d %-26s %10.1f %10.3f\n", stages, method, fb.received / secs / 1e6, secs);
+
+    if (deflate)
+    {
+        wstack.printStats(stdout);
+        rstack.printStats(stdout);
+    }
+    for (size_t i = 0; i < fb.stages.size(); i++)
+    {
+        delete fb.stages[i];
+    }
+}
+
+static
+void benchFilters(int mbytes)
+{
+    size_t total = (size_t)mbytes * 1024 * 1024;
+    printf("filters: %d MB through a socketpair\n", mbytes);
+    printf("%6s %-26s %10s %10s\n", "stages", "method", "MB/s", "secs");
+    runFilterBench("none", 0, true, false, total);
+    for (int stages = 1; stages <= 4; stages *= 2)
+    {
+        runFilterBench("EvFilterStack", stages, true, false, total);
+        runFilterBench("copy in read callback", stages, false, false, total);
+    }
+    runFilterBench("EvDeflateFilter both ends", 0, true, true, total / 8);
+}
+
+//
+// Framing: EvFrameCodec over a socketpair with small frames (batched) up to 1 MB frames spread
+// over many chains
+//
+
+struct CodecBench
+{
+    std::vector<char> payload;
+    size_t frame;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t total;             // Frames
+    bool corrupt;
+};
+
+static
+void onCodecBenchWrite(struct bufferevent* bev, void* arg)
+{
+    CodecBench* cb = (CodecBench*)arg;
+    EvBuffer out(bufferevent_get_output(bev));
+    while (out.length() < 256 * 1024 && cb->sent < cb->total)
+    {
+        EvFrameCodec::writeHeader(out, EvFrameCodec::LengthU32, cb->frame);
+        out.append(&cb->payload[0], cb->frame);
+        cb->sent++;
+    }
+}
+
+static
+void onCodecBenchFrames(EvBufferEvent& bev, const EvFrame* frames, int count, void* arg)
+{
+    CodecBench* cb = (CodecBench*)arg;
+    if (count < 0)
+    {
+        cb->corrupt = true;
+        event_base_loopbreak(bufferevent_get_base(bev.ptr()));
+        return;
+    }
+    EvBuffer input = bev.input();
+    for (int i = 0; i < count; i++)
+    {
+        // The last payload byte, wherever its chain is
+        EvBufferView view;
+        EvFrameCodec::view(input, frames[i], view);
+        char last = 0;
+        if (frames[i].length != cb->frame || view.copyOut(cb->frame - 1, &last, 1) != 1 ||
+            last != cb->payload[cb->frame - 1])
+        {
+            cb->corrupt = true;
+        }
+    }
+    cb->received += count;
+    if (cb->received >= cb->total)
+    {
+        event_base_loopbreak(bufferevent_get_base(bev.ptr()));
+    }
+}
+
+static
+void runCodecBench(size_t frame, size_t totalbytes)
+{
+    EvBaseLoop base;
+    CodecBench cb;
+    cb.payload.resize(frame);
+    for (size_t i = 0; i < frame; i++)
+    {
+        cb.payload[i] = (char)(i * 7);
+    }
+    cb.frame = frame;
+    cb.sent = 0;
+    cb.received = 0;
+    cb.total = totalbytes / frame + 1;
+    cb.corrupt = false;
+
+    int fds[2];
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    evutil_make_socket_nonblocking(fds[0]);
+    evutil_make_socket_nonblocking(fds[1]);
+    EvBufferEvent writer;
+    EvBufferEvent reader;
+    writer.newForSocket(fds[0], NULL, onCodecBenchWrite, NULL, &cb, base);
+    reader.newForSocket(fds[1], NULL, NULL, NULL, NULL, base);
+    EvFrameCodec codec;
+    codec.setLengthPrefixed(EvFrameCodec::LengthU32);
+    codec.setCallback(onCodecBenchFrames, &cb);
+    codec.attach(reader);
+    writer.enable(EV_WRITE);
+    reader.enable(EV_READ);
+
+    // A frame the codec never delivers would otherwise hang the bench
+    struct timeval limit = {10, 0};
+    event_base_loopexit(base.base(), &limit);
+
+    double start = nowSecs();
+    onCodecBenchWrite(writer.ptr(), &cb);
+    base.loop();
+    double secs = nowSecs() - start;
+    if (cb.received < cb.total || cb.corrupt)
+    {
+        printf("%10zu FAILED: %lu of %lu frames%s, %zu bytes left in input\n", frame, cb.received,
+            cb.total, cb.corrupt ? " (corrupt)" : "", reader.input().length());
+        return;
+    }
+    printf("%10zu %14.0f %10.1f %12.1f %10.3f\n", frame, cb.received / secs,
+        cb.received * (double)frame / secs / 1e6, (double)codec.frames() / codec.batches(), secs);
+}
+
+static
+void benchCodec(int mbytes)
+{
+    size_t total = (size_t)mbytes * 1024 * 1024;
+    printf("codec: %d MB of U32 length-prefixed frames through a socketpair\n", mbytes);
+    printf("%10s %14s %10s %12s %10s\n", "frame", "frames/sec", "MB/s", "frames/call", "secs");
+    runCodecBench(64, total / 4);
+    runCodecBench(4096, total);
+    runCodecBench(128 * 1024, total);
+    runCodecBench(1024 * 1024, total);
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt = 0;
+    int count = 1000000;
+    int maxthreads = 4;
+    char mode = 0;
+    while ((opt = getopt(argc, argv, "plrHqTzFcn:t:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 't':
+                maxthreads = atoi(optarg);
+                break;
+            default:
+                mode = (char)opt;
+                break;
+        }
+    }
+
+    switch (mode)
+    {
+        case 'p':
+            benchPost(maxthreads, count);
+            break;
+        case 'l':
+            benchLines(count);
+            break;
+        case 'r':
+            benchRouter(500, count);
+            break;
+        case 'H':
+            benchHeaders(count);
+            break;
+        case 'q':
+            benchQuery(count);
+            break;
+        case 'T':
+            benchTimers(1000000, count);
+            break;
+        case 'z':
+            benchDeflate(count);
+            break;
+        case 'F':
+            benchFilters(count / 1000);
+            break;
+        case 'c':
+            benchCodec(count / 1000);
+            break;
+        default:
+            printf("microbench OPTION [-n count] [-t threads]\n");
+            printf("   -p   EvBaseLoop::post() throughput from 1..threads producers\n");
+            printf("   -l   line parsing, evbuffer_readln vs EvBufferView\n");
+            printf("   -r   route lookup with 500 routes, evhttp_set_cb vs EvHttpRouter\n");
+            printf("   -H   8 header lookups in 32 headers, evhttp_find_header vs EvHeaderIndex\n");
+            printf("   -q   URI and query parsing, evhttp_uri_parse vs EvUriView/EvQueryView\n");
+            printf("   -T   timer re-arm with 1M live timers, EvTimerWheel vs libevent\n");
+            printf("   -z   gzip CPU cost and size of JSON replies by level (-n bytes per row)\n");
+            printf("   -F   filter stack stages vs copying stages over a socketpair (-n KB)\n");
+            printf("   -c   EvFrameCodec from 64 byte to 1 MB frames over a socketpair (-n KB)\n");
+            break;
+    }
+
+    return 0;
+}
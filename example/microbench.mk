@@ -0,0 +1,9 @@
+TYPE = exe
+SOURCES = microbench.cpp
+INCLUDES = -I. -I/usr/local/include -I../include
+INSLIBS = -L/usr/lib/x86_64-linux-gnu -levent -levent_pthreads -lpthread -lrt -lz
+OUT = microbench
+
+#-----------------------------------------------------------------
+include ../build.mk
+
@@ -0,0 +1,7 @@
+oo/echobench.o: echobench.cpp ../include/lev.h ../include/levthread.h \
+ ../include/levpool.h ../include/levmetrics.h
+echobench.cpp:
+../include/lev.h:
+../include/levthread.h:
+../include/levpool.h:
+../include/levmetrics.h:
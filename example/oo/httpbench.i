@@ -0,0 +1,7 @@
+oo/httpbench.o: httpbench.cpp ../include/lev.h ../include/levhttp.h \
+ ../include/levmetrics.h ../include/levthread.h
+httpbench.cpp:
+../include/lev.h:
+../include/levhttp.h:
+../include/levmetrics.h:
+../include/levthread.h:
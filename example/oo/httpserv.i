@@ -0,0 +1,18 @@
+oo/httpserv.o: httpserv.cpp ../include/lev.h ../include/levhttp.h \
+ ../include/levmetrics.h ../include/levthread.h ../include/levalloc.h \
+ ../include/levmonitor.h ../include/levstatic.h ../include/levhttp.h \
+ ../include/levcache.h ../include/levzip.h ../include/levfilter.h \
+ ../include/levcache.h
+httpserv.cpp:
+../include/lev.h:
+../include/levhttp.h:
+../include/levmetrics.h:
+../include/levthread.h:
+../include/levalloc.h:
+../include/levmonitor.h:
+../include/levstatic.h:
+../include/levhttp.h:
+../include/levcache.h:
+../include/levzip.h:
+../include/levfilter.h:
+../include/levcache.h:
@@ -0,0 +1,16 @@
+oo/microbench.o: microbench.cpp ../include/lev.h ../include/levhttp.h \
+ ../include/levmetrics.h ../include/levthread.h ../include/levtimer.h \
+ ../include/levfilter.h ../include/levzip.h ../include/levhttp.h \
+ ../include/levfilter.h ../include/levcache.h ../include/levcodec.h
+microbench.cpp:
+../include/lev.h:
+../include/levhttp.h:
+../include/levmetrics.h:
+../include/levthread.h:
+../include/levtimer.h:
+../include/levfilter.h:
+../include/levzip.h:
+../include/levhttp.h:
+../include/levfilter.h:
+../include/levcache.h:
+../include/levcodec.h:
@@ -0,0 +1,8 @@
+oo/sockcliserv.o: sockcliserv.cpp ../include/lev.h ../include/levthread.h \
+ ../include/levpool.h ../include/levmetrics.h ../include/levflow.h
+sockcliserv.cpp:
+../include/lev.h:
+../include/levthread.h:
+../include/levpool.h:
+../include/levmetrics.h:
+../include/levflow.h:
@@ -0,0 +1,10 @@
+oo/tlsbench.o: tlsbench.cpp ../include/lev.h ../include/levhttp.h \
+ ../include/levmetrics.h ../include/levthread.h ../include/levtls.h \
+ ../include/levhttp.h
+tlsbench.cpp:
+../include/lev.h:
+../include/levhttp.h:
+../include/levmetrics.h:
+../include/levthread.h:
+../include/levtls.h:
+../include/levhttp.h:
@@ -3,6 +3,9 @@
 
 #include <getopt.h>
 #include "lev.h"
+#include "levthread.h"
+#include "levpool.h"
+#include "levflow.h"
 
 using namespace lev;
 
@@ -14,51 +17,130 @@ void onCtrlC(evutil_socket_t fd, short what, void* arg)
     ev->exitLoop();
 }
 
+struct EchoState
+{
+    EchoState() :
+        bytes(0)
+    {
+    }
+    int64_t bytes;
+    EvFlowControl flow;
+};
+
+typedef EvConnectionPool<EchoState> EchoPool;
+
+struct EchoServer
+{
+    EvConnListener listener;
+    EvRateLimitGroup group;     // Before the pool: outlive its connections
+    EvRateLimit connLimit;
+    EchoPool pool;
+    EvMemoryBudget budget;      // After the pool: destructed first
+};
+
+// Egress caps in bytes per second (0 = unlimited), per connection and per loop
+static size_t gConnRate = 0;
+static size_t gLoopRate = 0;
+
 static
-void onServEcho(struct bufferevent* bev, void* cbarg)
+void onServAccept(EvConnection<EchoState>* conn, void* cbarg)
 {
-    EvBufferEvent evbuf(bev);
+    // Stop reading from a client that doesn't read its echo
+    EchoServer* serv = (EchoServer*)cbarg;
+    conn->state().flow.setUserData(conn);
+    conn->state().flow.attach(conn->bev(), &serv->budget);
+}
 
-    // Copy all the data from the input buffer to the output buffer.
-    evbuf.output().append(evbuf.input());
+static
+void onServShed(EvFlowControl* flow, void* cbarg)
+{
+    printf("Shedding connection with %lu bytes buffered\n", (unsigned long)flow->buffered());
+    ((EvConnection<EchoState>*)flow->userData())->close();
 }
 
 static
-void onServEvent(struct bufferevent* bev, short events, void* cbarg)
+void onServEcho(EvConnection<EchoState>* conn, void* cbarg)
 {
-    EvBufferEvent evbuf(bev);
+    // Copy all the data from the input buffer to the output buffer.
+    conn->state().bytes += conn->input().length();
+    conn->output().append(conn->input());
+}
 
+static
+void onServEvent(EvConnection<EchoState>* conn, short events, void* cbarg)
+{
+    // The pool recycles the connection after EOF or error
     if (events & BEV_EVENT_ERROR)
     {
         printf("Error: Server connection error\n");
     }
-    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+}
+
+static
+bool startEchoServer(EchoServer* serv, const IpAddr& sin, struct event_base* base, int flags)
+{
+    // Pause the heaviest echoes past 64MB buffered on this loop, drop them past 256MB
+    serv->budget.start(base, 64 * 1024 * 1024, 256 * 1024 * 1024);
+    serv->budget.setShedCallback(onServShed, serv);
+
+    if (gConnRate)
+    {
+        serv->connLimit.newLimit(0, 0, gConnRate, gConnRate);
+    }
+    if (gLoopRate)
     {
-        evbuf.own(true);
-        evbuf.free();
+        EvRateLimit looplimit;
+        looplimit.newLimit(0, 0, gLoopRate, gLoopRate);
+        serv->group.newGroup(base, looplimit);
     }
+    serv->pool.setRateLimits(&serv->group, &serv->connLimit);
+
+    serv->pool.setCallbacks(onServEcho, NULL, onServEvent, serv);
+    serv->pool.setAcceptCallback(onServAccept);
+    return serv->listener.newListener(sin, EchoPool::onAccept, &serv->pool, base, flags);
 }
 
 static
-void onAccept(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* address,
-    int socklen, void* cbarg)
+void printEchoStats(EchoServer* serv)
 {
-    EvConnListener evlis(listener);
-    EvBufferEvent evbuf;
-
-    if (evbuf.newForSocket(fd, onServEcho, NULL, onServEvent, NULL, evlis.base()))
+    printf("Connections: %lu accepted, %lu peak, %lu pooled\n", (unsigned long)serv->pool.accepted(),
+        (unsigned long)serv->pool.highWater(), (unsigned long)serv->pool.capacity());
+    printf("Output: %lu bytes buffered, %lu peak, %lu pauses, %lu shed\n", (unsigned long)serv->budget.buffered(),
+        (unsigned long)serv->budget.peak(), (unsigned long)serv->budget.pauses(),
+        (unsigned long)serv->budget.sheds());
+    if (serv->group.valid())
     {
-        evbuf.own(false);
-        evbuf.enable(EV_READ | EV_WRITE);
+        EvRateLimitGroup::Stats st;
+        serv->group.stats(st);
+        printf("Rate group: %lu bytes written, %ld write tokens left\n", (unsigned long)st.writtenBytes,
+            (long)st.writeLimit);
     }
+}
+
+static
+void onServThreadInit(EvLoopThread* thread, void* arg)
+{
+    IpAddr* sin = (IpAddr*)arg;
+    EchoServer* serv = new EchoServer();
+    int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT;
 
-    evlis.setTcpNoDelay(fd);
+    startEchoServer(serv, *sin, thread->loop(), flags);
+    thread->setUserData(serv);
 }
 
-void testServer(const char* arg)
+static
+void onServThreadExit(EvLoopThread* thread, void* arg)
+{
+    EchoServer* serv = (EchoServer*)thread->userData();
+    printEchoStats(serv);
+    delete serv;
+}
+
+void testServer(const char* arg, int threads)
 {
     EvBaseLoop base;
-    EvConnListener listener;
+    EchoServer serv;
+    EvServerGroup group;
     IpAddr sin(arg ? arg : "127.0.0.1:60");
 
     printf("Server listening on %s\n", sin.toString().c_str());
@@ -73,10 +155,26 @@ void testServer(const char* arg)
     evstop.newSignal(onCtrlC, SIGHUP, base);
     evstop.start();
 
-    listener.newListener(sin, onAccept, NULL, base);
+    if (threads > 1)
+    {
+        // One loop and one SO_REUSEPORT listener per thread; this loop only waits for signals
+        printf("Starting %d loop threads\n", threads);
+        group.start(threads, onServThreadInit, onServThreadExit, &sin, true);
+    }
+    else
+    {
+        startEchoServer(&serv, sin, base, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE);
+    }
 
     base.loop();
 
+    group.stop();
+    group.join();
+
+    if (threads <= 1)
+    {
+        printEchoStats(&serv);
+    }
 }
 
 
@@ -164,26 +262,50 @@ void testClient(const char* arg)
 int main(int argc, char** argv)
 {
     int opt = 0;
-    bool showhelp = true;
-    while ((opt = getopt(argc, argv, "cs")) != -1)
+    bool client = false;
+    bool server = false;
+    int threads = 1;
+    while ((opt = getopt(argc, argv, "cst:r:g:")) != -1)
     {
         switch (opt)
         {
             case 'c':
-                testClient(NULL);
-                showhelp = false;
+                client = true;
                 break;
             case 's':
-                testServer(NULL);
-                showhelp = false;
+                server = true;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0)
+                {
+                    threads = EvLoopThread::cpuCount();
+                }
+                break;
+            case 'r':
+                gConnRate = (size_t)atol(optarg) * 1024;
+                break;
+            case 'g':
+                gLoopRate = (size_t)atol(optarg) * 1024;
                 break;
         }
     }
-    if (showhelp)
+    if (server)
+    {
+        testServer(NULL, threads);
+    }
+    else if (client)
+    {
+        testClient(NULL);
+    }
+    else
     {
         printf("sockcliserv OPTION\n");
-        printf("   -s   start server\n");
-        printf("   -c   start client\n");
+        printf("   -s     start server\n");
+        printf("   -t N   server loop threads (0 = one per cpu)\n");
+        printf("   -r KB  cap each connection's echo at KB/s\n");
+        printf("   -g KB  cap each server loop's echo at KB/s (shared by its connections)\n");
+        printf("   -c     start client\n");
     }
 
     return 0;
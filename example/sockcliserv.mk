@@ -1,7 +1,7 @@
 TYPE = exe
 SOURCES = sockcliserv.cpp
 INCLUDES = -I. -I/usr/local/include -I../include
-INSLIBS = -L/usr/lib/x86_64-linux-gnu -levent -lrt
+INSLIBS = -L/usr/lib/x86_64-linux-gnu -levent -levent_pthreads -lpthread -lrt
 OUT = sockcliserv
 
 #-----------------------------------------------------------------
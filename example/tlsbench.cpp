@@ -0,0 +1,405 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#include <getopt.h>
+#include <time.h>
+#include <vector>
+#include "lev.h"
+#include "levhttp.h"
+#include "levthread.h"
+#include "levtls.h"
+
+using namespace lev;
+
+//
+// HTTPS benchmark.  By default every connection makes one request and closes, so the rate is
+// TLS handshakes per second, resumed from the previous session unless -R.  With -b each
+// connection stays open and fetches N byte bodies back to back, measuring bytes/s through
+// TLS.  An in-process EvHttpServer with a self-signed P-256 certificate runs on its own loop
+// threads unless -a names an external one.
+//
+
+struct BenchConfig
+{
+    IpAddr addr;
+    int conns;
+    int secs;
+    int warmup;
+    int bytes;                          // 0: handshake mode
+    bool resume;
+    bool tickets;
+    int serverThreads;
+};
+
+static BenchConfig gConf;
+static EvTlsContext gServerTls;
+static std::vector<char> gBlock;
+
+static
+double nowSecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//
+// Server
+//
+
+static
+void onHello(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    static const char hello[] = "<html><body>Hello from lev over TLS</body></html>";
+    EvHttpRequest evreq(req);
+    evreq.output().addReference(hello, sizeof(hello) - 1, NULL, NULL);
+    evreq.sendReply(200, "OK");
+}
+
+static
+void onBytes(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+{
+    // /bytes/:n, referenced from a shared block
+    EvHttpRequest evreq(req);
+    long left = atol(params.find("n").str().c_str());
+    EvBuffer out = evreq.output();
+    while (left > 0)
+    {
+        size_t n = ((size_t)left < gBlock.size()) ? (size_t)left : gBlock.size();
+        out.addReference(&gBlock[0], n, NULL, NULL);
+        left -= n;
+    }
+    evreq.sendReply(200, "OK");
+}
+
+static
+void onServThreadInit(EvLoopThread* thread, void* arg)
+{
+    EvHttpRouter* router = (EvHttpRouter*)arg;
+    EvHttpServer* http = new EvHttpServer(thread->loop());
+    http->setTls(gServerTls);
+    router->attach(*http);
+    if (!http->bindReusePort(gConf.addr))
+    {
+        printf("Error: Failed to listen on %s\n", gConf.addr.toStringFull().c_str());
+    }
+    thread->setUserData(http);
+}
+
+static
+void onServThreadExit(EvLoopThread* thread, void* arg)
+{
+    delete (EvHttpServer*)thread->userData();
+}
+
+//
+// Client
+//
+
+struct ClientBench
+{
+    ClientBench(EvBaseLoop& b) :
+        base(b),
+        recordFrom(0.0),
+        handshakes(0),
+        resumed(0),
+        requests(0),
+        bytes(0),
+        errors(0)
+    {
+    }
+    EvBaseLoop& base;
+    EvTlsContext tls;
+    std::string request;
+    double recordFrom;
+    uint64_t handshakes;
+    uint64_t resumed;
+    uint64_t requests;
+    uint64_t bytes;
+    uint64_t errors;
+    EvHistogram handshakeUsecs;
+};
+
+struct Conn
+{
+    ClientBench* cb;
+    EvBufferEvent bev;
+    double start;
+    bool inBody;
+    size_t want;
+};
+
+static void startConn(Conn* c);
+
+static inline
+bool recording(ClientBench* cb)
+{
+    return cb->recordFrom > 0.0 && nowSecs() >= cb->recordFrom;
+}
+
+static
+void sendRequest(Conn* c)
+{
+    c->inBody = false;
+    c->want = 0;
+    c->bev.output().append(c->cb->request.data(), c->cb->request.size());
+}
+
+static
+void onConnRead(struct bufferevent* bev, void* arg)
+{
+    Conn* c = (Conn*)arg;
+    EvBuffer in = c->bev.input();
+    for (;;)
+    {
+        if (!c->inBody)
+        {
+            ssize_t end = in.find("\r\n\r\n", 4);
+            if (end < 0)
+            {
+                return;
+            }
+            size_t hdrlen = (size_t)end + 4;
+            char* hdrs = (char*)evbuffer_pullup(in.ptr(), hdrlen);
+            const char* cl = NULL;
+            for (size_t i = 0; i + 15 < hdrlen && cl == NULL; i++)
+            {
+                if (evutil_ascii_strncasecmp(hdrs + i, "\r\nContent-Length:", 17) == 0)
+                {
+                    cl = hdrs + i + 17;
+                }
+            }
+            c->want = cl ? strtoul(cl, NULL, 10) : 0;
+            c->inBody = true;
+            in.drain(hdrlen);
+        }
+
+        size_t n = (in.length() < c->want) ? in.length() : c->want;
+        in.drain(n);
+        c->want -= n;
+        if (recording(c->cb))
+        {
+            c->cb->bytes += n;
+        }
+        if (c->want > 0)
+        {
+            return;
+        }
+
+        if (recording(c->cb))
+        {
+            c->cb->requests++;
+        }
+        if (gConf.bytes == 0)
+        {
+            // Handshake mode: next connection
+            startConn(c);
+            return;
+        }
+        sendRequest(c);
+    }
+}
+
+static
+void onConnEvent(struct bufferevent* bev, short events, void* arg)
+{
+    Conn* c = (Conn*)arg;
+    if (events & BEV_EVENT_CONNECTED)
+    {
+        if (recording(c->cb))
+        {
+            c->cb->handshakes++;
+            c->cb->resumed += EvTlsContext::isResumed(bev) ? 1 : 0;
+            c->cb->handshakeUsecs.record((uint64_t)((nowSecs() - c->start) * 1e6));
+        }
+        sendRequest(c);
+        return;
+    }
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF))
+    {
+        if (recording(c->cb))
+        {
+            c->cb->errors++;
+        }
+        startConn(c);
+    }
+}
+
+static
+void startConn(Conn* c)
+{
+    c->start = nowSecs();
+    if (c->bev.ptr())
+    {
+        EvTlsContext::shutdown(c->bev.ptr());
+    }
+    if (!c->bev.newForTlsSocket(-1, c->cb->tls, false, onConnRead, NULL, onConnEvent, c, c->cb->base,
+        "localhost") || !c->bev.connect(gConf.addr))
+    {
+        c->cb->errors++;
+        return;
+    }
+    c->bev.setTcpNoDelay();
+    c->bev.enable(EV_READ | EV_WRITE);
+}
+
+static
+void onBenchDone(evutil_socket_t fd, short what, void* arg)
+{
+    ((EvEvent*)arg)->exitLoop();
+}
+
+static
+void runBench()
+{
+    EvHttpRouter router;
+    EvServerGroup servers;
+
+    router.add(EVHTTP_REQ_GET, "/hello", onHello);
+    router.add(EVHTTP_REQ_GET, "/bytes/:n", onBytes);
+    gBlock.assign(1024 * 1024, 'x');
+
+    if (gConf.serverThreads > 0)
+    {
+        if (!gServerTls.newServer() || !gServerTls.useSelfSigned("localhost"))
+        {
+            printf("Error: Failed to set up the server TLS context\n");
+            return;
+        }
+        gServerTls.setTickets(gConf.tickets);
+        if (!servers.start(gConf.serverThreads, onServThreadInit, onServThreadExit, &router))
+        {
+            printf("Error: Failed to start server threads\n");
+            return;
+        }
+    }
+
+    EvBaseLoop base;
+    ClientBench cb(base);
+    cb.tls.newClient();
+    cb.tls.setResumption(gConf.resume);
+    char req[256];
+    if (gConf.bytes > 0)
+    {
+        snprintf(req, sizeof(req), "GET /bytes/%d HTTP/1.1\r\nHost: localhost\r\n\r\n", gConf.bytes);
+    }
+    else
+    {
+        snprintf(req, sizeof(req), "GET /hello HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n");
+    }
+    cb.request = req;
+
+    std::vector<Conn*> conns;
+    for (int i = 0; i < gConf.conns; i++)
+    {
+        Conn* c = new Conn();
+        c->cb = &cb;
+        conns.push_back(c);
+        startConn(c);
+    }
+
+    EvEvent done;
+    done.newTimer(onBenchDone, base);
+    done.start((gConf.warmup + gConf.secs) * 1000);
+    double start = nowSecs();
+    cb.recordFrom = start + gConf.warmup;
+    base.loop();
+    double elapsed = nowSecs() - cb.recordFrom;
+
+    for (size_t i = 0; i < conns.size(); i++)
+    {
+        delete conns[i];
+    }
+    servers.stop();
+    servers.join();
+
+    printf("tlsbench %s: %d conns, %s, resumption %s, tickets %s, %.1fs\n", gConf.addr.toStringFull().c_str(),
+        gConf.conns, gConf.bytes ? "keep-alive" : "one request per connection", gConf.resume ? "on" : "off",
+        gConf.tickets ? "on" : "off", elapsed);
+    printf("%12s %10s %9s %9s %9s %9s %12s\n", "handshakes/s", "resumed", "hs mean", "hs p50", "hs p99",
+        "req/s", "MB/s");
+    printf("%12.0f %9.1f%% %7.0fus %7luus %7luus %9.0f %12.1f\n", cb.handshakes / elapsed,
+        cb.handshakes ? 100.0 * cb.resumed / cb.handshakes : 0.0, cb.handshakeUsecs.mean(),
+        (unsigned long)cb.handshakeUsecs.percentile(50), (unsigned long)cb.handshakeUsecs.percentile(99),
+        cb.requests / elapsed, cb.bytes / elapsed / 1e6);
+    if (gConf.serverThreads > 0)
+    {
+        printf("server: %ld handshakes, %ld resumed\n", gServerTls.handshakes(), gServerTls.resumed());
+    }
+    printf("%lu errors\n", (unsigned long)cb.errors);
+}
+
+
+int main(int argc, char** argv)
+{
+    int opt = 0;
+    const char* addr = NULL;
+
+    gConf.conns = 16;
+    gConf.secs = 5;
+    gConf.warmup = 1;
+    gConf.bytes = 0;
+    gConf.resume = true;
+    gConf.tickets = true;
+    gConf.serverThreads = 1;
+
+    while ((opt = getopt(argc, argv, "a:c:d:w:b:RST:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'a':
+                addr = optarg;
+                gConf.serverThreads = 0;
+                break;
+            case 'c':
+                gConf.conns = atoi(optarg);
+                break;
+            case 'd':
+                gConf.secs = atoi(optarg);
+                break;
+            case 'w':
+                gConf.warmup = atoi(optarg);
+                break;
+            case 'b':
+                gConf.bytes = atoi(optarg);
+                break;
+            case 'R':
+                gConf.resume = false;
+                break;
+            case 'S':
+                gConf.tickets = false;
+                break;
+            case 'T':
+                gConf.serverThreads = atoi(optarg);
+                break;
+            default:
+                printf("tlsbench [-a host:port] [-c conns] [-d secs] [-w secs] [-b bytes] [-R] [-S] [-T N]\n");
+                printf("   -a     benchmark an external HTTPS server instead of an in-process one\n");
+                printf("   -c N   concurrent connections (16)\n");
+                printf("   -d N   measured seconds (5)\n");
+                printf("   -w N   warmup seconds before measuring (1)\n");
+                printf("   -b N   keep-alive, GET /bytes/N repeatedly: TLS bytes/s (default one request per\n");
+                printf("          connection: handshakes/s)\n");
+                printf("   -R     no session resumption, every handshake is a full one\n");
+                printf("   -S     in-process server without session tickets (session cache only)\n");
+                printf("   -T N   in-process server loop threads (1)\n");
+                return 1;
+        }
+    }
+    if (gConf.conns <= 0 || gConf.secs <= 0 || gConf.bytes < 0)
+    {
+        printf("Error: counts must be positive\n");
+        return 1;
+    }
+    if (gConf.warmup < 0)
+    {
+        gConf.warmup = 0;
+    }
+
+    gConf.addr.assign(addr ? addr : "127.0.0.1:8443");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    runBench();
+    return 0;
+}
@@ -0,0 +1,9 @@
+TYPE = exe
+SOURCES = tlsbench.cpp
+INCLUDES = -I. -I/usr/local/include -I../include
+INSLIBS = -L/usr/lib/x86_64-linux-gnu -levent_openssl -levent -levent_pthreads -lpthread -lrt -lssl -lcrypto
+OUT = tlsbench
+
+#-----------------------------------------------------------------
+include ../build.mk
+
@@ -11,8 +11,18 @@
 #include <memory.h>
 #include <netinet/tcp.h>
 #include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
 
 #include <string>
+#include <atomic>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include <event2/event-config.h>
 #include <event2/event.h>
@@ -22,6 +32,7 @@
 #include <event2/buffer.h>
 #include <event2/bufferevent.h>
 #include <event2/http.h>
+#include <event2/thread.h>
 
 #ifndef dbgerr
     #define dbgerr(fmt, ...) \
@@ -37,13 +48,25 @@ namespace lev
 {
 
 class IpAddr;
+class EvMem;
+class EvStrView;
+class EvTask;
+class EvTaskQueue;
 class EvBaseLoop;
 class EvEvent;
+class EvCounter;
 class EvKeyValues;
+class EvFileSegment;
 class EvBuffer;
+class EvBufferView;
+class EvRateLimit;
 class EvBufferEvent;
+class EvTlsContext;
+class EvRateLimitGroup;
 class EvConnListener;
 class EvHttpUri;
+class EvUriView;
+class EvQueryView;
 
 
 class IpAddr
@@ -156,6 +179,105 @@ protected:
 };
 
 
+class EvMem
+{
+public:
+    // Frees memory allocated by libevent and handed to the caller (ie evhttp_encode_uri,
+    // evbuffer_readln).  Once a custom allocator is installed with event_set_mem_functions()
+    // such memory must not go to ::free().
+
+    static inline
+    void free(void* ptr)
+    {
+        freeFn()(ptr);
+    }
+
+    static
+    void setFree(void (*fn)(void*))
+    {
+        // Called by whoever installs the libevent memory functions (ie EvArena::install)
+        freeFn() = fn ? fn : ::free;
+    }
+
+protected:
+    typedef void (*FreeFn)(void*);
+
+    static inline
+    FreeFn& freeFn()
+    {
+        static FreeFn fn = ::free;
+        return fn;
+    }
+};
+
+
+class EvStrView
+{
+public:
+    // Non-owning pointer and length into someone else's string (ie a request's URI).  Not
+    // necessarily NUL terminated; only valid as long as the underlying string is.
+
+    EvStrView() :
+        mPtr(NULL),
+        mLen(0)
+    {
+    }
+    EvStrView(const char* ptr, size_t len) :
+        mPtr(ptr),
+        mLen(len)
+    {
+    }
+    EvStrView(const char* str) :
+        mPtr(str),
+        mLen(str ? strlen(str) : 0)
+    {
+    }
+
+    inline const char* data() const
+    {
+        return mPtr;
+    }
+    inline size_t length() const
+    {
+        return mLen;
+    }
+    inline bool empty() const
+    {
+        return mLen == 0;
+    }
+    inline bool valid() const
+    {
+        return mPtr != NULL;
+    }
+    inline char operator[](size_t i) const
+    {
+        return mPtr[i];
+    }
+
+    inline bool equals(const char* str, size_t len) const
+    {
+        return (mLen == len) && (memcmp(mPtr, str, len) == 0);
+    }
+    inline bool equals(const char* str) const
+    {
+        return equals(str, strlen(str));
+    }
+    inline bool equalsNoCase(const char* str, size_t len) const
+    {
+        return (mLen == len) && (evutil_ascii_strncasecmp(mPtr, str, len) == 0);
+    }
+
+    inline std::string str() const
+    {
+        return std::string(mPtr ? mPtr : "", mLen);
+    }
+
+protected:
+    const char* mPtr;
+    size_t mLen;
+};
+
+
 class EvEvent
 {
 public:
@@ -222,6 +344,11 @@ public:
         timeval t = EvEvent::tvMsecs(msecs);
         event_add(mPtr, &t);
     }
+    inline void start(const struct timeval* tv)
+    {
+        // tv may come from EvBaseLoop::commonTimeout()
+        event_add(mPtr, tv);
+    }
     inline void end()
     {
         event_del(mPtr);
@@ -336,246 +463,1231 @@ public:
         return evbuffer_add_buffer(mPtr, src.mPtr) == 0;
     }
 
-    inline struct evbuffer* ptr()
-    {
-        return mPtr;
-    }
-
-protected:
-    struct evbuffer* mPtr;
-    bool mOwner;
-};
+    // Zero-copy writes
 
-
-class EvBufferEvent
-{
-public:
-    EvBufferEvent() :
-        mPtr(NULL),
-        mOwner(false)
-    {
-    }
-    EvBufferEvent(struct bufferevent* ptr) :
-        mPtr(ptr),
-        mOwner(false)
+    inline int reserve(size_t size, struct evbuffer_iovec* vec, int nvecs)
     {
+        // Reserves at least 'size' bytes at the end of the buffer, returned as up to 'nvecs'
+        // extents (returns the number used, or -1).  Write directly into the extents, set each
+        // iov_len to the bytes actually written, then commit().  The buffer must not be
+        // modified in between.
+        return evbuffer_reserve_space(mPtr, size, vec, nvecs);
     }
-    ~EvBufferEvent()
+    inline bool commit(struct evbuffer_iovec* vec, int nvecs)
     {
-        free();
+        return evbuffer_commit_space(mPtr, vec, nvecs) == 0;
     }
-    void free()
+    inline void* reserve(size_t size, struct evbuffer_iovec& vec)
     {
-        if (mOwner && mPtr)
+        // Single contiguous extent of at least 'size' bytes (NULL on failure)
+        if (evbuffer_reserve_space(mPtr, size, &vec, 1) != 1)
         {
-            bufferevent_free(mPtr);
+            return NULL;
         }
-        mOwner = false;
-        mPtr = NULL;
+        return vec.iov_base;
     }
-
-    bool newForSocket(int fd, bufferevent_data_cb readcb, bufferevent_data_cb writecb,
-        bufferevent_event_cb eventcb, void* cbarg, struct event_base* base)
+    inline bool commit(struct evbuffer_iovec& vec, size_t used)
     {
-        // fd can be -1 if you connect later
-
-        // typedef void (*bufferevent_data_cb)(struct bufferevent *bev, void *cbarg);
-        // typedef void (*bufferevent_event_cb)(struct bufferevent *bev,short events, void *cbarg);
-
-        free();
-
-        struct bufferevent* be;
-        int flags = /*BEV_OPT_THREADSAFE |*/ BEV_OPT_CLOSE_ON_FREE;
-
-        // Create a new socket buffer event
-        be = bufferevent_socket_new(base, fd, flags);
-        if (be == NULL)
-        {
-            dbgerr("Failed to create libevent buffer event\n");
-            return false;
-        }
-
-        bufferevent_setcb(be, readcb, writecb, eventcb, cbarg);
-
-        // Assign the pointer to the object
-        mPtr = be;
-        mOwner = true;
-
-        return true;
+        vec.iov_len = used;
+        return evbuffer_commit_space(mPtr, &vec, 1) == 0;
     }
 
-    inline void own(bool objowns)
+    inline bool addReference(const void* data, size_t datalen, evbuffer_ref_cleanup_cb cleanup, void* arg)
     {
-        mOwner = objowns;
+        // Appends caller owned memory without copying.  The memory must stay valid and unchanged
+        // until cleanup(data, datalen, arg) is called, once the last byte has been drained or
+        // the buffer freed.  'cleanup' may be NULL for static data.
+        return evbuffer_add_reference(mPtr, data, datalen, cleanup, arg) == 0;
     }
 
-    bool connect(const IpAddr& sa)
+    inline bool addFile(int fd, off_t offset, off_t length)
     {
-        int ret = bufferevent_socket_connect(mPtr, (sockaddr*)sa.addr(), sa.addrLen());
-
-        return (ret == 0);
+        // Appends a range of the file; the buffer takes ownership of fd and closes it.  If this
+        // buffer drains to an fd (a socket bufferevent's output, or EVBUFFER_FLAG_DRAINS_TO_FD)
+        // writes use sendfile() where available, so the data never enters user space;
+        // otherwise the file is mmapped or read in.
+        return evbuffer_add_file(mPtr, fd, offset, length) == 0;
     }
+    bool addFileSegment(EvFileSegment& seg, off_t offset = 0, off_t length = -1);
 
-    inline EvBuffer input()
+    // Zero-copy reads
+
+    inline int peek(ssize_t len, struct evbuffer_iovec* vec, int nvecs)
     {
-        return EvBuffer(bufferevent_get_input(mPtr));
+        // Fills up to 'nvecs' extents pointing at the first 'len' bytes (-1 for all) without
+        // copying or linearising.  With len >= 0, returns the number of extents needed, which
+        // may be more than nvecs; with -1 it stops at nvecs and returns the number filled.
+        return evbuffer_peek(mPtr, len, NULL, vec, nvecs);
     }
-    inline EvBuffer output()
+    int peek(size_t offset, ssize_t len, struct evbuffer_iovec* vec, int nvecs)
     {
-        return EvBuffer(bufferevent_get_output(mPtr));
+        // Same, starting 'offset' bytes into the buffer
+        struct evbuffer_ptr start;
+        if (evbuffer_ptr_set(mPtr, &start, offset, EVBUFFER_PTR_SET) != 0)
+        {
+            return 0;
+        }
+        return evbuffer_peek(mPtr, len, &start, vec, nvecs);
     }
-
-    inline void enable(short flags)
+    inline bool drain(size_t len)
     {
-        bufferevent_enable(mPtr, flags);
+        // Consumes 'len' bytes from the front (ie what a parser has finished with)
+        return evbuffer_drain(mPtr, len) == 0;
     }
-    inline void disable(short flags)
+    inline int copyOut(void* data, size_t datalen)
     {
-        bufferevent_disable(mPtr, flags);
+        return evbuffer_copyout(mPtr, data, datalen);
     }
+    ssize_t find(const char* delim, size_t delimlen);
 
-    void setTcpNoDelay()
+    inline struct evbuffer* ptr()
     {
-        int one = 1;
-        setsockopt(bufferevent_getfd(mPtr), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        return mPtr;
     }
 
 protected:
-    struct bufferevent* mPtr;
+    struct evbuffer* mPtr;
     bool mOwner;
 };
 
-class EvConnListener
+
+class EvFileSegment
 {
 public:
-    EvConnListener() :
-        mPtr(NULL),
-        mOwner(false)
+    // Reference counted open file range that can be attached to any number of buffers (ie one
+    // per response) without reopening or rereading the file.
+
+    EvFileSegment() :
+        mSeg(NULL)
     {
     }
-    EvConnListener(struct evconnlistener* ptr) :
-        mPtr(ptr),
-        mOwner(false)
+    ~EvFileSegment()
     {
+        free();
     }
-    ~EvConnListener()
+
+    bool newSegment(int fd, off_t offset = 0, off_t length = -1, unsigned flags = EVBUF_FS_CLOSE_ON_FREE)
     {
+        // flags: EVBUF_FS_CLOSE_ON_FREE, EVBUF_FS_DISABLE_MMAP, EVBUF_FS_DISABLE_SENDFILE,
+        //        EVBUF_FS_DISABLE_LOCKING
         free();
+        mSeg = evbuffer_file_segment_new(fd, offset, length, flags);
+        if (mSeg == NULL)
+        {
+            dbgerr("Failed to create file segment for fd %d\n", fd);
+            return false;
+        }
+        return true;
     }
     void free()
     {
-        if (mOwner && mPtr)
+        // Drops our reference; buffers still holding the segment keep it (and the fd) alive
+        if (mSeg)
         {
-            evconnlistener_free(mPtr);
+            evbuffer_file_segment_free(mSeg);
         }
-        mOwner = false;
-        mPtr = NULL;
+        mSeg = NULL;
     }
-    void assign(struct evconnlistener* ptr)
+
+    inline bool valid() const
     {
-        free();
-        mPtr = ptr;
+        return mSeg != NULL;
     }
-    void newListener(const IpAddr& sa, evconnlistener_cb callback, void* cbarg, struct event_base* base)
+    inline struct evbuffer_file_segment* ptr()
     {
-        //dbglog("Listening on %s\n", sa.toString().c_str());
+        return mSeg;
+    }
 
-        free();
+protected:
+    struct evbuffer_file_segment* mSeg;
 
-        int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE;
-        int backlog = -1;  //TODO: expose
+private:
+    EvFileSegment(const EvFileSegment&);
+    EvFileSegment& operator=(const EvFileSegment&);
+};
 
-        mPtr = evconnlistener_new_bind(base, callback, cbarg, flags, backlog, sa.addr(), sa.addrLen());
-        mOwner = true;
-    }
+inline bool EvBuffer::addFileSegment(EvFileSegment& seg, off_t offset, off_t length)
+{
+    // Appends part of a shared segment (length -1 means through the end of the segment).  As
+    // addFile(), sendfile() is only used when this buffer drains to an fd.
+    return evbuffer_add_file_segment(mPtr, seg.ptr(), offset, length) == 0;
+}
 
-    inline void enable()
+
+class EvBufferView
+{
+public:
+    // Read-only iovec view over the chains of an EvBuffer.  The view is invalidated by any change
+    // to the buffer, so parse, then drain() what was consumed.
+    //
+    //      EvBufferView view(evbuf.input());
+    //      ssize_t pos;
+    //      while ((pos = view.find("\r\n", 2, off)) >= 0) { ...; off = pos + 2; }
+    //      evbuf.input().drain(off);
+
+    EvBufferView() :
+        mVec(mInline),
+        mCount(0),
+        mLength(0)
     {
-        evconnlistener_enable(mPtr);
     }
-    inline void disable()
+    EvBufferView(const EvBuffer& buf, ssize_t len = -1) :
+        mVec(mInline),
+        mCount(0),
+        mLength(0)
     {
-        evconnlistener_disable(mPtr);
+        assign(buf, len);
     }
-    inline struct event_base* base()
+
+    EvBufferView(const EvBuffer& buf, size_t offset, ssize_t len) :
+        mVec(mInline),
+        mCount(0),
+        mLength(0)
     {
-        return evconnlistener_get_base(mPtr);
+        assign(buf, offset, len);
     }
-    void setTcpNoDelay(int fd)
+
+    inline size_t assign(const EvBuffer& src, ssize_t len = -1)
     {
-        int one = 1;
-        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        // Views the first 'len' bytes (-1 for all); returns the length viewed
+        return assign(src, 0, len);
     }
 
-protected:
-    struct evconnlistener* mPtr;
-    bool mOwner;
-};
-
-
-class EvBaseLoop
-{
-public:
-    EvBaseLoop()
+    size_t assign(const EvBuffer& src, size_t offset, ssize_t len)
     {
-        mBase = event_base_new();
-        if (!mBase)
+        // Views 'len' bytes (-1 for all) starting at 'offset'
+        EvBuffer& buf = const_cast<EvBuffer&>(src);
+        if (len < 0)
         {
-            dbgerr("Failed to get libevent base\n");
+            // evbuffer_peek(-1) stops at MaxInline extents; an explicit length reports them all
+            size_t total = buf.length();
+            len = offset < total ? total - offset : 0;
         }
-    }
-    ~EvBaseLoop()
-    {
-        if (mBase)
+        mVec = mInline;
+        mCount = buf.peek(offset, len, mInline, MaxInline);
+        if (mCount > MaxInline)
         {
-            event_base_free(mBase);
+            mMore.resize(mCount);
+            mCount = buf.peek(offset, len, &mMore[0], mCount);
+            mVec = &mMore[0];
+        }
+        if (mCount < 0)
+        {
+            mCount = 0;
         }
+
+        mLength = 0;
+        for (int i = 0; i < mCount; i++)
+        {
+            mLength += mVec[i].iov_len;
+        }
+        if (len >= 0 && mLength > (size_t)len)
+        {
+            // evbuffer_peek returns whole chains; trim the last one
+            mVec[mCount - 1].iov_len -= mLength - len;
+            mLength = len;
+        }
+        return mLength;
     }
 
-    inline operator struct event_base*()
+    inline int count() const
     {
-        return mBase;
+        return mCount;
     }
-
-    inline struct event_base* base()
+    inline const char* data(int i) const
     {
-        return mBase;
+        return (const char*)mVec[i].iov_base;
     }
-
-    inline void incLoopRef()
+    inline size_t len(int i) const
     {
-        event_base_add_virtual(mBase);
+        return mVec[i].iov_len;
     }
-
-    void loop(int flags = 0)
+    inline size_t length() const
     {
-        // EVLOOP_ONCE
-        // EVLOOP_NONBLOCK
-        // EVLOOP_NO_EXIT_ON_EMPTY
-
-        assert(mBase);
-        event_base_loop(mBase, flags);
+        return mLength;
     }
 
-    static
-    void enableDebug()
+    ssize_t find(const char* delim, size_t delimlen, size_t from = 0) const
     {
-        event_enable_debug_mode();
-    }
+        // Offset of the first 'delim' at or after 'from', or -1.  Walks the chains in place
+        // (delimiters may straddle two chains) using a SIMD scan for the first byte.
 
-protected:
-    struct event_base* mBase;
-};
+        if (delimlen == 0)
+        {
+            return -1;
+        }
 
+        size_t base = 0;
+        for (int i = 0; i < mCount; i++)
+        {
+            size_t n = mVec[i].iov_len;
+            if (from >= base + n)
+            {
+                base += n;
+                continue;
+            }
 
+            const char* start = data(i);
+            const char* p = start + (from > base ? from - base : 0);
+            const char* end = start + n;
+            while ((p = scanChar(p, end, delim[0])) != NULL)
+            {
+                if (matchAt(i, p - start, delim + 1, delimlen - 1))
+                {
+                    return base + (p - start);
+                }
+                p++;
+            }
+            base += n;
+        }
+        return -1;
+    }
 
-class EvKeyValues
-{
-public:
-    EvKeyValues() :
-        mHdrHead(NULL),
-        mHdrPtr(NULL),
-        mOwner(false)
+    size_t copyOut(size_t offset, void* dest, size_t destlen) const
+    {
+        // Copies up to destlen bytes starting at 'offset'; returns bytes copied
+        char* d = (char*)dest;
+        size_t copied = 0;
+        size_t base = 0;
+        for (int i = 0; i < mCount && copied < destlen; i++)
+        {
+            size_t n = mVec[i].iov_len;
+            if (offset < base + n)
+            {
+                size_t skip = (offset > base) ? offset - base : 0;
+                size_t c = n - skip;
+                if (c > destlen - copied)
+                {
+                    c = destlen - copied;
+                }
+                memcpy(d + copied, data(i) + skip, c);
+                copied += c;
+                offset += c;
+            }
+            base += n;
+        }
+        return copied;
+    }
+
+    static inline
+    const char* scanChar(const char* p, const char* end, char c)
+    {
+        // First occurrence of c in [p, end), or NULL
+#if defined(__AVX2__)
+        __m256i pat32 = _mm256_set1_epi8(c);
+        while (end - p >= 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat32));
+            if (m)
+            {
+                return p + __builtin_ctz(m);
+            }
+            p += 32;
+        }
+#endif
+#if defined(__SSE2__)
+        __m128i pat16 = _mm_set1_epi8(c);
+        while (end - p >= 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            unsigned m = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(v, pat16));
+            if (m)
+            {
+                return p + __builtin_ctz(m);
+            }
+            p += 16;
+        }
+#endif
+        while (p < end)
+        {
+            if (*p == c)
+            {
+                return p;
+            }
+            p++;
+        }
+        return NULL;
+    }
+
+protected:
+    enum { MaxInline = 16 };
+
+    struct evbuffer_iovec* mVec;
+    struct evbuffer_iovec mInline[MaxInline];
+    std::vector<struct evbuffer_iovec> mMore;
+    int mCount;
+    size_t mLength;
+
+    bool matchAt(int i, size_t pos, const char* rest, size_t restlen) const
+    {
+        // Compares 'rest' against the bytes following position pos of extent i
+        pos++;
+        while (restlen > 0)
+        {
+            while (pos >= mVec[i].iov_len)
+            {
+                pos -= mVec[i].iov_len;
+                if (++i >= mCount)
+                {
+                    return false;
+                }
+            }
+            size_t c = mVec[i].iov_len - pos;
+            if (c > restlen)
+            {
+                c = restlen;
+            }
+            if (memcmp(data(i) + pos, rest, c) != 0)
+            {
+                return false;
+            }
+            rest += c;
+            restlen -= c;
+            pos += c;
+        }
+        return true;
+    }
+
+private:
+    EvBufferView(const EvBufferView&);
+    EvBufferView& operator=(const EvBufferView&);
+};
+
+inline ssize_t EvBuffer::find(const char* delim, size_t delimlen)
+{
+    // Offset of the first 'delim' in the buffer or -1; see EvBufferView to scan repeatedly
+    EvBufferView view(*this);
+    return view.find(delim, delimlen);
+}
+
+
+class EvRateLimit
+{
+public:
+    // Token bucket configuration (bytes per second and burst, for reading and writing) for
+    // EvBufferEvent::setRateLimit() and EvRateLimitGroup.  Buckets refill every tick; shorter
+    // ticks are smoother but wake the loop more often.  A rate of 0 is unlimited.  Must outlive
+    // the bufferevents it is set on (groups keep their own copy).
+
+    EvRateLimit() :
+        mPtr(NULL)
+    {
+    }
+    ~EvRateLimit()
+    {
+        free();
+    }
+    void free()
+    {
+        if (mPtr)
+        {
+            ev_token_bucket_cfg_free(mPtr);
+        }
+        mPtr = NULL;
+    }
+
+    bool newLimit(size_t readbps, size_t readburst, size_t writebps, size_t writeburst, int tickmsecs = 100)
+    {
+        free();
+
+        if (tickmsecs <= 0)
+        {
+            tickmsecs = 100;
+        }
+        timeval tick = EvEvent::tvMsecs(tickmsecs);
+        size_t readrate = perTick(readbps, tickmsecs);
+        size_t writerate = perTick(writebps, tickmsecs);
+
+        // The burst is at least one tick's worth
+        mPtr = ev_token_bucket_cfg_new(readrate, burst(readburst, readrate), writerate,
+            burst(writeburst, writerate), &tick);
+        if (mPtr == NULL)
+        {
+            dbgerr("Failed to create libevent rate limit\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool valid() const
+    {
+        return mPtr != NULL;
+    }
+    inline struct ev_token_bucket_cfg* ptr() const
+    {
+        return mPtr;
+    }
+
+protected:
+    struct ev_token_bucket_cfg* mPtr;
+
+    static inline
+    size_t perTick(size_t bps, int tickmsecs)
+    {
+        if (bps == 0)
+        {
+            return EV_RATE_LIMIT_MAX;
+        }
+        uint64_t rate = (uint64_t)bps * tickmsecs / 1000;
+        if (rate == 0)
+        {
+            return 1;
+        }
+        return (rate < EV_RATE_LIMIT_MAX) ? (size_t)rate : EV_RATE_LIMIT_MAX;
+    }
+    static inline
+    size_t burst(size_t burst, size_t rate)
+    {
+        if (rate == EV_RATE_LIMIT_MAX)
+        {
+            return EV_RATE_LIMIT_MAX;
+        }
+        if (burst < rate)
+        {
+            return rate;
+        }
+        return (burst < EV_RATE_LIMIT_MAX) ? burst : EV_RATE_LIMIT_MAX;
+    }
+
+private:
+    EvRateLimit(const EvRateLimit&);
+    EvRateLimit& operator=(const EvRateLimit&);
+};
+
+
+class EvBufferEvent
+{
+public:
+    EvBufferEvent() :
+        mPtr(NULL),
+        mOwner(false)
+    {
+    }
+    EvBufferEvent(struct bufferevent* ptr) :
+        mPtr(ptr),
+        mOwner(false)
+    {
+    }
+    ~EvBufferEvent()
+    {
+        free();
+    }
+    void free()
+    {
+        if (mOwner && mPtr)
+        {
+            bufferevent_free(mPtr);
+        }
+        mOwner = false;
+        mPtr = NULL;
+    }
+
+    bool newForSocket(int fd, bufferevent_data_cb readcb, bufferevent_data_cb writecb,
+        bufferevent_event_cb eventcb, void* cbarg, struct event_base* base)
+    {
+        // fd can be -1 if you connect later
+
+        // typedef void (*bufferevent_data_cb)(struct bufferevent *bev, void *cbarg);
+        // typedef void (*bufferevent_event_cb)(struct bufferevent *bev,short events, void *cbarg);
+
+        free();
+
+        struct bufferevent* be;
+        int flags = /*BEV_OPT_THREADSAFE |*/ BEV_OPT_CLOSE_ON_FREE;
+
+        // Create a new socket buffer event
+        be = bufferevent_socket_new(base, fd, flags);
+        if (be == NULL)
+        {
+            dbgerr("Failed to create libevent buffer event\n");
+            return false;
+        }
+
+        bufferevent_setcb(be, readcb, writecb, eventcb, cbarg);
+
+        // Assign the pointer to the object
+        mPtr = be;
+        mOwner = true;
+
+        return true;
+    }
+    bool newForTlsSocket(int fd, EvTlsContext& tls, bool accepting, bufferevent_data_cb readcb,
+        bufferevent_data_cb writecb, bufferevent_event_cb eventcb, void* cbarg, struct event_base* base,
+        const char* peer = NULL);   // levtls.h
+
+    inline void own(bool objowns)
+    {
+        mOwner = objowns;
+    }
+    inline void replace(struct bufferevent* ptr)
+    {
+        // Refer to another bufferevent without freeing this one, which now sits under it (ie
+        // EvFilterStack) and is freed along with it.  Ownership carries over.
+        mPtr = ptr;
+    }
+
+    inline struct bufferevent* ptr()
+    {
+        return mPtr;
+    }
+
+    bool connect(const IpAddr& sa)
+    {
+        int ret = bufferevent_socket_connect(mPtr, (sockaddr*)sa.addr(), sa.addrLen());
+
+        return (ret == 0);
+    }
+
+    inline EvBuffer input()
+    {
+        return EvBuffer(bufferevent_get_input(mPtr));
+    }
+    inline EvBuffer output()
+    {
+        return EvBuffer(bufferevent_get_output(mPtr));
+    }
+
+    inline void enable(short flags)
+    {
+        bufferevent_enable(mPtr, flags);
+    }
+    inline void disable(short flags)
+    {
+        bufferevent_disable(mPtr, flags);
+    }
+
+    void setTcpNoDelay()
+    {
+        int one = 1;
+        setsockopt(bufferevent_getfd(mPtr), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    inline bool setRateLimit(const EvRateLimit& limit)
+    {
+        return bufferevent_set_rate_limit(mPtr, limit.ptr()) == 0;
+    }
+    inline void clearRateLimit()
+    {
+        bufferevent_set_rate_limit(mPtr, NULL);
+    }
+
+protected:
+    struct bufferevent* mPtr;
+    bool mOwner;
+};
+
+
+class EvRateLimitGroup
+{
+public:
+    // Shared token buckets for a set of bufferevents (ie every connection of a listener), on top
+    // of any per-connection limit.  libevent splits each tick's budget between the members in a
+    // rotating order, so thousands of connections get a fair share without a timer each.  One
+    // group per loop; free it after its members (a bufferevent leaves its group when freed).
+
+    struct Stats
+    {
+        uint64_t readBytes;         // Read by members since the last resetTotals()
+        uint64_t writtenBytes;
+        ssize_t readLimit;          // Tokens left in the buckets; 0 or less means throttling
+        ssize_t writeLimit;
+    };
+
+    EvRateLimitGroup() :
+        mPtr(NULL)
+    {
+    }
+    ~EvRateLimitGroup()
+    {
+        free();
+    }
+    void free()
+    {
+        if (mPtr)
+        {
+            bufferevent_rate_limit_group_free(mPtr);
+        }
+        mPtr = NULL;
+    }
+
+    bool newGroup(struct event_base* base, const EvRateLimit& limit)
+    {
+        free();
+        mPtr = bufferevent_rate_limit_group_new(base, limit.ptr());
+        if (mPtr == NULL)
+        {
+            dbgerr("Failed to create libevent rate limit group\n");
+            return false;
+        }
+        return true;
+    }
+
+    inline bool setLimit(const EvRateLimit& limit)
+    {
+        return bufferevent_rate_limit_group_set_cfg(mPtr, limit.ptr()) == 0;
+    }
+    inline void setMinShare(size_t bytes)
+    {
+        // Smallest slice a member gets per tick; larger means fewer, bigger writes (default 64)
+        bufferevent_rate_limit_group_set_min_share(mPtr, bytes);
+    }
+
+    inline bool add(EvBufferEvent& bev)
+    {
+        return bufferevent_add_to_rate_limit_group(bev.ptr(), mPtr) == 0;
+    }
+    inline void remove(EvBufferEvent& bev)
+    {
+        bufferevent_remove_from_rate_limit_group(bev.ptr());
+    }
+
+    void stats(Stats& st)
+    {
+        // libevent doesn't count throttled bytes; non-positive bucket levels show throttling
+        ev_uint64_t rd = 0;
+        ev_uint64_t wr = 0;
+        bufferevent_rate_limit_group_get_totals(mPtr, &rd, &wr);
+        st.readBytes = rd;
+        st.writtenBytes = wr;
+        st.readLimit = bufferevent_rate_limit_group_get_read_limit(mPtr);
+        st.writeLimit = bufferevent_rate_limit_group_get_write_limit(mPtr);
+    }
+    inline void resetTotals()
+    {
+        bufferevent_rate_limit_group_reset_totals(mPtr);
+    }
+
+    inline bool valid() const
+    {
+        return mPtr != NULL;
+    }
+    inline struct bufferevent_rate_limit_group* ptr()
+    {
+        return mPtr;
+    }
+
+protected:
+    struct bufferevent_rate_limit_group* mPtr;
+
+private:
+    EvRateLimitGroup(const EvRateLimitGroup&);
+    EvRateLimitGroup& operator=(const EvRateLimitGroup&);
+};
+
+class EvConnListener
+{
+public:
+    EvConnListener() :
+        mPtr(NULL),
+        mOwner(false)
+    {
+    }
+    EvConnListener(struct evconnlistener* ptr) :
+        mPtr(ptr),
+        mOwner(false)
+    {
+    }
+    ~EvConnListener()
+    {
+        free();
+    }
+    void free()
+    {
+        if (mOwner && mPtr)
+        {
+            evconnlistener_free(mPtr);
+        }
+        mOwner = false;
+        mPtr = NULL;
+    }
+    void assign(struct evconnlistener* ptr)
+    {
+        free();
+        mPtr = ptr;
+    }
+    inline void own(bool objowns)
+    {
+        mOwner = objowns;
+    }
+    bool newListener(const IpAddr& sa, evconnlistener_cb callback, void* cbarg, struct event_base* base,
+        int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, int backlog = -1)
+    {
+        // Add LEV_OPT_REUSEABLE_PORT to flags to let several listeners (one per loop thread) bind
+        // the same address; the kernel then load balances accepted connections between them.
+
+        //dbglog("Listening on %s\n", sa.toString().c_str());
+
+        free();
+
+        mPtr = evconnlistener_new_bind(base, callback, cbarg, flags, backlog, sa.addr(), sa.addrLen());
+        if (mPtr == NULL)
+        {
+            dbgerr("Failed to listen on %s\n", sa.toStringFull().c_str());
+            return false;
+        }
+        mOwner = true;
+        return true;
+    }
+
+    inline void enable()
+    {
+        evconnlistener_enable(mPtr);
+    }
+    inline void disable()
+    {
+        evconnlistener_disable(mPtr);
+    }
+    inline struct event_base* base()
+    {
+        return evconnlistener_get_base(mPtr);
+    }
+    inline struct evconnlistener* ptr()
+    {
+        return mPtr;
+    }
+    void setTcpNoDelay(int fd)
+    {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+protected:
+    struct evconnlistener* mPtr;
+    bool mOwner;
+};
+
+
+class EvTask
+{
+public:
+    // Unit of work posted to an EvBaseLoop from any thread.  The task is intrusive (the queue
+    // link lives in the object) so posting a preallocated task does not allocate.
+    EvTask() :
+        mNext(NULL)
+    {
+    }
+    virtual ~EvTask()
+    {
+    }
+
+    // Runs on the loop thread.  The task may delete itself.
+    virtual void run() = 0;
+
+    // Called instead of run() if the loop is freed while the task is still queued.
+    virtual void discard()
+    {
+    }
+
+protected:
+    std::atomic<EvTask*> mNext;
+
+    friend class EvTaskQueue;
+};
+
+template <class F>
+class EvFuncTask : public EvTask
+{
+public:
+    EvFuncTask(const F& fn) :
+        mFn(fn)
+    {
+    }
+    virtual void run()
+    {
+        mFn();
+        delete this;
+    }
+    virtual void discard()
+    {
+        delete this;
+    }
+
+protected:
+    F mFn;
+};
+
+class EvTaskQueue
+{
+public:
+    // Lock-free multi-producer single-consumer queue (Vyukov intrusive MPSC).  push() is wait-free
+    // and may be called from any thread; pop() must only be called by the consumer.
+
+    EvTaskQueue() :
+        mHead(&mStub),
+        mTail(&mStub)
+    {
+    }
+
+    void push(EvTask* task)
+    {
+        task->mNext.store(NULL, std::memory_order_relaxed);
+        EvTask* prev = mHead.exchange(task, std::memory_order_acq_rel);
+        prev->mNext.store(task, std::memory_order_release);
+    }
+
+    EvTask* pop()
+    {
+        // Returns NULL when empty, or when a producer is half way through a push (the producer's
+        // wakeup will bring the consumer back for it).
+        EvTask* tail = mTail;
+        EvTask* next = tail->mNext.load(std::memory_order_acquire);
+        if (tail == &mStub)
+        {
+            if (next == NULL)
+            {
+                return NULL;
+            }
+            mTail = next;
+            tail = next;
+            next = next->mNext.load(std::memory_order_acquire);
+        }
+        if (next)
+        {
+            mTail = next;
+            return tail;
+        }
+        if (tail != mHead.load(std::memory_order_acquire))
+        {
+            return NULL;
+        }
+        push(&mStub);
+        next = tail->mNext.load(std::memory_order_acquire);
+        if (next)
+        {
+            mTail = next;
+            return tail;
+        }
+        return NULL;
+    }
+
+protected:
+    class StubTask : public EvTask
+    {
+    public:
+        virtual void run()
+        {
+        }
+    };
+
+    std::atomic<EvTask*> mHead;
+    EvTask* mTail;
+    StubTask mStub;
+
+private:
+    EvTaskQueue(const EvTaskQueue&);
+    EvTaskQueue& operator=(const EvTaskQueue&);
+};
+
+
+class EvBaseLoop
+{
+public:
+    typedef void (*TaskCallback)(void* arg);
+
+    EvBaseLoop() :
+        mWakeFd(-1),
+        mWakeEv(NULL),
+        mWakePending(false)
+    {
+        mBase = event_base_new();
+        if (!mBase)
+        {
+            dbgerr("Failed to get libevent base\n");
+        }
+    }
+    ~EvBaseLoop()
+    {
+        if (mWakeEv)
+        {
+            event_free(mWakeEv);
+            close(mWakeFd);
+
+            EvTask* task;
+            while ((task = mTasks.pop()) != NULL)
+            {
+                task->discard();
+            }
+        }
+        if (mBase)
+        {
+            event_base_free(mBase);
+        }
+    }
+
+    inline operator struct event_base*()
+    {
+        return mBase;
+    }
+
+    inline struct event_base* base()
+    {
+        return mBase;
+    }
+
+    inline void incLoopRef()
+    {
+        event_base_add_virtual(mBase);
+    }
+
+    const struct timeval* commonTimeout(int msecs)
+    {
+        // Returns a timeval to pass to event_add()/EvEvent::start() for timeouts that all share
+        // this duration.  libevent keeps such events in a FIFO queue instead of its min-heap, so
+        // adding or re-adding one is O(1).  Use the same duration for many events (ie an idle
+        // timeout); each distinct duration costs a queue.
+        timeval t = EvEvent::tvMsecs(msecs);
+        return event_base_init_common_timeout(mBase, &t);
+    }
+
+    void loop(int flags = 0)
+    {
+        // EVLOOP_ONCE
+        // EVLOOP_NONBLOCK
+        // EVLOOP_NO_EXIT_ON_EMPTY
+
+        assert(mBase);
+        event_base_loop(mBase, flags);
+    }
+
+    inline void exitLoop()
+    {
+        event_base_loopexit(mBase, NULL);
+    }
+    inline void breakLoop()
+    {
+        event_base_loopbreak(mBase);
+    }
+
+    bool enableTasks()
+    {
+        // Enables post().  Call on the loop's thread before any other thread posts.  Producers
+        // push to a lock-free queue and wake the loop through an eventfd at most once per batch;
+        // each wakeup runs every task queued so far.  Does not need enableThreads().
+
+        if (mWakeEv)
+        {
+            return true;
+        }
+        mWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (mWakeFd < 0)
+        {
+            dbgerr("Failed to create eventfd\n");
+            return false;
+        }
+        mWakeEv = event_new(mBase, mWakeFd, EV_READ | EV_PERSIST, onWake, this);
+        event_add(mWakeEv, NULL);
+        return true;
+    }
+
+    void post(EvTask* task)
+    {
+        // Thread-safe.  Ownership of the task passes to the loop until run() or discard().
+        assert(mWakeEv);
+        mTasks.push(task);
+        if (!mWakePending.exchange(true, std::memory_order_acq_rel))
+        {
+            uint64_t one = 1;
+            if (write(mWakeFd, &one, sizeof(one)) < 0)
+            {
+                dbgerr("Failed to wake loop\n");
+            }
+        }
+    }
+    inline void post(TaskCallback callback, void* arg)
+    {
+        post(newTask(callback, arg));
+    }
+    template <class F>
+    inline typename std::enable_if<!std::is_convertible<F, EvTask*>::value>::type post(const F& fn)
+    {
+        // Any callable (ie lambda); allocates one small task object per post
+        post(static_cast<EvTask*>(new EvFuncTask<F>(fn)));
+    }
+
+    int runTasks()
+    {
+        // Runs all queued tasks on the calling (loop) thread; returns the number run
+        int count = 0;
+        EvTask* task;
+
+        mWakePending.exchange(false, std::memory_order_acq_rel);
+        while ((task = mTasks.pop()) != NULL)
+        {
+            task->run();
+            count++;
+        }
+        return count;
+    }
+
+    static
+    void enableDebug()
+    {
+        event_enable_debug_mode();
+    }
+
+    static
+    bool enableThreads()
+    {
+        // Must be called before any base is created if libevent objects are touched from other
+        // threads (ie exitLoop() called by a thread other than the one running the loop).  Not
+        // needed to hand work to a loop through post().  Needs -levent_pthreads.
+        return evthread_use_pthreads() == 0;
+    }
+
+protected:
+    struct event_base* mBase;
+    EvTaskQueue mTasks;
+    int mWakeFd;
+    struct event* mWakeEv;
+    std::atomic<bool> mWakePending;
+
+    static
+    void onWake(evutil_socket_t fd, short what, void* arg)
+    {
+        EvBaseLoop* self = (EvBaseLoop*)arg;
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) < 0)
+        {
+            // EAGAIN: another wakeup already consumed the counter
+        }
+        self->runTasks();
+    }
+
+    static
+    EvTask* newTask(TaskCallback callback, void* arg)
+    {
+        struct CallbackFn
+        {
+            TaskCallback cb;
+            void* arg;
+            void operator()() const
+            {
+                cb(arg);
+            }
+        };
+        CallbackFn fn = { callback, arg };
+        return new EvFuncTask<CallbackFn>(fn);
+    }
+
+private:
+    EvBaseLoop(const EvBaseLoop&);
+    EvBaseLoop& operator=(const EvBaseLoop&);
+};
+
+
+class EvCounter
+{
+public:
+    // Increments for std::atomic counters with a single writer (one thread, or writes under
+    // a lock), read from anywhere (ie stats).  A plain load/store instead of an atomic
+    // increment: no locked instruction on the hot path; readers may see a slightly stale
+    // value.
+
+    static inline
+    void inc(std::atomic<uint64_t>& c, uint64_t n = 1)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    static inline
+    void dec(std::atomic<uint64_t>& c)
+    {
+        c.store(c.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+    }
+
+private:
+    EvCounter();
+};
+
+
+template <class T>
+class EvLruList
+{
+public:
+    // Intrusive recency list for caches: T has 'T* prev' and 'T* next'.  The caller owns the
+    // entries and does the locking.
+
+    EvLruList() :
+        mHead(NULL),
+        mTail(NULL)
+    {
+    }
+
+    inline T* head() const
+    {
+        // Most recently used
+        return mHead;
+    }
+    inline T* tail() const
+    {
+        // Least recently used: the next to evict
+        return mTail;
+    }
+
+    void pushFront(T* e)
+    {
+        e->prev = NULL;
+        e->next = mHead;
+        if (mHead)
+        {
+            mHead->prev = e;
+        }
+        mHead = e;
+        if (mTail == NULL)
+        {
+            mTail = e;
+        }
+    }
+
+    void unlink(T* e)
+    {
+        if (e->prev)
+        {
+            e->prev->next = e->next;
+        }
+        else
+        {
+            mHead = e->next;
+        }
+        if (e->next)
+        {
+            e->next->prev = e->prev;
+        }
+        else
+        {
+            mTail = e->prev;
+        }
+        e->prev = NULL;
+        e->next = NULL;
+    }
+
+    inline void touch(T* e)
+    {
+        if (e != mHead)
+        {
+            unlink(e);
+            pushFront(e);
+        }
+    }
+
+protected:
+    T* mHead;
+    T* mTail;
+
+private:
+    EvLruList(const EvLruList&);
+    EvLruList& operator=(const EvLruList&);
+};
+
+
+
+class EvKeyValues
+{
+public:
+    EvKeyValues() :
+        mHdrHead(NULL),
+        mHdrPtr(NULL),
+        mOwner(false)
     {
     }
     EvKeyValues(struct evkeyvalq* headers) :
@@ -733,6 +1845,11 @@ public:
         }
         return s;
     }
+    inline const char* join(char* buf, size_t size)
+    {
+        // Into the caller's buffer; NULL if it doesn't fit
+        return evhttp_uri_join(mUri, buf, size);
+    }
 
     // Get values
 
@@ -802,6 +1919,423 @@ protected:
 };
 
 
+class EvUriView
+{
+public:
+    // Splits a URI into views of its components without copying or allocating, for the request
+    // path where EvHttpUri::newParsed() would allocate every part:
+    //
+    //      EvUriView u;
+    //      if (u.parse(evreq.uriStr()))
+    //      {
+    //          EvStrView path = u.path();
+    //          ...
+    //
+    // Handles origin-form ('/path?query#fragment', what servers mostly see), absolute URIs
+    // ('scheme://[userinfo@]host[:port]/path?query#fragment') and relative paths.  Components
+    // are not percent-decoded (see EvQueryView::decode()) and an absent one is an invalid
+    // (NULL) view.  Checks structure only, less strictly than evhttp_uri_parse().
+
+    EvUriView() :
+        mPort(-1)
+    {
+    }
+
+    bool parse(const char* uri)
+    {
+        return parse(uri, uri ? strlen(uri) : 0);
+    }
+
+    bool parse(const char* uri, size_t len)
+    {
+        mScheme = mUserInfo = mHost = mPath = mQuery = mFragment = EvStrView();
+        mPort = -1;
+        if (uri == NULL || len == 0)
+        {
+            return false;
+        }
+
+        const char* p = uri;
+        const char* end = uri + len;
+
+        // Scheme: ALPHA *( ALPHA / DIGIT / "+" / "-" / "." ) ":"
+        if (isAlpha(*p))
+        {
+            const char* s = p + 1;
+            while (s < end && (isAlpha(*s) || isDigit(*s) || *s == '+' || *s == '-' || *s == '.'))
+            {
+                s++;
+            }
+            if (s < end && *s == ':')
+            {
+                mScheme = EvStrView(p, s - p);
+                p = s + 1;
+            }
+        }
+
+        if (end - p >= 2 && p[0] == '/' && p[1] == '/')
+        {
+            p += 2;
+            const char* a = p;
+            while (p < end && *p != '/' && *p != '?' && *p != '#')
+            {
+                p++;
+            }
+            if (!parseAuthority(a, p))
+            {
+                return false;
+            }
+        }
+
+        const char* s = p;
+        while (p < end && *p != '?' && *p != '#')
+        {
+            p++;
+        }
+        mPath = EvStrView(s, p - s);
+
+        if (p < end && *p == '?')
+        {
+            s = ++p;
+            while (p < end && *p != '#')
+            {
+                p++;
+            }
+            mQuery = EvStrView(s, p - s);
+        }
+        if (p < end && *p == '#')
+        {
+            p++;
+            mFragment = EvStrView(p, end - p);
+        }
+        return true;
+    }
+
+    inline const EvStrView& scheme() const
+    {
+        return mScheme;
+    }
+    inline const EvStrView& userInfo() const
+    {
+        return mUserInfo;
+    }
+    inline const EvStrView& host() const
+    {
+        // Without the brackets of an IPv6 literal
+        return mHost;
+    }
+    inline int port() const
+    {
+        // -1 when there is none
+        return mPort;
+    }
+    inline const EvStrView& path() const
+    {
+        // Empty (but valid) for 'http://host' or '?q'
+        return mPath;
+    }
+    inline const EvStrView& query() const
+    {
+        return mQuery;
+    }
+    inline const EvStrView& fragment() const
+    {
+        return mFragment;
+    }
+
+protected:
+    EvStrView mScheme;
+    EvStrView mUserInfo;
+    EvStrView mHost;
+    EvStrView mPath;
+    EvStrView mQuery;
+    EvStrView mFragment;
+    int mPort;
+
+    static inline
+    bool isAlpha(char c)
+    {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+    }
+    static inline
+    bool isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    bool parseAuthority(const char* p, const char* end)
+    {
+        // [userinfo@]host[:port]
+        const char* at = NULL;
+        for (const char* s = p; s < end; s++)
+        {
+            if (*s == '@')
+            {
+                at = s;
+            }
+        }
+        if (at)
+        {
+            mUserInfo = EvStrView(p, at - p);
+            p = at + 1;
+        }
+
+        const char* hostend;
+        if (p < end && *p == '[')
+        {
+            const char* close = (const char*)memchr(p, ']', end - p);
+            if (close == NULL)
+            {
+                return false;
+            }
+            mHost = EvStrView(p + 1, close - p - 1);
+            hostend = close + 1;
+        }
+        else
+        {
+            hostend = p;
+            while (hostend < end && *hostend != ':')
+            {
+                hostend++;
+            }
+            mHost = EvStrView(p, hostend - p);
+        }
+
+        if (hostend < end)
+        {
+            if (*hostend != ':')
+            {
+                return false;
+            }
+            int port = 0;
+            for (const char* s = hostend + 1; s < end; s++)
+            {
+                if (!isDigit(*s) || (port = port * 10 + (*s - '0')) > 65535)
+                {
+                    return false;
+                }
+            }
+            // 'host:' has no port
+            mPort = (hostend + 1 < end) ? port : -1;
+        }
+        return true;
+    }
+};
+
+
+class EvQueryView
+{
+public:
+    // Iterates the parameters of a query string as views into it, with no copies and no
+    // allocation (EvKeyValues::newFromUri() mallocs every key and value).  Keys and values
+    // stay percent-encoded until decode() writes one into a caller's buffer:
+    //
+    //      EvQueryView q;
+    //      q.assignUri(evreq.uriStr());
+    //      char name[256];
+    //      if (EvQueryView::decode(q.find("name"), name, sizeof(name)) >= 0)
+    //      {
+    //          ...
+    //
+    //      for (q.moveFirst(); !q.eof(); q.moveNext())
+    //      {
+    //          ... q.key(), q.value()
+    //
+    // A key without '=' has an empty value.  Only valid as long as the underlying string is.
+
+    EvQueryView() :
+        mBegin(NULL),
+        mEnd(NULL),
+        mNext(NULL)
+    {
+    }
+
+    void assignQuery(const char* query, size_t len)
+    {
+        mBegin = query;
+        mEnd = query ? query + len : NULL;
+        moveFirst();
+    }
+    inline void assignQuery(const EvStrView& query)
+    {
+        assignQuery(query.data(), query.length());
+    }
+
+    void assignUri(const char* uri)
+    {
+        // The part of a URI between '?' and '#'
+        const char* q = uri ? strchr(uri, '?') : NULL;
+        if (q == NULL)
+        {
+            assignQuery(NULL, 0);
+            return;
+        }
+        q++;
+        assignQuery(q, strcspn(q, "#"));
+    }
+
+    inline void moveFirst()
+    {
+        load(mBegin);
+    }
+    inline void moveNext()
+    {
+        load(mNext);
+    }
+    inline bool eof() const
+    {
+        return !mKey.valid();
+    }
+    inline const EvStrView& key() const
+    {
+        return mKey;
+    }
+    inline const EvStrView& value() const
+    {
+        return mValue;
+    }
+
+    EvStrView find(const char* key) const
+    {
+        // Raw value of the first parameter whose decoded key is 'key', else an invalid view
+        EvQueryView it(*this);
+        for (it.moveFirst(); !it.eof(); it.moveNext())
+        {
+            if (decodedEquals(it.mKey, key))
+            {
+                return it.mValue;
+            }
+        }
+        return EvStrView();
+    }
+
+    static
+    ssize_t decode(const EvStrView& raw, char* buf, size_t size, bool plusisspace = true)
+    {
+        // Decodes '+' and %XX into buf and NUL terminates it.  Returns the decoded length, or
+        // -1 if raw is invalid or does not fit.  Malformed escapes are copied as is.  For a path
+        // (where '+' is a plus) pass plusisspace false.
+        if (!raw.valid() || size == 0)
+        {
+            return -1;
+        }
+        size_t n = 0;
+        for (size_t i = 0; i < raw.length(); n++)
+        {
+            if (n + 1 >= size)
+            {
+                return -1;
+            }
+            i += decodeAt(raw.data() + i, raw.length() - i, &buf[n], plusisspace);
+        }
+        buf[n] = '\0';
+        return (ssize_t)n;
+    }
+
+    static
+    bool decodedEquals(const EvStrView& raw, const char* str)
+    {
+        // Compares without decoding into a buffer
+        size_t i = 0;
+        while (i < raw.length())
+        {
+            char c;
+            if (*str == '\0')
+            {
+                return false;
+            }
+            i += decodeAt(raw.data() + i, raw.length() - i, &c);
+            if (c != *str++)
+            {
+                return false;
+            }
+        }
+        return *str == '\0';
+    }
+
+protected:
+    const char* mBegin;
+    const char* mEnd;
+    const char* mNext;
+    EvStrView mKey;
+    EvStrView mValue;
+
+    void load(const char* p)
+    {
+        // Empty parameters ('a=1&&b=2') are skipped
+        while (p && p < mEnd && *p == '&')
+        {
+            p++;
+        }
+        if (p == NULL || p >= mEnd)
+        {
+            mKey = mValue = EvStrView();
+            mNext = mEnd;
+            return;
+        }
+
+        const char* amp = (const char*)memchr(p, '&', mEnd - p);
+        if (amp == NULL)
+        {
+            amp = mEnd;
+        }
+        const char* eq = (const char*)memchr(p, '=', amp - p);
+        if (eq)
+        {
+            mKey = EvStrView(p, eq - p);
+            mValue = EvStrView(eq + 1, amp - eq - 1);
+        }
+        else
+        {
+            mKey = EvStrView(p, amp - p);
+            mValue = EvStrView(amp, 0);
+        }
+        mNext = amp;
+    }
+
+    static inline
+    int hexVal(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        if (c >= 'a' && c <= 'f')
+        {
+            return c - 'a' + 10;
+        }
+        if (c >= 'A' && c <= 'F')
+        {
+            return c - 'A' + 10;
+        }
+        return -1;
+    }
+
+    static inline
+    size_t decodeAt(const char* p, size_t left, char* out, bool plusisspace = true)
+    {
+        // One decoded character; returns the raw bytes it took
+        if (*p == '+' && plusisspace)
+        {
+            *out = ' ';
+            return 1;
+        }
+        if (*p == '%' && left >= 3)
+        {
+            int hi = hexVal(p[1]);
+            int lo = hexVal(p[2]);
+            if (hi >= 0 && lo >= 0)
+            {
+                *out = (char)((hi << 4) | lo);
+                return 3;
+            }
+        }
+        *out = *p;
+        return 1;
+    }
+};
+
+
 } // namespace lev
 
 #endif // _LEV_H
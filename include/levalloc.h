@@ -0,0 +1,349 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVALLOC_H
+#define _LEVALLOC_H
+
+#include <pthread.h>
+
+#include <vector>
+
+namespace lev
+{
+
+class EvArena;
+
+
+class EvArena
+{
+public:
+    // Opt-in allocator for libevent internals (evbuffer chains, events, bufferevents, evhttp
+    // requests and headers).  Each thread keeps size-classed freelists, so a chain freed on a
+    // loop thread is reused by that loop's next allocation of the same class without touching
+    // the global allocator or its locks.  Classes are powers of two from 16 bytes to 64KB, which
+    // is also how libevent sizes buffer chains; larger blocks go straight to malloc.
+    //
+    // Install before any other libevent call (before the first EvBaseLoop):
+    //
+    //      EvArena::install();
+
+    enum
+    {
+        MinShift = 4,
+        MaxShift = 16,
+        Classes = MaxShift - MinShift + 1,
+        Large = Classes,                    // Stats index for blocks above the largest class
+        MaxCacheBytes = 1024 * 1024         // Per thread and class
+    };
+
+    struct ClassStats
+    {
+        uint64_t allocs;        // Allocations served
+        uint64_t frees;
+        uint64_t hits;          // Allocations served from a thread cache
+        uint64_t bytes;         // Bytes requested by all allocations
+    };
+
+    static
+    void install()
+    {
+        // Memory libevent hands back to the caller must then be freed with EvMem::free()
+        event_set_mem_functions(arenaMalloc, arenaRealloc, arenaFree);
+        EvMem::setFree(arenaFree);
+    }
+
+    static
+    void stats(ClassStats out[Classes + 1])
+    {
+        // Sums the counters of every thread that has allocated (approximate while running)
+        memset(out, 0, sizeof(ClassStats) * (Classes + 1));
+
+        Registry& reg = registry();
+        pthread_mutex_lock(&reg.lock);
+        for (size_t t = 0; t < reg.caches.size(); t++)
+        {
+            ThreadCache* tc = reg.caches[t];
+            for (int c = 0; c <= Classes; c++)
+            {
+                out[c].allocs += tc->counters[c].allocs.load(std::memory_order_relaxed);
+                out[c].frees += tc->counters[c].frees.load(std::memory_order_relaxed);
+                out[c].hits += tc->counters[c].hits.load(std::memory_order_relaxed);
+                out[c].bytes += tc->counters[c].bytes.load(std::memory_order_relaxed);
+            }
+        }
+        pthread_mutex_unlock(&reg.lock);
+    }
+
+    static
+    void printStats(FILE* f)
+    {
+        ClassStats st[Classes + 1];
+        stats(st);
+
+        fprintf(f, "%8s %12s %12s %12s %14s\n", "class", "allocs", "frees", "cache hits", "bytes");
+        for (int c = 0; c <= Classes; c++)
+        {
+            if (st[c].allocs == 0 && st[c].frees == 0)
+            {
+                continue;
+            }
+            char name[16];
+            if (c == Large)
+            {
+                snprintf(name, sizeof(name), "large");
+            }
+            else
+            {
+                snprintf(name, sizeof(name), "%d", classSize(c));
+            }
+            fprintf(f, "%8s %12lu %12lu %12lu %14lu\n", name, (unsigned long)st[c].allocs,
+                (unsigned long)st[c].frees, (unsigned long)st[c].hits, (unsigned long)st[c].bytes);
+        }
+    }
+
+    static inline
+    int classSize(int cls)
+    {
+        return 1 << (cls + MinShift);
+    }
+
+protected:
+    struct Header
+    {
+        // Precedes every block; keeps the user pointer 16 byte aligned
+        uint32_t cls;
+        uint32_t pad;
+        uint64_t pad2;
+    };
+
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    struct Counter
+    {
+        // Owning thread only (EvCounter::inc())
+        std::atomic<uint64_t> allocs;
+        std::atomic<uint64_t> frees;
+        std::atomic<uint64_t> hits;
+        std::atomic<uint64_t> bytes;
+    };
+
+    struct ThreadCache
+    {
+        FreeBlock* lists[Classes];
+        size_t cached[Classes];
+        Counter counters[Classes + 1];
+        bool dead;
+
+        ThreadCache() :
+            dead(false)
+        {
+            memset(lists, 0, sizeof(lists));
+            memset(cached, 0, sizeof(cached));
+            for (int c = 0; c <= Classes; c++)
+            {
+                counters[c].allocs.store(0);
+                counters[c].frees.store(0);
+                counters[c].hits.store(0);
+                counters[c].bytes.store(0);
+            }
+        }
+
+        void flush()
+        {
+            for (int c = 0; c < Classes; c++)
+            {
+                while (lists[c])
+                {
+                    FreeBlock* b = lists[c];
+                    lists[c] = b->next;
+                    ::free((Header*)b - 1);
+                }
+                cached[c] = 0;
+            }
+        }
+    };
+
+    struct Registry
+    {
+        // Thread caches are kept after their thread exits so the counters survive
+        pthread_mutex_t lock;
+        std::vector<ThreadCache*> caches;
+
+        Registry()
+        {
+            pthread_mutex_init(&lock, NULL);
+        }
+    };
+
+    struct Local
+    {
+        ThreadCache* cache;
+
+        Local() :
+            cache(NULL)
+        {
+        }
+        ~Local()
+        {
+            if (cache)
+            {
+                cache->flush();
+                cache->dead = true;
+            }
+        }
+    };
+
+    static
+    Registry& registry()
+    {
+        static Registry* reg = new Registry();
+        return *reg;
+    }
+
+    static inline
+    ThreadCache* local()
+    {
+        static thread_local Local tl;
+        if (tl.cache == NULL)
+        {
+            tl.cache = new ThreadCache();
+            Registry& reg = registry();
+            pthread_mutex_lock(&reg.lock);
+            reg.caches.push_back(tl.cache);
+            pthread_mutex_unlock(&reg.lock);
+        }
+        return tl.cache;
+    }
+
+    static inline
+    int sizeClass(size_t size)
+    {
+        if (size <= ((size_t)1 << MinShift))
+        {
+            return 0;
+        }
+        int shift = 64 - __builtin_clzll((unsigned long long)(size - 1));
+        return (shift <= MaxShift) ? shift - MinShift : Large;
+    }
+
+    static
+    void* arenaMalloc(size_t size)
+    {
+        ThreadCache* tc = local();
+        int cls = sizeClass(size);
+        Header* h;
+
+        EvCounter::inc(tc->counters[cls].allocs);
+        EvCounter::inc(tc->counters[cls].bytes, size);
+
+        if (cls != Large && tc->lists[cls])
+        {
+            FreeBlock* b = tc->lists[cls];
+            tc->lists[cls] = b->next;
+            tc->cached[cls]--;
+            EvCounter::inc(tc->counters[cls].hits);
+            h = (Header*)b - 1;
+        }
+        else
+        {
+            size_t blocksize = (cls != Large) ? (size_t)classSize(cls) : size;
+            h = (Header*)::malloc(sizeof(Header) + blocksize);
+            if (h == NULL)
+            {
+                return NULL;
+            }
+        }
+        h->cls = cls;
+        return h + 1;
+    }
+
+    static
+    void arenaFree(void* ptr)
+    {
+        if (ptr == NULL)
+        {
+            return;
+        }
+        Header* h = (Header*)ptr - 1;
+        int cls = h->cls;
+        ThreadCache* tc = local();
+
+        EvCounter::inc(tc->counters[cls].frees);
+
+        if (cls != Large && !tc->dead && tc->cached[cls] * classSize(cls) < MaxCacheBytes)
+        {
+            FreeBlock* b = (FreeBlock*)ptr;
+            b->next = tc->lists[cls];
+            tc->lists[cls] = b;
+            tc->cached[cls]++;
+            return;
+        }
+        ::free(h);
+    }
+
+    static
+    void* arenaRealloc(void* ptr, size_t size)
+    {
+        if (ptr == NULL)
+        {
+            return arenaMalloc(size);
+        }
+        if (size == 0)
+        {
+            arenaFree(ptr);
+            return NULL;
+        }
+
+        Header* h = (Header*)ptr - 1;
+        int cls = h->cls;
+        if (cls != Large)
+        {
+            if (sizeClass(size) == cls)
+            {
+                return ptr;
+            }
+            void* p = arenaMalloc(size);
+            if (p)
+            {
+                size_t oldsize = classSize(cls);
+                memcpy(p, ptr, (oldsize < size) ? oldsize : size);
+                arenaFree(ptr);
+            }
+            return p;
+        }
+
+        if (sizeClass(size) != Large)
+        {
+            // Shrinking out of the large range: move into a class (copy what fits)
+            void* p = arenaMalloc(size);
+            if (p)
+            {
+                memcpy(p, ptr, size);
+                arenaFree(ptr);
+            }
+            return p;
+        }
+
+        ThreadCache* tc = local();
+        EvCounter::inc(tc->counters[Large].allocs);
+        EvCounter::inc(tc->counters[Large].frees);
+        EvCounter::inc(tc->counters[Large].bytes, size);
+
+        h = (Header*)::realloc(h, sizeof(Header) + size);
+        if (h == NULL)
+        {
+            return NULL;
+        }
+        return h + 1;
+    }
+
+private:
+    EvArena();
+};
+
+} // namespace lev
+
+#endif // _LEVALLOC_H
@@ -0,0 +1,475 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVCACHE_H
+#define _LEVCACHE_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include <map>
+
+#include "levhttp.h"
+
+namespace lev
+{
+
+class EvResponseCache;
+class EvHttpCompressor;                 // levzip.h
+
+
+class EvResponseCache
+{
+public:
+    // Opt-in cache of rendered responses for EvHttpRouter routes.  A cached route has a
+    // renderer instead of a handler: it fills in the body and output headers and returns the
+    // status, and the cache replies.  200 responses are kept for the route's TTL, keyed on the
+    // method, the URI and the values of the route's vary headers:
+    //
+    //      EvResponseCache cache(64 * 1024 * 1024);
+    //      cache.add(router, EVHTTP_REQ_GET, "/reports/:id", renderReport, NULL, 5000, "Accept-Language");
+    //
+    // Hits reference the cached body rather than copying it.  Every entry has an ETag (the
+    // renderer's, else a hash of the body), so a matching If-None-Match gets a 304.  With a
+    // compressor set, each compressible entry also keeps a gzip copy made once when it is
+    // stored, served to clients that accept gzip (others get the plain body).  Memory is
+    // bounded by evicting the least recently used entries.  Hits and misses are counted in
+    // EvMetrics (lev_http_cache_lookups_total).
+    //
+    // Thread safe: one cache can serve the routes of every loop thread.  Shared across loops,
+    // hits only reference the cached bodies after EvBaseLoop::enableThreads() (called before
+    // the first base is created): libevent counts those references under the buffer's lock,
+    // on whichever thread writes the reply.  Without it hits copy the body.  Renderers must
+    // reply synchronously.
+
+    typedef int (*Renderer)(struct evhttp_request* req, const EvRouteParams& params, EvBuffer& body,
+        void* arg);
+
+    EvResponseCache(size_t maxbytes) :
+        mMaxBytes(maxbytes),
+        mZip(NULL),
+        mCompress(NULL),
+        mAcceptsGzip(NULL)
+    {
+        pthread_mutex_init(&mLock, NULL);
+        mBytes.store(0);
+        mEntries.store(0);
+        mEvictions.store(0);
+        mNotModified.store(0);
+    }
+    ~EvResponseCache()
+    {
+        // Responses still being written keep their references to cached bodies
+        while (mLru.head())
+        {
+            evict(mLru.head());
+        }
+        for (size_t i = 0; i < mRoutes.size(); i++)
+        {
+            delete mRoutes[i];
+        }
+        pthread_mutex_destroy(&mLock);
+    }
+
+    bool add(EvHttpRouter& router, int methods, const char* pattern, Renderer renderer, void* arg = NULL,
+        int ttlmsecs = 1000, const char* vary = NULL)
+    {
+        // 'vary' is a comma separated list of request headers that select different responses
+        Route* r = new Route();
+        r->cache = this;
+        r->renderer = renderer;
+        r->arg = arg;
+        r->ttlMsecs = ttlmsecs;
+        for (const char* p = vary; p && *p;)
+        {
+            while (*p == ' ' || *p == ',')
+            {
+                p++;
+            }
+            size_t len = strcspn(p, ", ");
+            if (len > 0)
+            {
+                r->vary.push_back(std::string(p, len));
+            }
+            p += len;
+        }
+
+        if (!router.add(methods, pattern, onRoute, r))
+        {
+            delete r;
+            return false;
+        }
+        mRoutes.push_back(r);
+        return true;
+    }
+
+    void setCompressor(EvHttpCompressor* zip); // levzip.h
+
+    void clear()
+    {
+        pthread_mutex_lock(&mLock);
+        while (mLru.head())
+        {
+            evict(mLru.head());
+        }
+        pthread_mutex_unlock(&mLock);
+    }
+
+    // Stats (hits and misses are in EvMetrics)
+
+    inline size_t bytes() const
+    {
+        return mBytes.load(std::memory_order_relaxed);
+    }
+    inline size_t entries() const
+    {
+        return mEntries.load(std::memory_order_relaxed);
+    }
+    inline uint64_t evictions() const
+    {
+        return mEvictions.load(std::memory_order_relaxed);
+    }
+    inline uint64_t notModified() const
+    {
+        return mNotModified.load(std::memory_order_relaxed);
+    }
+
+protected:
+    struct Route
+    {
+        EvResponseCache* cache;
+        Renderer renderer;
+        void* arg;
+        int ttlMsecs;
+        std::vector<std::string> vary;
+    };
+
+    struct Entry
+    {
+        std::string key;
+        EvBuffer body;
+        std::vector<std::pair<std::string, std::string> > headers;
+        std::string etag;
+        EvBuffer gzip;                  // Empty unless compressed when stored
+        std::string gzipEtag;
+        bool locked;                    // Buffers have locks: hits can reference them
+        uint64_t expires;               // msecs
+        size_t cost;
+        Entry* prev;                    // LRU list, most recent first
+        Entry* next;
+    };
+
+    size_t mMaxBytes;
+    // Set by setCompressor(), so that only its users need zlib
+    typedef bool (*CompressHook)(EvHttpCompressor* zip, const char* ctype, EvBuffer& body, EvBuffer& gzip);
+    typedef bool (*AcceptsGzipHook)(struct evhttp_request* req);
+
+    EvHttpCompressor* mZip;
+    CompressHook mCompress;
+    AcceptsGzipHook mAcceptsGzip;
+    pthread_mutex_t mLock;
+    std::map<std::string, Entry*> mMap;
+    EvLruList<Entry> mLru;
+    std::vector<Route*> mRoutes;
+    std::atomic<size_t> mBytes;         // Written under mLock, read anywhere
+    std::atomic<size_t> mEntries;
+    std::atomic<uint64_t> mEvictions;   // Written under mLock (EvCounter::inc())
+    std::atomic<uint64_t> mNotModified;
+
+    static
+    void onRoute(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+    {
+        Route* r = (Route*)arg;
+        r->cache->serve(req, params, r);
+    }
+
+    void serve(struct evhttp_request* req, const EvRouteParams& params, Route* r)
+    {
+        std::string key;
+        makeKey(req, r, key);
+
+        EvLoopMetrics& m = EvMetrics::local();
+        pthread_mutex_lock(&mLock);
+        Entry* e = find(key);
+        if (e)
+        {
+            EvLoopMetrics::inc(m.cacheHits);
+            replyCached(req, e);
+            return;
+        }
+        pthread_mutex_unlock(&mLock);
+        EvLoopMetrics::inc(m.cacheMisses);
+
+        // Rendered outside the lock; two threads missing the same key both render
+        EvBuffer body;
+        body.newBuffer();
+        int status = r->renderer(req, params, body, r->arg);
+        if (status != HTTP_OK)
+        {
+            evhttp_send_reply(req, status, NULL, body.ptr());
+            return;
+        }
+
+        e = newEntry(req, key, body, r->ttlMsecs);
+        pthread_mutex_lock(&mLock);
+        if (e->cost <= mMaxBytes)
+        {
+            insert(e);
+            replyCached(req, e);
+            return;
+        }
+        pthread_mutex_unlock(&mLock);
+
+        // Too big to keep
+        bool gzip = wantsGzip(req, e);
+        addHeaders(req, e, gzip);
+        evhttp_send_reply(req, HTTP_OK, "OK", gzip ? e->gzip.ptr() : e->body.ptr());
+        delete e;
+    }
+
+    static
+    void addHeaders(struct evhttp_request* req, const Entry* e, bool gzip)
+    {
+        struct evkeyvalq* out = evhttp_request_get_output_headers(req);
+        for (size_t i = 0; i < e->headers.size(); i++)
+        {
+            evhttp_add_header(out, e->headers[i].first.c_str(), e->headers[i].second.c_str());
+        }
+        if (gzip)
+        {
+            evhttp_add_header(out, "Content-Encoding", "gzip");
+        }
+        if (!e->gzipEtag.empty())
+        {
+            evhttp_add_header(out, "Vary", "Accept-Encoding");
+        }
+        evhttp_add_header(out, "ETag", gzip ? e->gzipEtag.c_str() : e->etag.c_str());
+    }
+
+    inline bool wantsGzip(struct evhttp_request* req, const Entry* e) const
+    {
+        return !e->gzipEtag.empty() && mAcceptsGzip(req);
+    }
+
+    void replyCached(struct evhttp_request* req, Entry* e)
+    {
+        // Called with mLock held; releases it
+        bool gzip = wantsGzip(req, e);
+        const std::string& etag = gzip ? e->gzipEtag : e->etag;
+        addHeaders(req, e, gzip);
+
+        const char* inm = evhttp_find_header(evhttp_request_get_input_headers(req), "If-None-Match");
+        if (inm && (strcmp(inm, "*") == 0 || strstr(inm, etag.c_str()) != NULL))
+        {
+            EvCounter::inc(mNotModified);
+            pthread_mutex_unlock(&mLock);
+            evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+            return;
+        }
+
+        struct evbuffer* out = evhttp_request_get_output_buffer(req);
+        EvBuffer& body = gzip ? e->gzip : e->body;
+        if (e->locked)
+        {
+            // The reference pins the body even if the entry is evicted before it is written
+            evbuffer_add_buffer_reference(out, body.ptr());
+        }
+        else
+        {
+            copyBody(out, body);
+        }
+        pthread_mutex_unlock(&mLock);
+        evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+    }
+
+    static
+    void makeKey(struct evhttp_request* req, const Route* r, std::string& key)
+    {
+        char cmd[16];
+        snprintf(cmd, sizeof(cmd), "%d ", (int)evhttp_request_get_command(req));
+        key.assign(cmd);
+        key.append(evhttp_request_get_uri(req));
+        struct evkeyvalq* in = evhttp_request_get_input_headers(req);
+        for (size_t i = 0; i < r->vary.size(); i++)
+        {
+            const char* v = evhttp_find_header(in, r->vary[i].c_str());
+            key.push_back('\n');
+            key.append(v ? v : "");
+        }
+    }
+
+    Entry* newEntry(struct evhttp_request* req, const std::string& key, EvBuffer& rendered, int ttlmsecs)
+    {
+        // Takes over the rendered body and the renderer's output headers
+        Entry* e = new Entry();
+        e->key = key;
+        e->body.newBuffer();
+        e->locked = (evbuffer_enable_locking(e->body.ptr(), NULL) == 0);
+        e->body.append(rendered);
+        e->expires = EvMetrics::nowMsecs() + ttlmsecs;
+        e->cost = sizeof(Entry) + key.size() + e->body.length();
+
+        struct evkeyvalq* out = evhttp_request_get_output_headers(req);
+        for (struct evkeyval* kv = out->tqh_first; kv; kv = kv->next.tqe_next)
+        {
+            if (evutil_ascii_strcasecmp(kv->key, "ETag") == 0)
+            {
+                e->etag = kv->value;
+                continue;
+            }
+            e->headers.push_back(std::make_pair(std::string(kv->key), std::string(kv->value)));
+            e->cost += strlen(kv->key) + strlen(kv->value);
+        }
+        evhttp_clear_headers(out);
+
+        if (e->etag.empty())
+        {
+            char buf[24];
+            snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)hashBody(e->body));
+            e->etag = buf;
+        }
+        if (mZip)
+        {
+            compressEntry(e);
+        }
+        e->prev = NULL;
+        e->next = NULL;
+        return e;
+    }
+
+    void compressEntry(Entry* e)
+    {
+        // Once per entry, outside the lock, so hits never compress
+        const char* ctype = NULL;
+        for (size_t i = 0; i < e->headers.size(); i++)
+        {
+            const char* k = e->headers[i].first.c_str();
+            if (evutil_ascii_strcasecmp(k, "Content-Encoding") == 0)
+            {
+                return;
+            }
+            if (evutil_ascii_strcasecmp(k, "Content-Type") == 0)
+            {
+                ctype = e->headers[i].second.c_str();
+            }
+        }
+        if (!mCompress(mZip, ctype, e->body, e->gzip))
+        {
+            return;
+        }
+        if (evbuffer_enable_locking(e->gzip.ptr(), NULL) != 0)
+        {
+            e->locked = false;
+        }
+        e->cost += e->gzip.length();
+
+        // A different representation needs a different strong ETag: "xyz" -> "xyz-gz"
+        e->gzipEtag = e->etag;
+        size_t q = e->gzipEtag.rfind('"');
+        e->gzipEtag.insert((q != std::string::npos && q > 0) ? q : e->gzipEtag.size(), "-gz");
+    }
+
+    static
+    void copyBody(struct evbuffer* out, EvBuffer& body)
+    {
+        // Only reads the body, so other threads can copy it at the same time
+        int n = evbuffer_peek(body.ptr(), -1, NULL, NULL, 0);
+        if (n <= 0)
+        {
+            return;
+        }
+        std::vector<struct evbuffer_iovec> vec(n);
+        n = evbuffer_peek(body.ptr(), -1, NULL, &vec[0], n);
+        evbuffer_expand(out, body.length());
+        for (int i = 0; i < n; i++)
+        {
+            evbuffer_add(out, vec[i].iov_base, vec[i].iov_len);
+        }
+    }
+
+    static
+    uint64_t hashBody(EvBuffer& body)
+    {
+        // FNV-1a over the chains without linearizing them
+        uint64_t h = 14695981039346656037ull;
+        struct evbuffer_iovec vec[16];
+        struct evbuffer_ptr pos;
+        evbuffer_ptr_set(body.ptr(), &pos, 0, EVBUFFER_PTR_SET);
+        size_t left = body.length();
+        while (left > 0)
+        {
+            int n = evbuffer_peek(body.ptr(), left, &pos, vec, 16);
+            if (n <= 0)
+            {
+                break;
+            }
+            n = (n > 16) ? 16 : n;
+            for (int i = 0; i < n && left > 0; i++)
+            {
+                size_t len = (vec[i].iov_len < left) ? vec[i].iov_len : left;
+                const uint8_t* p = (const uint8_t*)vec[i].iov_base;
+                for (size_t j = 0; j < len; j++)
+                {
+                    h = (h ^ p[j]) * 1099511628211ull;
+                }
+                left -= len;
+                evbuffer_ptr_set(body.ptr(), &pos, len, EVBUFFER_PTR_ADD);
+            }
+        }
+        return h;
+    }
+
+    Entry* find(const std::string& key)
+    {
+        // Live entry for key (under mLock)
+        std::map<std::string, Entry*>::iterator it = mMap.find(key);
+        if (it == mMap.end())
+        {
+            return NULL;
+        }
+        Entry* e = it->second;
+        if (EvMetrics::nowMsecs() >= e->expires)
+        {
+            evict(e);
+            return NULL;
+        }
+        mLru.touch(e);
+        return e;
+    }
+
+    void insert(Entry* e)
+    {
+        // Replaces a previous entry for the key (under mLock)
+        std::map<std::string, Entry*>::iterator it = mMap.find(e->key);
+        if (it != mMap.end())
+        {
+            evict(it->second);
+        }
+        while (mLru.tail() && bytes() + e->cost > mMaxBytes)
+        {
+            EvCounter::inc(mEvictions);
+            evict(mLru.tail());
+        }
+        mMap[e->key] = e;
+        mLru.pushFront(e);
+        mBytes.store(bytes() + e->cost, std::memory_order_relaxed);
+        mEntries.store(mMap.size(), std::memory_order_relaxed);
+    }
+
+    void evict(Entry* e)
+    {
+        mLru.unlink(e);
+        mMap.erase(e->key);
+        mBytes.store(bytes() - e->cost, std::memory_order_relaxed);
+        mEntries.store(mMap.size(), std::memory_order_relaxed);
+        delete e;
+    }
+
+private:
+    EvResponseCache(const EvResponseCache&);
+    EvResponseCache& operator=(const EvResponseCache&);
+};
+
+} // namespace lev
+
+#endif // _LEVCACHE_H
@@ -0,0 +1,396 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVCODEC_H
+#define _LEVCODEC_H
+
+namespace lev
+{
+
+struct EvFrame;
+class EvFrameCodec;
+
+
+struct EvFrame
+{
+    // Payload of one frame, as a position in the input buffer during the frames callback
+    size_t offset;
+    size_t length;
+};
+
+
+class EvFrameCodec
+{
+public:
+    // Splits an EvBufferEvent's input into frames and hands them to a callback in batches (up to
+    // MaxBatch per call), then drains them.  Frames are positions in the input buffer, so
+    // payloads are read in place with view() instead of being copied out one by one.  While a
+    // frame is incomplete the read low watermark is set to the bytes it still needs, so the read
+    // callback doesn't fire for every partial segment.
+    //
+    //      codec.setLengthPrefixed(EvFrameCodec::LengthU32);
+    //      codec.setCallback(onFrames, arg);
+    //      codec.attach(bev);
+    //
+    // The codec must outlive the attachment; it can live in the connection state (ie
+    // EvConnection<State>), and may be destroyed from inside the callback.
+
+    enum Mode
+    {
+        LengthU16,          // 2 byte big endian length, then payload
+        LengthU32,          // 4 byte big endian length, then payload
+        LengthVarint,       // LEB128 varint length (as protobuf), then payload
+        Delimited           // Payload, then delimiter (ie "\r\n")
+    };
+
+    enum { MaxBatch = 64 };
+
+    // count is -1 (and frames NULL) on a protocol error: frame over the size limit or bad varint.
+    // The input is left as is; the handler normally closes the connection.
+    typedef void (*FramesCallback)(EvBufferEvent& bev, const EvFrame* frames, int count, void* arg);
+
+    EvFrameCodec() :
+        mMode(LengthU32),
+        mDelimLen(0),
+        mMaxFrame(16 * 1024 * 1024),
+        mCallback(NULL),
+        mCbArg(NULL),
+        mWriteCb(NULL),
+        mEventCb(NULL),
+        mOtherArg(NULL),
+        mBev(NULL),
+        mScanFrom(0),
+        mAlive(NULL),
+        mFrames(0),
+        mBatches(0)
+    {
+    }
+    ~EvFrameCodec()
+    {
+        if (mAlive)
+        {
+            *mAlive = false;
+        }
+    }
+
+    void setLengthPrefixed(Mode mode, size_t maxframe = 16 * 1024 * 1024)
+    {
+        mMode = mode;
+        mMaxFrame = maxframe;
+    }
+    void setDelimited(const char* delim, size_t delimlen, size_t maxframe = 64 * 1024)
+    {
+        mMode = Delimited;
+        mDelimLen = (delimlen < sizeof(mDelim)) ? delimlen : sizeof(mDelim);
+        memcpy(mDelim, delim, mDelimLen);
+        mMaxFrame = maxframe;
+    }
+    void setCallback(FramesCallback callback, void* arg)
+    {
+        mCallback = callback;
+        mCbArg = arg;
+    }
+
+    void attach(EvBufferEvent& bev)
+    {
+        // Takes over the read callback; the write and event callbacks already set on the
+        // bufferevent keep being called with their original argument
+        mBev = bev.ptr();
+        bufferevent_getcb(mBev, NULL, &mWriteCb, &mEventCb, &mOtherArg);
+        bufferevent_setcb(mBev, onRead, mWriteCb ? onWrite : NULL, mEventCb ? onEvent : NULL, this);
+        mScanFrom = 0;
+        setLowWatermark(headerMin());
+    }
+
+    // Writing frames
+
+    static
+    bool writeHeader(EvBuffer& out, Mode mode, size_t len)
+    {
+        // Header only; follow it with the payload (ie addReference() for zero-copy)
+        unsigned char hdr[10];
+        size_t n = 0;
+        switch (mode)
+        {
+            case LengthU16:
+                if (len > 0xffff)
+                {
+                    return false;
+                }
+                hdr[0] = (unsigned char)(len >> 8);
+                hdr[1] = (unsigned char)len;
+                n = 2;
+                break;
+            case LengthU32:
+                if ((uint64_t)len > 0xffffffffULL)
+                {
+                    return false;
+                }
+                hdr[0] = (unsigned char)(len >> 24);
+                hdr[1] = (unsigned char)(len >> 16);
+                hdr[2] = (unsigned char)(len >> 8);
+                hdr[3] = (unsigned char)len;
+                n = 4;
+                break;
+            case LengthVarint:
+                do
+                {
+                    hdr[n] = (unsigned char)(len & 0x7f);
+                    len >>= 7;
+                    if (len)
+                    {
+                        hdr[n] |= 0x80;
+                    }
+                    n++;
+                } while (len);
+                break;
+            case Delimited:
+                return true;
+        }
+        return out.append(hdr, n);
+    }
+
+    bool writeFrame(EvBuffer& out, const void* data, size_t len)
+    {
+        // Header (or trailing delimiter) and a copy of the payload
+        if (!writeHeader(out, mMode, len) || !out.append(data, len))
+        {
+            return false;
+        }
+        if (mMode == Delimited)
+        {
+            return out.append(mDelim, mDelimLen);
+        }
+        return true;
+    }
+
+    // Reading frames
+
+    static inline
+    size_t view(EvBuffer& input, const EvFrame& frame, EvBufferView& view)
+    {
+        // Points 'view' at the frame's payload (valid until the callback returns)
+        return view.assign(input, frame.offset, frame.length);
+    }
+
+    inline uint64_t frames() const
+    {
+        return mFrames;
+    }
+    inline uint64_t batches() const
+    {
+        // Callback invocations; frames() / batches() is the average batch size
+        return mBatches;
+    }
+
+protected:
+    Mode mMode;
+    char mDelim[8];
+    size_t mDelimLen;
+    size_t mMaxFrame;
+    FramesCallback mCallback;
+    void* mCbArg;
+    bufferevent_data_cb mWriteCb;
+    bufferevent_event_cb mEventCb;
+    void* mOtherArg;
+    struct bufferevent* mBev;
+    size_t mScanFrom;       // Delimited: input already scanned without finding a delimiter
+    bool* mAlive;
+    uint64_t mFrames;
+    uint64_t mBatches;
+
+    inline size_t headerMin() const
+    {
+        switch (mMode)
+        {
+            case LengthU16:
+                return 2;
+            case LengthU32:
+                return 4;
+            case LengthVarint:
+                return 1;
+            default:
+                return mDelimLen;
+        }
+    }
+
+    inline void setLowWatermark(size_t low)
+    {
+        bufferevent_setwatermark(mBev, EV_READ, low, 0);
+    }
+
+    int parseHeader(const EvBufferView& view, size_t pos, size_t* hdrlen, uint64_t* len)
+    {
+        // 1 ok, 0 need more data, -1 error
+        unsigned char hdr[10];
+        size_t avail = view.copyOut(pos, hdr, sizeof(hdr));
+
+        switch (mMode)
+        {
+            case LengthU16:
+                if (avail < 2)
+                {
+                    return 0;
+                }
+                *hdrlen = 2;
+                *len = ((uint64_t)hdr[0] << 8) | hdr[1];
+                return 1;
+            case LengthU32:
+                if (avail < 4)
+                {
+                    return 0;
+                }
+                *hdrlen = 4;
+                *len = ((uint64_t)hdr[0] << 24) | ((uint64_t)hdr[1] << 16) | ((uint64_t)hdr[2] << 8) | hdr[3];
+                return 1;
+            case LengthVarint:
+            {
+                uint64_t v = 0;
+                for (size_t i = 0; i < avail; i++)
+                {
+                    v |= (uint64_t)(hdr[i] & 0x7f) << (7 * i);
+                    if ((hdr[i] & 0x80) == 0)
+                    {
+                        *hdrlen = i + 1;
+                        *len = v;
+                        return 1;
+                    }
+                }
+                return (avail < sizeof(hdr)) ? 0 : -1;
+            }
+            default:
+                return -1;
+        }
+    }
+
+    static
+    void onWrite(struct bufferevent* bev, void* cbarg)
+    {
+        EvFrameCodec* self = (EvFrameCodec*)cbarg;
+        self->mWriteCb(bev, self->mOtherArg);
+    }
+
+    static
+    void onEvent(struct bufferevent* bev, short events, void* cbarg)
+    {
+        EvFrameCodec* self = (EvFrameCodec*)cbarg;
+        self->mEventCb(bev, events, self->mOtherArg);
+    }
+
+    static
+    void onRead(struct bufferevent* bev, void* cbarg)
+    {
+        EvFrameCodec* self = (EvFrameCodec*)cbarg;
+        EvBufferEvent evbuf(bev);
+        EvBuffer input = evbuf.input();
+
+        bool alive = true;
+        self->mAlive = &alive;
+
+        for (;;)
+        {
+            EvBufferView view(input);
+            EvFrame frames[MaxBatch];
+            int count = 0;
+            size_t pos = 0;
+            size_t need = 0;        // Bytes past 'pos' needed to complete the next frame
+            bool error = false;
+
+            while (count < MaxBatch)
+            {
+                size_t avail = view.length() - pos;
+                if (self->mMode == Delimited)
+                {
+                    ssize_t at = view.find(self->mDelim, self->mDelimLen, pos + self->mScanFrom);
+                    if (at < 0)
+                    {
+                        // Next time resume the scan where this one stopped
+                        error = (avail > self->mMaxFrame + self->mDelimLen);
+                        self->mScanFrom = (avail >= self->mDelimLen) ? avail - (self->mDelimLen - 1) : 0;
+                        break;
+                    }
+                    self->mScanFrom = 0;
+                    if ((size_t)at - pos > self->mMaxFrame)
+                    {
+                        error = true;
+                        break;
+                    }
+                    frames[count].offset = pos;
+                    frames[count].length = at - pos;
+                    count++;
+                    pos = at + self->mDelimLen;
+                }
+                else
+                {
+                    size_t hdrlen = 0;
+                    uint64_t len = 0;
+                    int ret = self->parseHeader(view, pos, &hdrlen, &len);
+                    if (ret < 0 || (ret > 0 && len > self->mMaxFrame))
+                    {
+                        error = true;
+                        break;
+                    }
+                    if (ret == 0)
+                    {
+                        need = (self->mMode == LengthVarint) ? avail + 1 : self->headerMin();
+                        break;
+                    }
+                    if (avail < hdrlen + len)
+                    {
+                        need = hdrlen + len;
+                        break;
+                    }
+                    frames[count].offset = pos + hdrlen;
+                    frames[count].length = len;
+                    count++;
+                    pos += hdrlen + len;
+                }
+            }
+
+            if (count > 0)
+            {
+                self->mFrames += count;
+                self->mBatches++;
+                if (self->mCallback)
+                {
+                    self->mCallback(evbuf, frames, count, self->mCbArg);
+                }
+                if (!alive)
+                {
+                    return;
+                }
+                input.drain(pos);
+            }
+
+            if (error)
+            {
+                self->mAlive = NULL;
+                if (self->mCallback)
+                {
+                    self->mCallback(evbuf, NULL, -1, self->mCbArg);
+                }
+                return;
+            }
+
+            if (count == MaxBatch)
+            {
+                // More complete frames may be waiting
+                continue;
+            }
+
+            // Don't wake up again until the partial frame can be complete
+            self->setLowWatermark((self->mMode == Delimited) ? self->headerMin() : need);
+            break;
+        }
+
+        self->mAlive = NULL;
+    }
+
+private:
+    EvFrameCodec(const EvFrameCodec&);
+    EvFrameCodec& operator=(const EvFrameCodec&);
+};
+
+} // namespace lev
+
+#endif // _LEVCODEC_H
@@ -0,0 +1,311 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVFILTER_H
+#define _LEVFILTER_H
+
+#include <time.h>
+
+#include <vector>
+
+namespace lev
+{
+
+struct EvFilterStats;
+class EvFilter;
+class EvFilterStack;
+
+
+struct EvFilterStats
+{
+    // One direction of one stage
+    uint64_t calls;
+    uint64_t bytesIn;                   // Taken from the source buffer
+    uint64_t bytesOut;                  // Added to the destination buffer
+    uint64_t nsecs;                     // Inside the filter
+
+    EvFilterStats() :
+        calls(0),
+        bytesIn(0),
+        bytesOut(0),
+        nsecs(0)
+    {
+    }
+};
+
+
+class EvFilter
+{
+public:
+    // One stage of an EvFilterStack.  input() transforms data read from below (the socket
+    // side) on its way up, output() data written from above on its way down.  Both get the
+    // source and destination buffers themselves: move whole chains with pass() rather than
+    // copying, read in place with peek(), and write with reserve()/commit().
+    //
+    // Return BEV_OK when something was produced, BEV_NEED_MORE to wait for more source data
+    // and BEV_ERROR to fail the connection (the event callback gets BEV_EVENT_ERROR).  'limit'
+    // is how much the destination would like at most, -1 for no limit.  'mode' is BEV_FLUSH or
+    // BEV_FINISHED when buffered data has to come out now (ie end a compressed block).
+    //
+    // The base class passes everything through untouched, which makes it a byte/time tap.
+
+    EvFilter()
+    {
+    }
+    virtual ~EvFilter()
+    {
+    }
+
+    virtual const char* name() const
+    {
+        return "pass";
+    }
+
+    virtual enum bufferevent_filter_result input(EvBuffer& src, EvBuffer& dst, ssize_t limit,
+        enum bufferevent_flush_mode mode)
+    {
+        return pass(src, dst, limit);
+    }
+    virtual enum bufferevent_filter_result output(EvBuffer& src, EvBuffer& dst, ssize_t limit,
+        enum bufferevent_flush_mode mode)
+    {
+        return pass(src, dst, limit);
+    }
+
+    inline const EvFilterStats& inputStats() const
+    {
+        return mIn;
+    }
+    inline const EvFilterStats& outputStats() const
+    {
+        return mOut;
+    }
+
+    static
+    enum bufferevent_filter_result pass(EvBuffer& src, EvBuffer& dst, ssize_t limit)
+    {
+        // Moves up to 'limit' bytes.  Whole chains change buffers by pointer; only a chain
+        // split by the limit is copied.
+        size_t len = src.length();
+        if (len == 0)
+        {
+            return BEV_NEED_MORE;
+        }
+        if (limit < 0 || len <= (size_t)limit)
+        {
+            evbuffer_add_buffer(dst.ptr(), src.ptr());
+        }
+        else
+        {
+            evbuffer_remove_buffer(src.ptr(), dst.ptr(), (size_t)limit);
+        }
+        return BEV_OK;
+    }
+
+protected:
+    friend class EvFilterStack;
+
+    EvFilterStats mIn;
+    EvFilterStats mOut;
+
+private:
+    EvFilter(const EvFilter&);
+    EvFilter& operator=(const EvFilter&);
+};
+
+
+class EvFilterStack
+{
+public:
+    // Stacks filters on an EvBufferEvent with bufferevent_filter_new(), nearest the socket
+    // first.  attach() moves the callbacks and enabled flags already set on the bufferevent to
+    // the top of the stack and points the EvBufferEvent at it, so the rest of the code (ie an
+    // EvFrameCodec) uses it as before:
+    //
+    //      EvFilterStack* stack = new EvFilterStack();
+    //      stack->push(new EvDeflateFilter(1));     // levzip.h
+    //      stack->push(new EvFilter());             // bytes/time of the plain stream
+    //      stack->attach(bev);
+    //      ...
+    //      stack->printStats(stdout);
+    //
+    // Connect (or accept) before attaching.  Freeing the EvBufferEvent frees every layer.  The
+    // stack owns its filters and must outlive the bufferevent; one stack per connection, since
+    // filters keep per-stream state.  If attach() fails the layers stacked so far stay, with
+    // the callbacks moved to the highest: close the connection.
+
+    EvFilterStack() :
+        mTiming(true),
+        mAttached(false)
+    {
+    }
+    ~EvFilterStack()
+    {
+        for (size_t i = 0; i < mLayers.size(); i++)
+        {
+            delete mLayers[i].filter;
+        }
+    }
+
+    bool push(EvFilter* filter)
+    {
+        // Takes ownership unless attach() has been called (the layers are the filters' context)
+        if (mAttached)
+        {
+            dbgerr("Filter pushed after attach()\n");
+            return false;
+        }
+        Layer l;
+        l.stack = this;
+        l.filter = filter;
+        mLayers.push_back(l);
+        return true;
+    }
+
+    bool attach(EvBufferEvent& bev)
+    {
+        if (mAttached)
+        {
+            dbgerr("Filter stack already attached\n");
+            return false;
+        }
+        mAttached = true;
+
+        struct bufferevent* top = bev.ptr();
+        bufferevent_data_cb readcb;
+        bufferevent_data_cb writecb;
+        bufferevent_event_cb eventcb;
+        void* cbarg;
+        bufferevent_getcb(top, &readcb, &writecb, &eventcb, &cbarg);
+        short enabled = bufferevent_get_enabled(top);
+        bufferevent_setcb(top, NULL, NULL, NULL, NULL);
+
+        bool ok = true;
+        for (size_t i = 0; i < mLayers.size(); i++)
+        {
+            struct bufferevent* f = bufferevent_filter_new(top, onInput, onOutput, BEV_OPT_CLOSE_ON_FREE,
+                NULL, &mLayers[i]);
+            if (f == NULL)
+            {
+                // The layers below can't be freed without freeing the bufferevent they're on
+                dbgerr("bufferevent_filter_new failed\n");
+                ok = false;
+                break;
+            }
+            // What a filter produces is counted as it is added: the destination can be drained
+            // before the filter returns (ie by a bufferevent pair)
+            evbuffer_add_cb(bufferevent_get_output(top), onAdded, &mLayers[i].filter->mOut.bytesOut);
+            evbuffer_add_cb(bufferevent_get_input(f), onAdded, &mLayers[i].filter->mIn.bytesOut);
+            top = f;
+            bev.replace(top);
+        }
+
+        bufferevent_setcb(top, readcb, writecb, eventcb, cbarg);
+        bufferevent_enable(top, enabled);
+        return ok;
+    }
+
+    inline void setTiming(bool timing)
+    {
+        // Two clock reads per filter call; on by default
+        mTiming = timing;
+    }
+
+    inline size_t size() const
+    {
+        return mLayers.size();
+    }
+    inline EvFilter* filter(size_t i) const
+    {
+        // 0 is nearest the socket
+        return mLayers[i].filter;
+    }
+
+    void printStats(FILE* out) const
+    {
+        fprintf(out, "%-3s %-12s %-4s %10s %14s %14s %10s %10s\n", "#", "filter", "dir", "calls", "bytes in",
+            "bytes out", "usecs", "MB/s");
+        for (size_t i = 0; i < mLayers.size(); i++)
+        {
+            const EvFilter* f = mLayers[i].filter;
+            printLine(out, i, f->name(), "in", f->mIn);
+            printLine(out, i, f->name(), "out", f->mOut);
+        }
+    }
+
+protected:
+    struct Layer
+    {
+        EvFilterStack* stack;
+        EvFilter* filter;
+    };
+
+    std::vector<Layer> mLayers;         // Not resized after attach(); the filters point into it
+    bool mTiming;
+    bool mAttached;
+
+    static inline
+    uint64_t nowNsecs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+    }
+
+    static
+    enum bufferevent_filter_result run(Layer* l, bool input, struct evbuffer* src, struct evbuffer* dst,
+        ev_ssize_t limit, enum bufferevent_flush_mode mode)
+    {
+        EvBuffer s(src);
+        EvBuffer d(dst);
+        EvFilterStats& st = input ? l->filter->mIn : l->filter->mOut;
+        size_t slen = s.length();
+        uint64_t start = l->stack->mTiming ? nowNsecs() : 0;
+
+        enum bufferevent_filter_result res = input ? l->filter->input(s, d, limit, mode) :
+            l->filter->output(s, d, limit, mode);
+
+        if (l->stack->mTiming)
+        {
+            st.nsecs += nowNsecs() - start;
+        }
+        st.calls++;
+        st.bytesIn += slen - s.length();
+        return res;
+    }
+
+    static
+    void onAdded(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg)
+    {
+        *(uint64_t*)arg += info->n_added;
+    }
+
+    static
+    enum bufferevent_filter_result onInput(struct evbuffer* src, struct evbuffer* dst, ev_ssize_t limit,
+        enum bufferevent_flush_mode mode, void* ctx)
+    {
+        return run((Layer*)ctx, true, src, dst, limit, mode);
+    }
+    static
+    enum bufferevent_filter_result onOutput(struct evbuffer* src, struct evbuffer* dst, ev_ssize_t limit,
+        enum bufferevent_flush_mode mode, void* ctx)
+    {
+        return run((Layer*)ctx, false, src, dst, limit, mode);
+    }
+
+    static
+    void printLine(FILE* out, size_t i, const char* name, const char* dir, const EvFilterStats& st)
+    {
+        fprintf(out, "%-3zu %-12s %-4s %10lu %14lu %14lu %10lu %10.1f\n", i, name, dir, (unsigned long)st.calls,
+            (unsigned long)st.bytesIn, (unsigned long)st.bytesOut, (unsigned long)(st.nsecs / 1000),
+            st.nsecs ? st.bytesIn * 1e3 / st.nsecs : 0.0);
+    }
+
+private:
+    EvFilterStack(const EvFilterStack&);
+    EvFilterStack& operator=(const EvFilterStack&);
+};
+
+} // namespace lev
+
+#endif // _LEVFILTER_H
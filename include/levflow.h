@@ -0,0 +1,384 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVFLOW_H
+#define _LEVFLOW_H
+
+namespace lev
+{
+
+class EvFlowControl;
+class EvMemoryBudget;
+
+
+class EvFlowControl
+{
+public:
+    // Output backpressure for one EvBufferEvent.  When its output buffer grows past the high
+    // watermark, reading is disabled on the source (the peer feeding that output: the same
+    // bufferevent for an echo or request/response server, the other side for a proxy) and
+    // re-enabled once the output has drained to the low watermark.  With an EvMemoryBudget, the
+    // bytes are also counted against the loop's total.
+    //
+    //      flow.setWatermarks(256 * 1024, 64 * 1024);
+    //      flow.attach(bev, &budget);
+    //
+    // Detach (or destruct) before the bufferevent is freed.  Something else enabling EV_READ on
+    // the source while it is paused defeats the pause.
+
+    EvFlowControl() :
+        mOutput(NULL),
+        mCbEntry(NULL),
+        mSource(NULL),
+        mBudget(NULL),
+        mPrev(NULL),
+        mNext(NULL),
+        mHigh(256 * 1024),
+        mLow(64 * 1024),
+        mBuffered(0),
+        mPaused(false),
+        mUserData(NULL)
+    {
+    }
+    ~EvFlowControl()
+    {
+        detach();
+    }
+
+    void setWatermarks(size_t high, size_t low)
+    {
+        mHigh = high;
+        mLow = (low < high) ? low : high;
+    }
+
+    bool attach(EvBufferEvent& bev, EvMemoryBudget* budget = NULL, struct bufferevent* source = NULL);
+    void detach();
+
+    inline bool attached() const
+    {
+        return mOutput != NULL;
+    }
+    inline bool paused() const
+    {
+        return mPaused;
+    }
+    inline size_t buffered() const
+    {
+        // Bytes in the output buffer
+        return mBuffered;
+    }
+
+    inline void* userData()
+    {
+        return mUserData;
+    }
+    inline void setUserData(void* userdata)
+    {
+        // For the budget's shed callback (ie the EvConnection)
+        mUserData = userdata;
+    }
+
+protected:
+    struct evbuffer* mOutput;
+    struct evbuffer_cb_entry* mCbEntry;
+    struct bufferevent* mSource;
+    EvMemoryBudget* mBudget;
+    EvFlowControl* mPrev;
+    EvFlowControl* mNext;
+    size_t mHigh;
+    size_t mLow;
+    size_t mBuffered;
+    bool mPaused;
+    void* mUserData;
+
+    friend class EvMemoryBudget;
+
+    void pause();
+    void resume();
+
+    static
+    void onOutputChange(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg);
+
+private:
+    EvFlowControl(const EvFlowControl&);
+    EvFlowControl& operator=(const EvFlowControl&);
+};
+
+
+class EvMemoryBudget
+{
+public:
+    // Per-loop budget for the output bytes of every EvFlowControl attached to it.  Above the
+    // pause limit, a connection whose output grows past its fair share (limit / connections) is
+    // paused as if it had hit its high watermark, so the heaviest senders stop first.  Above the
+    // shed limit the heaviest connection is handed to the shed callback (from the loop, not
+    // from inside a buffer callback), which is expected to close it.
+    //
+    // buffered() and the counters can be read from any thread, ie by a monitor alerting well
+    // before the OOM killer would.
+
+    typedef void (*ShedCallback)(EvFlowControl* flow, void* arg);
+
+    EvMemoryBudget() :
+        mHead(NULL),
+        mFlows(0),
+        mPauseLimit(0),
+        mShedLimit(0),
+        mShedCb(NULL),
+        mShedArg(NULL)
+    {
+        mBuffered.store(0);
+        mPeak.store(0);
+        mPauses.store(0);
+        mSheds.store(0);
+    }
+    ~EvMemoryBudget()
+    {
+        // Flows still attached keep working without a budget
+        while (mHead)
+        {
+            EvFlowControl* f = mHead;
+            unlink(f);
+            f->mBudget = NULL;
+        }
+    }
+
+    void start(struct event_base* base, size_t pauselimit, size_t shedlimit = 0)
+    {
+        // 0 disables the limit
+        mPauseLimit = pauselimit;
+        mShedLimit = shedlimit;
+        mShedEv.newUser(onShed, base);
+        mShedEv.setUserData(this);
+    }
+
+    inline void setShedCallback(ShedCallback callback, void* arg)
+    {
+        mShedCb = callback;
+        mShedArg = arg;
+    }
+
+    inline size_t buffered() const
+    {
+        return mBuffered.load(std::memory_order_relaxed);
+    }
+    inline size_t peak() const
+    {
+        return mPeak.load(std::memory_order_relaxed);
+    }
+    inline uint64_t pauses() const
+    {
+        return mPauses.load(std::memory_order_relaxed);
+    }
+    inline uint64_t sheds() const
+    {
+        return mSheds.load(std::memory_order_relaxed);
+    }
+    inline size_t flows() const
+    {
+        return mFlows;
+    }
+
+    inline bool overPauseLimit() const
+    {
+        return mPauseLimit && buffered() > mPauseLimit;
+    }
+    inline size_t fairShare() const
+    {
+        return mFlows ? mPauseLimit / mFlows : mPauseLimit;
+    }
+
+protected:
+    EvFlowControl* mHead;
+    size_t mFlows;
+    size_t mPauseLimit;
+    size_t mShedLimit;
+    ShedCallback mShedCb;
+    void* mShedArg;
+    EvEvent mShedEv;
+
+    // Loop thread only (EvCounter::inc())
+    std::atomic<size_t> mBuffered;
+    std::atomic<size_t> mPeak;
+    std::atomic<uint64_t> mPauses;
+    std::atomic<uint64_t> mSheds;
+
+    friend class EvFlowControl;
+
+    void link(EvFlowControl* flow)
+    {
+        flow->mPrev = NULL;
+        flow->mNext = mHead;
+        if (mHead)
+        {
+            mHead->mPrev = flow;
+        }
+        mHead = flow;
+        mFlows++;
+    }
+    void unlink(EvFlowControl* flow)
+    {
+        if (flow->mPrev)
+        {
+            flow->mPrev->mNext = flow->mNext;
+        }
+        else
+        {
+            mHead = flow->mNext;
+        }
+        if (flow->mNext)
+        {
+            flow->mNext->mPrev = flow->mPrev;
+        }
+        flow->mPrev = NULL;
+        flow->mNext = NULL;
+        mFlows--;
+    }
+
+    void adjust(size_t added, size_t removed)
+    {
+        size_t total = buffered() + added - removed;
+        mBuffered.store(total, std::memory_order_relaxed);
+        if (total > peak())
+        {
+            mPeak.store(total, std::memory_order_relaxed);
+        }
+        if (mShedLimit && total > mShedLimit && mShedCb)
+        {
+            mShedEv.activateUser(0);
+        }
+    }
+
+    static
+    void onShed(evutil_socket_t fd, short what, void* arg)
+    {
+        // Sheds the heaviest connections until back under the shed limit
+        EvEvent* ev = (EvEvent*)arg;
+        EvMemoryBudget* self = (EvMemoryBudget*)ev->userData();
+
+        while (self->mShedCb && self->buffered() > self->mShedLimit)
+        {
+            EvFlowControl* heaviest = NULL;
+            for (EvFlowControl* f = self->mHead; f; f = f->mNext)
+            {
+                if (heaviest == NULL || f->mBuffered > heaviest->mBuffered)
+                {
+                    heaviest = f;
+                }
+            }
+            if (heaviest == NULL)
+            {
+                break;
+            }
+
+            EvCounter::inc(self->mSheds);
+            size_t before = self->mFlows;
+            self->mShedCb(heaviest, self->mShedArg);
+            if (self->mFlows == before)
+            {
+                // Callback kept the connection; detach it so the loop makes progress
+                heaviest->detach();
+            }
+        }
+    }
+
+private:
+    EvMemoryBudget(const EvMemoryBudget&);
+    EvMemoryBudget& operator=(const EvMemoryBudget&);
+};
+
+
+inline bool EvFlowControl::attach(EvBufferEvent& bev, EvMemoryBudget* budget, struct bufferevent* source)
+{
+    detach();
+
+    mOutput = bufferevent_get_output(bev.ptr());
+    mCbEntry = evbuffer_add_cb(mOutput, onOutputChange, this);
+    if (mCbEntry == NULL)
+    {
+        dbgerr("Failed to add output buffer callback\n");
+        mOutput = NULL;
+        return false;
+    }
+    mSource = source ? source : bev.ptr();
+    mBuffered = evbuffer_get_length(mOutput);
+    mPaused = false;
+
+    mBudget = budget;
+    if (mBudget)
+    {
+        mBudget->link(this);
+        mBudget->adjust(mBuffered, 0);
+    }
+    return true;
+}
+
+inline void EvFlowControl::detach()
+{
+    if (mOutput == NULL)
+    {
+        return;
+    }
+    evbuffer_remove_cb_entry(mOutput, mCbEntry);
+    if (mBudget)
+    {
+        mBudget->adjust(0, mBuffered);
+        mBudget->unlink(this);
+        mBudget = NULL;
+    }
+    resume();
+    mOutput = NULL;
+    mCbEntry = NULL;
+    mSource = NULL;
+    mBuffered = 0;
+}
+
+inline void EvFlowControl::pause()
+{
+    if (!mPaused)
+    {
+        bufferevent_disable(mSource, EV_READ);
+        mPaused = true;
+        if (mBudget)
+        {
+            EvCounter::inc(mBudget->mPauses);
+        }
+    }
+}
+
+inline void EvFlowControl::resume()
+{
+    if (mPaused)
+    {
+        bufferevent_enable(mSource, EV_READ);
+        mPaused = false;
+    }
+}
+
+inline void EvFlowControl::onOutputChange(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg)
+{
+    EvFlowControl* self = (EvFlowControl*)arg;
+
+    self->mBuffered = info->orig_size + info->n_added - info->n_deleted;
+    if (self->mBudget)
+    {
+        self->mBudget->adjust(info->n_added, info->n_deleted);
+    }
+
+    if (self->mBuffered <= self->mLow)
+    {
+        self->resume();
+    }
+    else if (info->n_added > 0)
+    {
+        if (self->mBuffered > self->mHigh ||
+            (self->mBudget && self->mBudget->overPauseLimit() && self->mBuffered > self->mBudget->fairShare()))
+        {
+            self->pause();
+        }
+    }
+}
+
+} // namespace lev
+
+#endif // _LEVFLOW_H
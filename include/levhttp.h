@@ -4,16 +4,93 @@
 #ifndef _LEVHTTP_H
 #define _LEVHTTP_H
 
+#include <deque>
+#include <map>
+
+#include "levmetrics.h"
+
 namespace lev
 {
 
+struct EvHttpConnState;
 class EvHttpRequest;
+class EvHeaderIndex;
 class EvHttpServer;
+class EvRouteParams;
+class EvHttpRouter;
+class EvHttpClient;
+
+
+struct EvHttpConnState
+{
+    // Kept for a server connection until it closes, on its loop thread.  It owns the
+    // connection's close callback, so EvHttpRequest::setCloseCallback() and
+    // EvHttpRouter::setOnComplete() don't replace each other's.
+
+    typedef void (*ConnCallback)(struct evhttp_connection* conn, void* arg);
+    typedef void (*CompleteCallback)(struct evhttp_request* req, void* arg);
+
+    ConnCallback onClose;
+    void* closeArg;
+    struct evhttp_request* req;         // With a chained on complete callback
+    CompleteCallback onComplete;
+    void* completeArg;
+    uint64_t start;                     // 0 if unknown
+
+    EvHttpConnState() :
+        onClose(NULL),
+        closeArg(NULL),
+        req(NULL),
+        onComplete(NULL),
+        completeArg(NULL),
+        start(0)
+    {
+    }
+
+    static
+    EvHttpConnState* get(struct evhttp_connection* conn)
+    {
+        // Created on first use; one lookup per call, one allocation per connection
+        std::map<struct evhttp_connection*, EvHttpConnState>& all = states();
+        std::map<struct evhttp_connection*, EvHttpConnState>::iterator it = all.find(conn);
+        if (it != all.end())
+        {
+            return &it->second;
+        }
+        EvHttpConnState* s = &all[conn];
+        evhttp_connection_set_closecb(conn, onConnClose, s);
+        return s;
+    }
+
+    static
+    std::map<struct evhttp_connection*, EvHttpConnState>& states()
+    {
+        static thread_local std::map<struct evhttp_connection*, EvHttpConnState> all;
+        return all;
+    }
+
+    static
+    void onConnClose(struct evhttp_connection* conn, void* arg)
+    {
+        // Requests still waiting for their reply are never completed, so this is the end of
+        // their chained callbacks too
+        EvHttpConnState* s = (EvHttpConnState*)arg;
+        ConnCallback onclose = s->onClose;
+        void* closearg = s->closeArg;
+        states().erase(conn);
+        if (onclose)
+        {
+            onclose(conn, closearg);
+        }
+    }
+};
 
 
 class EvHttpRequest
 {
 public:
+    typedef void (*ConnCallback)(struct evhttp_connection* conn, void* arg);
+
     EvHttpRequest(struct evhttp_request* req)
     {
         mReq = req;
@@ -35,7 +112,56 @@ public:
         evhttp_send_reply(mReq, responsecode, responsemsg, body.ptr());
     }
 
-    //TODO: add chunk API
+    // Streaming replies: sendReplyStart(), any number of sendReplyChunk(), then sendReplyEnd().
+    // HTTP/1.1 clients get chunked transfer encoding, HTTP/1.0 clients a close delimited body.
+
+    inline void sendReplyStart(int responsecode, const char* responsemsg)
+    {
+        evhttp_send_reply_start(mReq, responsecode, responsemsg);
+    }
+    inline void sendReplyChunk(EvBuffer& data)
+    {
+        evhttp_send_reply_chunk(mReq, data.ptr());
+    }
+    void sendReplyChunk(EvBuffer& data, ConnCallback ondrain, void* arg, size_t lowwatermark = 0)
+    {
+        // 'ondrain' fires once the connection's output has drained to 'lowwatermark' bytes or
+        // less.  Producing the next chunk from it keeps a slow client from making the producer
+        // buffer the whole body.  Not called for an empty chunk.
+        setOutputWatermark(lowwatermark);
+        evhttp_send_reply_chunk_with_cb(mReq, data.ptr(), ondrain, arg);
+    }
+    inline void sendReplyEnd()
+    {
+        // The request is freed once the reply is written; don't use it after this
+        setOutputWatermark(0);
+        evhttp_send_reply_end(mReq);
+    }
+
+    size_t outputPending()
+    {
+        // Bytes queued on the connection but not yet written to the socket
+        struct evhttp_connection* conn = connection();
+        if (conn == NULL)
+        {
+            return 0;
+        }
+        return evbuffer_get_length(bufferevent_get_output(evhttp_connection_get_bufferevent(conn)));
+    }
+
+    void setCloseCallback(ConnCallback onclose, void* arg)
+    {
+        // Called if the connection closes (ie the client goes away in the middle of a streamed
+        // reply).  The request is gone by then; release any producer state.  Pass NULL to clear
+        // before sendReplyEnd() since the connection may outlive this request (keep-alive).
+        struct evhttp_connection* conn = connection();
+        if (conn)
+        {
+            EvHttpConnState* s = EvHttpConnState::get(conn);
+            s->onClose = onclose;
+            s->closeArg = arg;
+        }
+    }
 
     inline void cancel()
     {
@@ -58,6 +184,13 @@ public:
         EvHttpUri u(evhttp_request_get_evhttp_uri(mReq));
         return u;
     }
+    inline EvQueryView query()
+    {
+        // Query parameters as views into the request's URI, no allocation
+        EvQueryView q;
+        q.assignUri(evhttp_request_get_uri(mReq));
+        return q;
+    }
 
     inline const char* host()
     {
@@ -90,20 +223,311 @@ public:
         return EvBuffer(evhttp_request_get_output_buffer(mReq));
     }
 
+    // Backpressure for streaming request bodies (EvHttpRouter::addStreaming()): stop reading
+    // the body from the socket, ie while a chunk is being written to disk, and carry on later.
+
+    void pauseInput()
+    {
+        struct evhttp_connection* conn = connection();
+        if (conn)
+        {
+            bufferevent_disable(evhttp_connection_get_bufferevent(conn), EV_READ);
+        }
+    }
+    void resumeInput()
+    {
+        struct evhttp_connection* conn = connection();
+        if (conn)
+        {
+            bufferevent_enable(evhttp_connection_get_bufferevent(conn), EV_READ);
+        }
+    }
+
 protected:
     struct evhttp_request* mReq;
 
+    void setOutputWatermark(size_t lowwatermark)
+    {
+        struct evhttp_connection* conn = connection();
+        if (conn)
+        {
+            bufferevent_setwatermark(evhttp_connection_get_bufferevent(conn), EV_WRITE, lowwatermark, 0);
+        }
+    }
+
 private:
     EvHttpRequest();
 };
 
 
+class EvHeaderIndex
+{
+public:
+    // Case-insensitive hash index over a header list (ie a request's input headers).  Built
+    // once per request, so a handler reading several headers doesn't walk the whole list with
+    // strcasecmp for each one the way evhttp_find_header() does:
+    //
+    //      EvHeaderIndex hdrs(evreq.inputHdrs());
+    //      const char* host = hdrs.find(EvHeaderIndex::Host);
+    //      const char* token = hdrs.find("X-Api-Token");
+    //
+    // Common headers have pre-interned ids whose hashes are computed once per process.  Like
+    // evhttp_find_header(), the first of repeated headers wins.  Entries point into the list,
+    // so rebuild after headers are added or removed.  Up to InlineSlots / 2 headers are indexed
+    // without allocating.
+
+    enum Id
+    {
+        Host,
+        ContentLength,
+        ContentType,
+        Connection,
+        AcceptEncoding,
+        Accept,
+        TransferEncoding,
+        UserAgent,
+        Cookie,
+        Authorization,
+        IfNoneMatch,
+        IfModifiedSince,
+        Range,
+        Expect,
+        Upgrade,
+        KnownIds
+    };
+
+    enum { InlineSlots = 64 };
+
+    EvHeaderIndex() :
+        mSlots(mInline),
+        mMask(InlineSlots - 1),
+        mCount(0)
+    {
+        memset(mInline, 0, sizeof(mInline));
+    }
+    EvHeaderIndex(struct evkeyvalq* hdrs) :
+        mSlots(mInline),
+        mMask(InlineSlots - 1),
+        mCount(0)
+    {
+        build(hdrs);
+    }
+    ~EvHeaderIndex()
+    {
+        if (mSlots != mInline)
+        {
+            delete[] mSlots;
+        }
+    }
+
+    void build(struct evkeyvalq* hdrs)
+    {
+        size_t n = 0;
+        struct evkeyval* kv;
+        for (kv = hdrs ? hdrs->tqh_first : NULL; kv; kv = kv->next.tqe_next)
+        {
+            n++;
+        }
+
+        // Keep the load factor at or below one half
+        size_t size = InlineSlots;
+        while (size < n * 2)
+        {
+            size <<= 1;
+        }
+        if (size > mMask + 1)
+        {
+            if (mSlots != mInline)
+            {
+                delete[] mSlots;
+            }
+            mSlots = new Slot[size];
+            mMask = size - 1;
+        }
+        memset(mSlots, 0, (mMask + 1) * sizeof(Slot));
+        mCount = 0;
+
+        for (kv = hdrs ? hdrs->tqh_first : NULL; kv; kv = kv->next.tqe_next)
+        {
+            uint32_t hash;
+            size_t len = hashKey(kv->key, &hash);
+            size_t i = hash & mMask;
+            while (mSlots[i].kv)
+            {
+                if (matches(mSlots[i], hash, kv->key, len))
+                {
+                    break;
+                }
+                i = (i + 1) & mMask;
+            }
+            if (mSlots[i].kv == NULL)
+            {
+                mSlots[i].kv = kv;
+                mSlots[i].hash = hash;
+                mSlots[i].len = (uint32_t)len;
+                mCount++;
+            }
+        }
+    }
+
+    inline const char* find(Id id) const
+    {
+        const Known& k = known()[id];
+        return lookup(k.hash, k.name, k.len);
+    }
+    inline const char* find(const char* key) const
+    {
+        uint32_t hash;
+        size_t len = hashKey(key, &hash);
+        return lookup(hash, key, len);
+    }
+
+    inline size_t count() const
+    {
+        // Distinct header names
+        return mCount;
+    }
+
+    static inline
+    const char* name(Id id)
+    {
+        return known()[id].name;
+    }
+
+protected:
+    struct Slot
+    {
+        struct evkeyval* kv;            // NULL when empty
+        uint32_t hash;
+        uint32_t len;
+    };
+
+    struct Known
+    {
+        const char* name;
+        size_t len;
+        uint32_t hash;
+    };
+
+    Slot* mSlots;
+    size_t mMask;
+    size_t mCount;
+    Slot mInline[InlineSlots];
+
+    static inline
+    char lower(char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+    }
+
+    static inline
+    size_t hashKey(const char* key, uint32_t* hash)
+    {
+        // Eight bytes at a time, case folded by setting bit 5 of every byte; matches() sorts out
+        // the odd non-letter collision this causes.  Returns the name's length.
+        size_t len = strlen(key);
+        uint64_t h = 0x9e3779b97f4a7c15ull ^ len;
+        size_t i = 0;
+        uint64_t w;
+        for (; i + 8 <= len; i += 8)
+        {
+            memcpy(&w, key + i, 8);
+            h = (h ^ (w | 0x2020202020202020ull)) * 0xff51afd7ed558ccdull;
+            h ^= h >> 29;
+        }
+        if (i < len)
+        {
+            w = 0;
+            memcpy(&w, key + i, len - i);
+            h = (h ^ (w | 0x2020202020202020ull)) * 0xff51afd7ed558ccdull;
+        }
+        h ^= h >> 32;
+        *hash = (uint32_t)h;
+        return len;
+    }
+
+    static inline
+    bool matches(const Slot& s, uint32_t hash, const char* key, size_t len)
+    {
+        if (s.hash != hash || s.len != len)
+        {
+            return false;
+        }
+        const char* k = s.kv->key;
+        for (size_t i = 0; i < len; i++)
+        {
+            if (k[i] != key[i] && lower(k[i]) != lower(key[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    inline const char* lookup(uint32_t hash, const char* key, size_t len) const
+    {
+        for (size_t i = hash & mMask; mSlots[i].kv; i = (i + 1) & mMask)
+        {
+            if (matches(mSlots[i], hash, key, len))
+            {
+                return mSlots[i].kv->value;
+            }
+        }
+        return NULL;
+    }
+
+    static
+    const Known* known()
+    {
+        static Known table[KnownIds] =
+        {
+            { "Host", 0, 0 },
+            { "Content-Length", 0, 0 },
+            { "Content-Type", 0, 0 },
+            { "Connection", 0, 0 },
+            { "Accept-Encoding", 0, 0 },
+            { "Accept", 0, 0 },
+            { "Transfer-Encoding", 0, 0 },
+            { "User-Agent", 0, 0 },
+            { "Cookie", 0, 0 },
+            { "Authorization", 0, 0 },
+            { "If-None-Match", 0, 0 },
+            { "If-Modified-Since", 0, 0 },
+            { "Range", 0, 0 },
+            { "Expect", 0, 0 },
+            { "Upgrade", 0, 0 }
+        };
+        static bool interned = intern(table);
+        (void)interned;
+        return table;
+    }
+
+    static
+    bool intern(Known* table)
+    {
+        for (int i = 0; i < KnownIds; i++)
+        {
+            table[i].len = hashKey(table[i].name, &table[i].hash);
+        }
+        return true;
+    }
+
+private:
+    EvHeaderIndex(const EvHeaderIndex&);
+    EvHeaderIndex& operator=(const EvHeaderIndex&);
+};
+
+
 class EvHttpServer
 {
 public:
     typedef void (*RouteCallback)(struct evhttp_request*, void*);
+    typedef bool (*BevCheck)(struct bufferevent* bev);
 
-    EvHttpServer(struct event_base* base)
+    EvHttpServer(struct event_base* base) :
+        mBase(base),
+        mMaxBody(-1),
+        mMaxHeaders(-1)
     {
         mServer = evhttp_new(base);
         if (mServer == NULL)
@@ -138,6 +562,45 @@ public:
         return ret == 0;
     }
 
+    void setMaxBodySize(ssize_t size)
+    {
+        // Requests with a larger body get 413 and their connection closed; -1 for no limit.
+        // EvHttpRouter routes can set their own.
+        mMaxBody = size;
+        evhttp_set_max_body_size(mServer, size);
+    }
+    void setMaxHeadersSize(ssize_t size)
+    {
+        // Request line and headers
+        mMaxHeaders = size;
+        evhttp_set_max_headers_size(mServer, size);
+    }
+    inline ssize_t maxBodySize() const
+    {
+        return mMaxBody;
+    }
+    inline ssize_t maxHeadersSize() const
+    {
+        return mMaxHeaders;
+    }
+
+    bool setTls(EvTlsContext& tls);     // levtls.h
+
+    static
+    bool drainsToSocket(struct evhttp_request* req)
+    {
+        // True when the response is written straight to the connection's socket, so file data
+        // added to it can go out with sendfile().  Not through a filter or TLS (setTls()).
+        struct evhttp_connection* conn = evhttp_request_get_connection(req);
+        struct bufferevent* bev = conn ? evhttp_connection_get_bufferevent(conn) : NULL;
+        if (bev == NULL || bufferevent_get_underlying(bev) != NULL)
+        {
+            return false;
+        }
+        BevCheck istls = tlsCheck().load(std::memory_order_relaxed);
+        return istls == NULL || !istls(bev);
+    }
+
     bool bind(const char* address, short port, EvConnListener* connout = NULL)
     {
         // can be called multiple times
@@ -158,6 +621,24 @@ public:
         return bind(sa.toString().c_str(), sa.port());
     }
 
+    bool bindReusePort(const IpAddr& sa, int backlog = -1)
+    {
+        // Binds with SO_REUSEPORT so that one server per loop thread can share the same port.
+        // The listener is owned (and freed) by the http server.
+        EvConnListener listener;
+        int flags = LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT;
+        if (!listener.newListener(sa, NULL, NULL, mBase, flags, backlog))
+        {
+            return false;
+        }
+        if (evhttp_bind_listener(mServer, listener.ptr()) == NULL)
+        {
+            return false;
+        }
+        listener.own(false);
+        return true;
+    }
+
     static
     std::string encodeUriString(const char* src)
     {
@@ -166,7 +647,7 @@ public:
         if (temp)
         {
             s.assign(temp);
-            free(temp);
+            EvMem::free(temp);
         }
         return s;
     }
@@ -179,7 +660,7 @@ public:
         if (temp)
         {
             s.assign(temp);
-            free(temp);
+            EvMem::free(temp);
         }
         return s;
     }
@@ -193,18 +674,1192 @@ public:
         if (temp)
         {
             s.assign(temp);
-            free(temp);
+            EvMem::free(temp);
         }
         return s;
     }
 
+    inline struct evhttp* ptr()
+    {
+        return mServer;
+    }
+
 protected:
     struct evhttp* mServer;
+    struct event_base* mBase;
+    ssize_t mMaxBody;
+    ssize_t mMaxHeaders;
+
+    static
+    std::atomic<BevCheck>& tlsCheck()
+    {
+        // Set by setTls(), so only programs using levtls.h link OpenSSL
+        static std::atomic<BevCheck> check(NULL);
+        return check;
+    }
 
 private:
     EvHttpServer();
 };
 
+
+
+class EvRouteParams
+{
+public:
+    // Captures of a matched route: ':name' segments and the trailing '*name'.  Values point into
+    // the request's path (not percent-decoded) and are valid for the duration of the handler.
+
+    enum { MaxParams = 8 };
+
+    EvRouteParams() :
+        mCount(0)
+    {
+    }
+
+    inline int count() const
+    {
+        return mCount;
+    }
+    inline const char* name(int i) const
+    {
+        return mNames[i];
+    }
+    inline const EvStrView& value(int i) const
+    {
+        return mValues[i];
+    }
+
+    EvStrView find(const char* name) const
+    {
+        for (int i = 0; i < mCount; i++)
+        {
+            if (strcmp(mNames[i], name) == 0)
+            {
+                return mValues[i];
+            }
+        }
+        return EvStrView();
+    }
+
+    inline std::string str(const char* name) const
+    {
+        return find(name).str();
+    }
+
+    inline void clear()
+    {
+        mCount = 0;
+    }
+    inline bool push(const char* name, const char* value, size_t len)
+    {
+        if (mCount >= MaxParams)
+        {
+            return false;
+        }
+        mNames[mCount] = name;
+        mValues[mCount] = EvStrView(value, len);
+        mCount++;
+        return true;
+    }
+    inline void pop()
+    {
+        mCount--;
+    }
+
+protected:
+    int mCount;
+    const char* mNames[MaxParams];
+    EvStrView mValues[MaxParams];
+};
+
+
+class EvHttpRouter
+{
+public:
+    // Method aware radix trie router.  Patterns are made of static text, ':name' captures (one
+    // path segment) and a final '*name' capture (rest of the path):
+    //
+    //      router.add(EVHTTP_REQ_GET, "/users/:id", onUser);
+    //      router.add(EVHTTP_REQ_GET | EVHTTP_REQ_HEAD, "/files/*path", onFile);
+    //      router.attach(http);
+    //
+    // Static text takes precedence over captures, unless its route doesn't take the method:
+    // with GET /users/me and POST /users/:id, POST /users/me goes to :id.  A path that only
+    // has routes for other methods gets a 405 listing them in Allow.  Lookup cost depends on
+    // the path length, not on the number of routes, and does not allocate.
+    //
+    // Dispatched requests are counted in EvMetrics by status class, with their latency; this
+    // uses the request's on complete callback.  Handlers that need one too install it with
+    // setOnComplete(), which runs it after the router's: evhttp_request_set_on_complete_cb()
+    // would replace the router's and the request would go uncounted.
+    //
+    // A route can cap its request body and header sizes below the server's, and a streaming
+    // route gets its body in chunks as it arrives instead of all of it buffered first:
+    //
+    //      router.addStreaming(EVHTTP_REQ_PUT, "/upload/:name", onUploadChunk, onUploadDone,
+    //          NULL, 1024 * 1024 * 1024);
+    //
+    // The chunk handler consumes each chunk (what it leaves is drained) and can pause the
+    // request's input for backpressure; the route's handler runs once the body is complete and
+    // replies.  Streaming needs libevent 2.2 (evhttp_set_newreqcb); with older versions the
+    // whole body is read first and handed to the chunk handler as one chunk.  Only
+    // EvHttpServer::setMaxBodySize() bounds that buffering, so set it on 2.1 servers.
+
+    typedef void (*Handler)(struct evhttp_request* req, const EvRouteParams& params, void* arg);
+    typedef EvHttpConnState::CompleteCallback CompleteCallback;
+    typedef void (*ChunkHandler)(struct evhttp_request* req, const EvRouteParams& params, EvBuffer& chunk,
+        void* arg);
+
+    EvHttpRouter() :
+        mRoot(new Node()),
+        mNotFound(NULL),
+        mNotFoundArg(NULL)
+    {
+    }
+    ~EvHttpRouter()
+    {
+        detachAll();
+        delete mRoot;
+    }
+
+    bool add(int methods, const char* pattern, Handler handler, void* arg = NULL, ssize_t maxbody = -1,
+        ssize_t maxheaders = -1)
+    {
+        // 'methods' is a mask of evhttp_cmd_type values, 0 for any method.  Requests over
+        // 'maxbody' get 413, over 'maxheaders' 431 (-1: the server's limits).
+        return addRoute(methods, pattern, handler, NULL, arg, maxbody, maxheaders);
+    }
+
+    bool addStreaming(int methods, const char* pattern, ChunkHandler onchunk, Handler handler, void* arg = NULL,
+        ssize_t maxbody = -1, ssize_t maxheaders = -1)
+    {
+        // With libevent 2.2 'maxbody' is applied before the body is read.  Before 2.2 it is
+        // only checked once the whole body has been buffered, so it isn't a memory cap there:
+        // the server's limit is.
+        return addRoute(methods, pattern, handler, onchunk, arg, maxbody, maxheaders);
+    }
+
+    void setNotFound(EvHttpServer::RouteCallback callback, void* arg = NULL)
+    {
+        mNotFound = callback;
+        mNotFoundArg = arg;
+    }
+
+    bool addMetrics(const char* path = "/metrics")
+    {
+        // Serves EvMetrics in Prometheus text format
+        return add(EVHTTP_REQ_GET, path, onMetrics);
+    }
+
+    void attach(EvHttpServer& server)
+    {
+        // Routes every request of the server through this router
+        server.setDefaultRoute(onRequest, this);
+
+        Attachments& all = attachments();
+        pthread_mutex_lock(&all.lock);
+        for (size_t i = 0; i < all.list.size(); i++)
+        {
+            if (all.list[i].http == server.ptr())
+            {
+                all.list.erase(all.list.begin() + i);
+                break;
+            }
+        }
+        Attachment a;
+        a.http = server.ptr();
+        a.server = &server;
+        a.router = this;
+        all.list.push_back(a);
+        all.version.store(all.version.load() + 1, std::memory_order_release);
+        pthread_mutex_unlock(&all.lock);
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+        evhttp_set_newreqcb(server.ptr(), onNewRequest, NULL);
+#endif
+    }
+
+    bool dispatch(struct evhttp_request* req)
+    {
+        // Returns false if no route matched (and the not found handler was used)
+
+        EvLoopMetrics::inc(EvMetrics::local().events);
+        uint64_t start = EvMetrics::nowUsecs();
+        evhttp_request_set_on_complete_cb(req, onComplete, (void*)(uintptr_t)start);
+
+        Completions& c = completions();
+        c.current = req;
+        c.start = start;
+        bool found = route(req);
+        c.current = NULL;
+        return found;
+    }
+
+    static
+    void setOnComplete(struct evhttp_request* req, CompleteCallback callback, void* arg)
+    {
+        // Runs 'callback' once the reply has been written, after the router has counted the
+        // request.  Call it on the request's loop thread; the latency is only recorded when
+        // it is called from the handler itself.  Kept with the connection (EvHttpConnState),
+        // so it goes away with it if the client leaves before the reply.
+        struct evhttp_connection* conn = evhttp_request_get_connection(req);
+        if (conn == NULL)
+        {
+            return;
+        }
+        Completions& c = completions();
+        EvHttpConnState* s = EvHttpConnState::get(conn);
+        s->req = req;
+        s->onComplete = callback;
+        s->completeArg = arg;
+        s->start = (req == c.current) ? c.start : 0;
+        evhttp_request_set_on_complete_cb(req, onChainedComplete, s);
+    }
+
+    struct Route
+    {
+        int methods;
+        Handler handler;
+        ChunkHandler onChunk;           // Streaming routes only
+        void* arg;
+        ssize_t maxBody;                // -1 for the server's limit
+        ssize_t maxHeaders;
+    };
+
+    const Route* match(int method, const char* path, size_t pathlen, EvRouteParams& params, int* status = NULL,
+        int* allowed = NULL)
+    {
+        // Finds the route for method and path, filling params.  Static text is tried before
+        // captures, and a path whose route lacks the method backtracks into the captures.  On
+        // failure *status is 404 or 405 (the path matched only for other methods, whose mask
+        // goes in *allowed).
+
+        params.clear();
+        int others = 0;
+        const Route* r = matchNode(mRoot, path, pathlen, method, params, others);
+        if (r == NULL)
+        {
+            if (status)
+            {
+                *status = others ? 405 : 404;
+            }
+            if (allowed)
+            {
+                *allowed = others;
+            }
+        }
+        return r;
+    }
+
+protected:
+    struct Node
+    {
+        std::string label;              // Static text matched by this node
+        std::string firstChars;         // firstChars[i] == children[i]->label[0]
+        std::vector<Node*> children;
+        Node* param;                    // ':name' capture
+        std::string paramName;
+        Node* wildcard;                 // '*name' capture
+        std::string wildName;
+        std::vector<Route> routes;
+
+        Node() :
+            param(NULL),
+            wildcard(NULL)
+        {
+        }
+        ~Node()
+        {
+            for (size_t i = 0; i < children.size(); i++)
+            {
+                delete children[i];
+            }
+            delete param;
+            delete wildcard;
+        }
+    };
+
+    struct Attachment
+    {
+        struct evhttp* http;
+        EvHttpServer* server;
+        EvHttpRouter* router;
+    };
+
+    struct Attachments
+    {
+        // Servers attached to routers, for the per-request callbacks that only get the evhttp
+        pthread_mutex_t lock;
+        std::vector<Attachment> list;
+        std::atomic<uint64_t> version;
+
+        Attachments()
+        {
+            pthread_mutex_init(&lock, NULL);
+            version.store(1);
+        }
+    };
+
+    struct Completions
+    {
+        // Per loop thread
+        struct evhttp_request* current; // Being dispatched
+        uint64_t start;
+
+        Completions() :
+            current(NULL),
+            start(0)
+        {
+        }
+    };
+
+    Node* mRoot;
+    EvHttpServer::RouteCallback mNotFound;
+    void* mNotFoundArg;
+
+    bool addRoute(int methods, const char* pattern, Handler handler, ChunkHandler onchunk, void* arg,
+        ssize_t maxbody, ssize_t maxheaders)
+    {
+        if (pattern == NULL || pattern[0] != '/')
+        {
+            dbgerr("Route pattern must start with '/': %s\n", pattern);
+            return false;
+        }
+
+        Route r;
+        r.methods = methods;
+        r.handler = handler;
+        r.onChunk = onchunk;
+        r.arg = arg;
+        r.maxBody = maxbody;
+        r.maxHeaders = maxheaders;
+        return insert(mRoot, pattern, r);
+    }
+
+    bool addRoute(Node* n, const Route& r)
+    {
+        for (size_t i = 0; i < n->routes.size(); i++)
+        {
+            if ((n->routes[i].methods & r.methods) || n->routes[i].methods == 0 || r.methods == 0)
+            {
+                dbgerr("Route already exists for these methods\n");
+                return false;
+            }
+        }
+        n->routes.push_back(r);
+        return true;
+    }
+
+    bool insert(Node* n, const char* pattern, const Route& r)
+    {
+        // Inserts the rest of 'pattern' below n (whose label has been consumed)
+
+        if (*pattern == '\0')
+        {
+            return addRoute(n, r);
+        }
+
+        if (*pattern == ':')
+        {
+            const char* end = strchr(pattern, '/');
+            std::string name = end ? std::string(pattern + 1, end - pattern - 1) : std::string(pattern + 1);
+            if (n->param == NULL)
+            {
+                n->param = new Node();
+                n->paramName = name;
+            }
+            else if (n->paramName != name)
+            {
+                dbgerr("Conflicting capture names :%s and :%s\n", n->paramName.c_str(), name.c_str());
+                return false;
+            }
+            return insert(n->param, end ? end : "", r);
+        }
+
+        if (*pattern == '*')
+        {
+            if (n->wildcard == NULL)
+            {
+                n->wildcard = new Node();
+                n->wildName = pattern + 1;
+            }
+            else if (n->wildName != pattern + 1)
+            {
+                dbgerr("Conflicting capture names *%s and *%s\n", n->wildName.c_str(), pattern + 1);
+                return false;
+            }
+            return addRoute(n->wildcard, r);
+        }
+
+        size_t len = strcspn(pattern, ":*");
+        return insertStatic(n, std::string(pattern, len), pattern + len, r);
+    }
+
+    bool insertStatic(Node* n, const std::string& text, const char* rest, const Route& r)
+    {
+        size_t idx = n->firstChars.find(text[0]);
+        if (idx == std::string::npos)
+        {
+            Node* child = new Node();
+            child->label = text;
+            n->children.push_back(child);
+            n->firstChars.push_back(text[0]);
+            return insert(child, rest, r);
+        }
+
+        Node* child = n->children[idx];
+        size_t common = 0;
+        while (common < text.size() && common < child->label.size() && text[common] == child->label[common])
+        {
+            common++;
+        }
+
+        if (common < child->label.size())
+        {
+            // Split the child at the end of the common prefix
+            Node* mid = new Node();
+            mid->label = child->label.substr(0, common);
+            child->label.erase(0, common);
+            mid->children.push_back(child);
+            mid->firstChars.push_back(child->label[0]);
+            n->children[idx] = mid;
+            child = mid;
+        }
+
+        if (common == text.size())
+        {
+            return insert(child, rest, r);
+        }
+        return insertStatic(child, text.substr(common), rest, r);
+    }
+
+    static
+    const Route* findRoute(Node* n, int method, int& others)
+    {
+        // Adds the methods of n's routes to 'others' if none takes 'method'
+        for (size_t i = 0; i < n->routes.size(); i++)
+        {
+            if (n->routes[i].methods == 0 || (n->routes[i].methods & method))
+            {
+                return &n->routes[i];
+            }
+        }
+        for (size_t i = 0; i < n->routes.size(); i++)
+        {
+            others |= n->routes[i].methods;
+        }
+        return NULL;
+    }
+
+    const Route* matchWildcard(Node* n, const char* path, size_t len, int method, EvRouteParams& params,
+        int& others)
+    {
+        if (n->wildcard == NULL || !params.push(n->wildName.c_str(), path, len))
+        {
+            return NULL;
+        }
+        const Route* r = findRoute(n->wildcard, method, others);
+        if (r == NULL)
+        {
+            params.pop();
+        }
+        return r;
+    }
+
+    const Route* matchNode(Node* n, const char* path, size_t len, int method, EvRouteParams& params,
+        int& others)
+    {
+        // Matches the rest of the path below n; backtracks from static text to captures
+
+        if (len == 0)
+        {
+            const Route* r = findRoute(n, method, others);
+            return r ? r : matchWildcard(n, path, 0, method, params, others);
+        }
+
+        const char* idx = (const char*)memchr(n->firstChars.data(), path[0], n->firstChars.size());
+        if (idx)
+        {
+            Node* child = n->children[idx - n->firstChars.data()];
+            size_t l = child->label.size();
+            if (len >= l && memcmp(child->label.data(), path, l) == 0)
+            {
+                const Route* found = matchNode(child, path + l, len - l, method, params, others);
+                if (found)
+                {
+                    return found;
+                }
+            }
+        }
+
+        if (n->param)
+        {
+            const char* slash = (const char*)memchr(path, '/', len);
+            size_t seglen = slash ? (size_t)(slash - path) : len;
+            if (seglen > 0 && params.push(n->paramName.c_str(), path, seglen))
+            {
+                const Route* found = matchNode(n->param, path + seglen, len - seglen, method, params, others);
+                if (found)
+                {
+                    return found;
+                }
+                params.pop();
+            }
+        }
+
+        return matchWildcard(n, path, len, method, params, others);
+    }
+
+    static
+    void addAllow(struct evhttp_request* req, int methods)
+    {
+        static const struct { int cmd; const char* name; } names[] =
+        {
+            { EVHTTP_REQ_GET, "GET" },
+            { EVHTTP_REQ_HEAD, "HEAD" },
+            { EVHTTP_REQ_POST, "POST" },
+            { EVHTTP_REQ_PUT, "PUT" },
+            { EVHTTP_REQ_DELETE, "DELETE" },
+            { EVHTTP_REQ_PATCH, "PATCH" },
+            { EVHTTP_REQ_OPTIONS, "OPTIONS" },
+            { EVHTTP_REQ_TRACE, "TRACE" },
+            { EVHTTP_REQ_CONNECT, "CONNECT" }
+        };
+        std::string allow;
+        for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++)
+        {
+            if (methods & names[i].cmd)
+            {
+                if (!allow.empty())
+                {
+                    allow.append(", ");
+                }
+                allow.append(names[i].name);
+            }
+        }
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Allow", allow.c_str());
+    }
+
+    bool route(struct evhttp_request* req)
+    {
+        const char* path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+        if (path == NULL)
+        {
+            path = "";
+        }
+
+        EvRouteParams params;
+        int status;
+        int allowed;
+        const Route* r = match(evhttp_request_get_command(req), path, strlen(path), params, &status, &allowed);
+        if (r)
+        {
+            if (r->maxBody >= 0 && evbuffer_get_length(evhttp_request_get_input_buffer(req)) > (size_t)r->maxBody)
+            {
+                evhttp_send_error(req, 413, NULL);
+                return true;
+            }
+            if (r->maxHeaders >= 0 && headersSize(req) > (size_t)r->maxHeaders)
+            {
+                evhttp_send_error(req, 431, "Request Header Fields Too Large");
+                return true;
+            }
+            if (r->onChunk)
+            {
+                // Whatever wasn't streamed (all of it before libevent 2.2)
+                EvBuffer body(evhttp_request_get_input_buffer(req));
+                if (body.length() > 0)
+                {
+                    r->onChunk(req, params, body, r->arg);
+                    body.drain(body.length());
+                }
+            }
+            r->handler(req, params, r->arg);
+            return true;
+        }
+
+        if (status == 405)
+        {
+            // Not evhttp_send_error(): it clears the output headers
+            addAllow(req, allowed);
+            evhttp_send_reply(req, 405, "Method Not Allowed", NULL);
+        }
+        else if (mNotFound)
+        {
+            mNotFound(req, mNotFoundArg);
+        }
+        else
+        {
+            evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+        }
+        return false;
+    }
+
+    static
+    void onRequest(struct evhttp_request* req, void* arg)
+    {
+        ((EvHttpRouter*)arg)->dispatch(req);
+    }
+
+    static
+    Attachments& attachments()
+    {
+        static Attachments* all = new Attachments();
+        return *all;
+    }
+
+    static
+    bool findAttachment(struct evhttp* http, Attachment& out)
+    {
+        // Called for every request; each thread remembers the last server it looked up
+        static thread_local Attachment cached = { NULL, NULL, NULL };
+        static thread_local uint64_t cachedVersion = 0;
+
+        Attachments& all = attachments();
+        uint64_t version = all.version.load(std::memory_order_acquire);
+        if (cached.http != http || cachedVersion != version)
+        {
+            cached.http = NULL;
+            pthread_mutex_lock(&all.lock);
+            for (size_t i = 0; i < all.list.size(); i++)
+            {
+                if (all.list[i].http == http)
+                {
+                    cached = all.list[i];
+                    break;
+                }
+            }
+            cachedVersion = all.version.load(std::memory_order_relaxed);
+            pthread_mutex_unlock(&all.lock);
+            if (cached.http == NULL)
+            {
+                return false;
+            }
+        }
+        out = cached;
+        return true;
+    }
+
+    void detachAll()
+    {
+        Attachments& all = attachments();
+        pthread_mutex_lock(&all.lock);
+        for (size_t i = all.list.size(); i-- > 0;)
+        {
+            if (all.list[i].router == this)
+            {
+                all.list.erase(all.list.begin() + i);
+            }
+        }
+        all.version.store(all.version.load() + 1, std::memory_order_release);
+        pthread_mutex_unlock(&all.lock);
+    }
+
+    const Route* matchRequest(struct evhttp_request* req, EvRouteParams& params)
+    {
+        const char* path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+        if (path == NULL)
+        {
+            path = "";
+        }
+        return match(evhttp_request_get_command(req), path, strlen(path), params);
+    }
+
+    static
+    size_t headersSize(struct evhttp_request* req)
+    {
+        // As sent: 'key: value\r\n'
+        size_t size = 0;
+        struct evkeyvalq* hdrs = evhttp_request_get_input_headers(req);
+        for (struct evkeyval* kv = hdrs->tqh_first; kv; kv = kv->next.tqe_next)
+        {
+            size += strlen(kv->key) + strlen(kv->value) + 4;
+        }
+        return size;
+    }
+
+    static
+    int onNewRequest(struct evhttp_request* req, void* arg)
+    {
+        // libevent 2.2+: a request is about to be read
+        evhttp_request_set_header_cb(req, onHeaders);
+        return 0;
+    }
+
+    static
+    int onHeaders(struct evhttp_request* req, void* arg)
+    {
+        // The headers are in, the body isn't: apply the route's limits and start streaming
+        struct evhttp_connection* conn = evhttp_request_get_connection(req);
+        Attachment a;
+        if (!findAttachment(evhttp_connection_get_server(conn), a))
+        {
+            return 0;
+        }
+        EvRouteParams params;
+        const Route* r = a.router->matchRequest(req, params);
+
+        // The body limit is per connection in libevent, so it is set for every request
+        evhttp_connection_set_max_body_size(conn, (r && r->maxBody >= 0) ? r->maxBody : a.server->maxBodySize());
+
+        if (r == NULL)
+        {
+            return 0;
+        }
+        if (r->maxHeaders >= 0 && headersSize(req) > (size_t)r->maxHeaders)
+        {
+            // Drops the connection
+            return -1;
+        }
+        if (r->onChunk)
+        {
+            evhttp_request_set_chunked_cb(req, onChunk);
+        }
+        return 0;
+    }
+
+    static
+    void onChunk(struct evhttp_request* req, void* arg)
+    {
+        Attachment a;
+        if (!findAttachment(evhttp_connection_get_server(evhttp_request_get_connection(req)), a))
+        {
+            return;
+        }
+        EvRouteParams params;
+        const Route* r = a.router->matchRequest(req, params);
+        if (r && r->onChunk)
+        {
+            EvBuffer chunk(evhttp_request_get_input_buffer(req));
+            r->onChunk(req, params, chunk, r->arg);
+        }
+    }
+
+    static
+    Completions& completions()
+    {
+        static thread_local Completions c;
+        return c;
+    }
+
+    static
+    void onComplete(struct evhttp_request* req, void* arg)
+    {
+        // arg is the dispatch time
+        EvLoopMetrics& m = EvMetrics::local();
+        m.countHttp(evhttp_request_get_response_code(req));
+        m.httpLatency.record(EvMetrics::nowUsecs() - (uint64_t)(uintptr_t)arg);
+    }
+
+    static
+    void onChainedComplete(struct evhttp_request* req, void* arg)
+    {
+        // arg is the connection's EvHttpConnState, still open while its reply completes
+        EvHttpConnState* s = (EvHttpConnState*)arg;
+        if (s->req != req)
+        {
+            return;
+        }
+        CompleteCallback callback = s->onComplete;
+        void* cbarg = s->completeArg;
+        uint64_t start = s->start;
+        s->req = NULL;
+        s->onComplete = NULL;
+
+        EvLoopMetrics& m = EvMetrics::local();
+        m.countHttp(evhttp_request_get_response_code(req));
+        if (start)
+        {
+            m.httpLatency.record(EvMetrics::nowUsecs() - start);
+        }
+        callback(req, cbarg);
+    }
+
+    static
+    void onMetrics(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+    {
+        EvHttpRequest evreq(req);
+        EvBuffer out = evreq.output();
+
+        EvMetrics::writePrometheus(out);
+        evhttp_add_header(evreq.outputHdrs(), "Content-Type", "text/plain; version=0.0.4");
+        evreq.sendReply(200, "OK");
+    }
+
+private:
+    EvHttpRouter(const EvHttpRouter&);
+    EvHttpRouter& operator=(const EvHttpRouter&);
+};
+
+
+class EvHttpClient
+{
+public:
+    // Client side of evhttp with a pool of keep-alive connections per host.  A request goes out
+    // on an idle connection of its host if there is one, on a new connection while the host is
+    // under its connection cap, else waits for the next response on that host.  Connections
+    // stay open between requests (evhttp reconnects if the server closed one), so only the
+    // first requests to a host pay for the TCP setup.  One client per loop.
+    //
+    //      client.request(IpAddr("127.0.0.1", 8080), EVHTTP_REQ_GET, "/hello", onResponse, arg);
+    //
+    // The response is only valid during the callback.  Hostnames are resolved with a blocking
+    // lookup when a connection is made; pass addresses on a loop that must not block.
+
+    // error is 0 on a response (of any status), else an evhttp_request_error or -1
+    typedef void (*ResponseCallback)(EvHttpRequest& resp, int error, void* arg);
+
+    EvHttpClient(struct event_base* base, int maxperhost = 8) :
+        mBase(base),
+        mMaxPerHost((maxperhost > 0) ? maxperhost : 1),
+        mTimeout(30),
+        mRetries(0),
+        mRequests(0),
+        mConnects(0),
+        mCloses(0),
+        mFailEv(NULL)
+    {
+    }
+    ~EvHttpClient()
+    {
+        // Outstanding requests are dropped without their callback
+        for (size_t i = 0; i < mFailed.size(); i++)
+        {
+            delete mFailed[i];
+        }
+        if (mFailEv)
+        {
+            event_free(mFailEv);
+        }
+        for (std::map<std::string, Host*>::iterator it = mHosts.begin(); it != mHosts.end(); ++it)
+        {
+            Host* h = it->second;
+            while (!h->waiting.empty())
+            {
+                Call* c = h->waiting.front();
+                h->waiting.pop_front();
+                evhttp_request_free(c->req);
+                delete c;
+            }
+            for (size_t i = 0; i < h->conns.size(); i++)
+            {
+                Conn* conn = h->conns[i];
+                evhttp_connection_free(conn->evcon);
+                delete conn->call;
+                delete conn;
+            }
+            delete h;
+        }
+    }
+
+    void setTimeout(int secs, int retries = 0)
+    {
+        // For connections made from now on: connect/read/write timeout and connect retries
+        mTimeout = secs;
+        mRetries = retries;
+    }
+
+    bool request(const char* host, int port, enum evhttp_cmd_type method, const char* uri,
+        ResponseCallback callback, void* arg, EvBuffer* body = NULL, EvKeyValues* headers = NULL)
+    {
+        // 'body' is moved into the request (left empty); 'headers' are copied.  Returns false
+        // (without calling back) if the request could not be created.
+        Call* c = new Call();
+        c->client = this;
+        c->method = method;
+        c->uri = uri;
+        c->callback = callback;
+        c->arg = arg;
+        c->req = evhttp_request_new(onDone, c);
+        if (c->req == NULL)
+        {
+            dbgerr("Failed to create http request\n");
+            delete c;
+            return false;
+        }
+        evhttp_request_set_error_cb(c->req, onError);
+
+        Host* h = findHost(host, port);
+        c->host = h;
+
+        struct evkeyvalq* out = evhttp_request_get_output_headers(c->req);
+        evhttp_add_header(out, "Host", h->hostHdr.c_str());
+        if (headers)
+        {
+            for (headers->moveFirst(); !headers->eof(); headers->moveNext())
+            {
+                evhttp_add_header(out, headers->key(), headers->value());
+            }
+        }
+        if (body)
+        {
+            evbuffer_add_buffer(evhttp_request_get_output_buffer(c->req), body->ptr());
+        }
+
+        mRequests++;
+        Conn* conn = NULL;
+        if (!h->idle.empty())
+        {
+            conn = h->idle.back();
+            h->idle.pop_back();
+        }
+        else if ((int)h->conns.size() < mMaxPerHost)
+        {
+            conn = newConn(h);
+        }
+        if (conn == NULL)
+        {
+            h->waiting.push_back(c);
+        }
+        else if (!send(conn, c))
+        {
+            release(conn);
+        }
+        return true;
+    }
+    inline bool request(const IpAddr& host, enum evhttp_cmd_type method, const char* uri,
+        ResponseCallback callback, void* arg, EvBuffer* body = NULL, EvKeyValues* headers = NULL)
+    {
+        return request(host.toString().c_str(), host.port(), method, uri, callback, arg, body, headers);
+    }
+
+    // Stats
+
+    inline uint64_t requests() const
+    {
+        return mRequests;
+    }
+    inline uint64_t connects() const
+    {
+        // Connections created; requests() - connects() were sent on a pooled connection
+        return mConnects;
+    }
+    inline uint64_t closes() const
+    {
+        // Pooled connections closed (by either side); evhttp reopens them on the next request
+        return mCloses;
+    }
+    size_t waiting() const
+    {
+        size_t n = 0;
+        for (std::map<std::string, Host*>::const_iterator it = mHosts.begin(); it != mHosts.end(); ++it)
+        {
+            n += it->second->waiting.size();
+        }
+        return n;
+    }
+
+protected:
+    struct Host;
+    struct Conn;
+
+    struct Call
+    {
+        EvHttpClient* client;
+        Host* host;
+        Conn* conn;
+        struct evhttp_request* req;
+        enum evhttp_cmd_type method;
+        std::string uri;
+        ResponseCallback callback;
+        void* arg;
+        int error;
+
+        Call() :
+            client(NULL),
+            host(NULL),
+            conn(NULL),
+            req(NULL),
+            method(EVHTTP_REQ_GET),
+            callback(NULL),
+            arg(NULL),
+            error(0)
+        {
+        }
+    };
+
+    struct Conn
+    {
+        EvHttpClient* client;
+        Host* host;
+        struct evhttp_connection* evcon;
+        Call* call;             // In flight on this connection
+    };
+
+    struct Host
+    {
+        std::string name;
+        int port;
+        std::string hostHdr;
+        std::vector<Conn*> conns;
+        std::vector<Conn*> idle;
+        std::deque<Call*> waiting;
+    };
+
+    struct event_base* mBase;
+    int mMaxPerHost;
+    int mTimeout;
+    int mRetries;
+    std::map<std::string, Host*> mHosts;
+    uint64_t mRequests;
+    uint64_t mConnects;
+    uint64_t mCloses;
+    std::vector<Call*> mFailed;         // To call back from the loop
+    struct event* mFailEv;
+
+    Host* findHost(const char* name, int port)
+    {
+        char key[300];
+        evutil_snprintf(key, sizeof(key), "%s:%d", name, port);
+        std::map<std::string, Host*>::iterator it = mHosts.find(key);
+        if (it != mHosts.end())
+        {
+            return it->second;
+        }
+
+        Host* h = new Host();
+        h->name = name;
+        h->port = port;
+        h->hostHdr = (port == 80) ? std::string(name) : std::string(key);
+        mHosts[key] = h;
+        return h;
+    }
+
+    Conn* newConn(Host* h)
+    {
+        struct evhttp_connection* evcon = evhttp_connection_base_new(mBase, NULL, h->name.c_str(), h->port);
+        if (evcon == NULL)
+        {
+            dbgerr("Failed to create http connection to %s:%d\n", h->name.c_str(), h->port);
+            return NULL;
+        }
+        evhttp_connection_set_timeout(evcon, mTimeout);
+        evhttp_connection_set_retries(evcon, mRetries);
+
+        Conn* conn = new Conn();
+        conn->client = this;
+        conn->host = h;
+        conn->evcon = evcon;
+        conn->call = NULL;
+        evhttp_connection_set_closecb(evcon, onClose, conn);
+
+        h->conns.push_back(conn);
+        mConnects++;
+        return conn;
+    }
+
+    bool send(Conn* conn, Call* c)
+    {
+        // On failure the call is failed (called back from the loop) and conn is left unused
+        conn->call = c;
+        c->conn = conn;
+        if (evhttp_make_request(conn->evcon, c->req, c->method, c->uri.c_str()) != 0)
+        {
+            // The connect failed at once (ie no socket, EMFILE): evhttp has taken the request
+            // off the connection but not freed it.  It only frees it itself when it can't copy
+            // the uri, out of memory.
+            dbgerr("Failed to send http request %s\n", c->uri.c_str());
+            evhttp_request_free(c->req);
+            c->req = NULL;
+            c->conn = NULL;
+            conn->call = NULL;
+            fail(c);
+            return false;
+        }
+        return true;
+    }
+
+    void release(Conn* conn)
+    {
+        // Hands the connection to the next waiting request of its host, else back to idle
+        Host* h = conn->host;
+        while (!h->waiting.empty())
+        {
+            Call* next = h->waiting.front();
+            h->waiting.pop_front();
+            if (send(conn, next))
+            {
+                return;
+            }
+        }
+        h->idle.push_back(conn);
+    }
+
+    void fail(Call* c)
+    {
+        // Calls back with error -1 from the loop rather than from inside request()
+        if (mFailEv == NULL)
+        {
+            mFailEv = evtimer_new(mBase, onFailed, this);
+        }
+        mFailed.push_back(c);
+        struct timeval now = { 0, 0 };
+        if (mFailEv == NULL || evtimer_add(mFailEv, &now) != 0)
+        {
+            dbgerr("Failed to schedule http failure callback\n");
+        }
+    }
+
+    static
+    void onFailed(evutil_socket_t fd, short what, void* arg)
+    {
+        EvHttpClient* self = (EvHttpClient*)arg;
+        std::vector<Call*> failed;
+        failed.swap(self->mFailed);
+        for (size_t i = 0; i < failed.size(); i++)
+        {
+            Call* c = failed[i];
+            if (c->callback)
+            {
+                EvHttpRequest resp(NULL);
+                c->callback(resp, -1, c->arg);
+            }
+            delete c;
+        }
+    }
+
+    static
+    void onError(enum evhttp_request_error error, void* arg)
+    {
+        ((Call*)arg)->error = (int)error;
+    }
+
+    static
+    void onDone(struct evhttp_request* req, void* arg)
+    {
+        // req is NULL if the request failed
+        Call* c = (Call*)arg;
+        EvHttpClient* self = c->client;
+        Conn* conn = c->conn;
+
+        int error = c->error;
+        if (req == NULL || evhttp_request_get_response_code(req) == 0)
+        {
+            error = error ? error : -1;
+        }
+        if (c->callback)
+        {
+            EvHttpRequest resp(req);
+            c->callback(resp, error, c->arg);
+        }
+
+        conn->call = NULL;
+        delete c;
+        self->release(conn);
+    }
+
+    static
+    void onClose(struct evhttp_connection* evcon, void* arg)
+    {
+        ((Conn*)arg)->client->mCloses++;
+    }
+
+private:
+    EvHttpClient(const EvHttpClient&);
+    EvHttpClient& operator=(const EvHttpClient&);
+};
+
 } // namespace lev
 
 #endif // _LEVHTTP_H
@@ -0,0 +1,410 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVMETRICS_H
+#define _LEVMETRICS_H
+
+#include <pthread.h>
+#include <time.h>
+
+#include <vector>
+
+namespace lev
+{
+
+class EvHistogram;
+struct EvLoopMetrics;
+class EvMetrics;
+
+
+class EvHistogram
+{
+public:
+    // Log-linear histogram of non-negative integers (ie latencies in microseconds): 32 buckets
+    // per power of two, so any recorded value is known to within 3% (HDR histogram style with
+    // about 1.5 significant digits).  Fixed size, no allocation on record.  Single writer;
+    // readers on other threads see relaxed values.
+
+    enum
+    {
+        SubBits = 5,
+        SubCount = 1 << SubBits,
+        Buckets = (64 - SubBits + 1) * SubCount
+    };
+
+    EvHistogram()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        for (int i = 0; i < Buckets; i++)
+        {
+            mCounts[i].store(0, std::memory_order_relaxed);
+        }
+        mCount.store(0, std::memory_order_relaxed);
+        mSum.store(0, std::memory_order_relaxed);
+        mMax.store(0, std::memory_order_relaxed);
+    }
+
+    inline void record(uint64_t value)
+    {
+        inc(mCounts[bucketOf(value)], 1);
+        inc(mCount, 1);
+        inc(mSum, value);
+        if (value > mMax.load(std::memory_order_relaxed))
+        {
+            mMax.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    void merge(const EvHistogram& other)
+    {
+        // Adds other's counts to this one (reader side, ie to aggregate per-loop histograms)
+        for (int i = 0; i < Buckets; i++)
+        {
+            inc(mCounts[i], other.mCounts[i].load(std::memory_order_relaxed));
+        }
+        inc(mCount, other.count());
+        inc(mSum, other.sum());
+        if (other.max() > max())
+        {
+            mMax.store(other.max(), std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t percentile(double pct) const
+    {
+        // Highest value equivalent to the pct'th percentile (pct in 0..100), 0 when empty
+        uint64_t total = count();
+        if (total == 0)
+        {
+            return 0;
+        }
+        uint64_t rank = (uint64_t)(pct / 100.0 * total + 0.5);
+        if (rank == 0)
+        {
+            rank = 1;
+        }
+        uint64_t seen = 0;
+        for (int i = 0; i < Buckets; i++)
+        {
+            seen += mCounts[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+            {
+                uint64_t high = bucketHigh(i);
+                return (high < max()) ? high : max();
+            }
+        }
+        return max();
+    }
+
+    uint64_t countBelow(uint64_t limit) const
+    {
+        // Values < limit; exact when limit is a power of two (a bucket boundary)
+        uint64_t n = 0;
+        for (int i = 0; i < Buckets && bucketLow(i) < limit; i++)
+        {
+            n += mCounts[i].load(std::memory_order_relaxed);
+        }
+        return n;
+    }
+
+    inline uint64_t count() const
+    {
+        return mCount.load(std::memory_order_relaxed);
+    }
+    inline uint64_t sum() const
+    {
+        return mSum.load(std::memory_order_relaxed);
+    }
+    inline uint64_t max() const
+    {
+        return mMax.load(std::memory_order_relaxed);
+    }
+    inline double mean() const
+    {
+        uint64_t n = count();
+        return n ? (double)sum() / n : 0.0;
+    }
+
+    static inline
+    int bucketOf(uint64_t value)
+    {
+        if (value < SubCount)
+        {
+            return (int)value;
+        }
+        int msb = 63 - __builtin_clzll((unsigned long long)value);
+        int shift = msb - SubBits;
+        return ((shift + 1) << SubBits) + (int)((value >> shift) & (SubCount - 1));
+    }
+    static inline
+    uint64_t bucketLow(int bucket)
+    {
+        if (bucket < SubCount)
+        {
+            return bucket;
+        }
+        int shift = (bucket >> SubBits) - 1;
+        return (uint64_t)(SubCount + (bucket & (SubCount - 1))) << shift;
+    }
+    static inline
+    uint64_t bucketHigh(int bucket)
+    {
+        return (bucket + 1 < Buckets) ? bucketLow(bucket + 1) - 1 : ~(uint64_t)0;
+    }
+
+protected:
+    std::atomic<uint64_t> mCounts[Buckets];
+    std::atomic<uint64_t> mCount;
+    std::atomic<uint64_t> mSum;
+    std::atomic<uint64_t> mMax;
+
+    static inline
+    void inc(std::atomic<uint64_t>& c, uint64_t n)
+    {
+        EvCounter::inc(c, n);
+    }
+
+private:
+    EvHistogram(const EvHistogram&);
+    EvHistogram& operator=(const EvHistogram&);
+};
+
+
+struct EvLoopMetrics
+{
+    // Counters of one loop thread, bumped with inc(); EvMetrics::collect() sums every thread's
+    // on demand.
+
+    enum { HttpClasses = 6 };           // Index 1..5 is 1xx..5xx, 0 anything else
+
+    std::atomic<uint64_t> accepts;      // Connections accepted by EvConnectionPool
+    std::atomic<uint64_t> active;       // Open pooled connections (a gauge; see activeCount())
+    std::atomic<uint64_t> bytesIn;      // Read from pooled connections' sockets
+    std::atomic<uint64_t> bytesOut;     // Written to pooled connections' sockets
+    std::atomic<uint64_t> events;       // Callbacks dispatched by the pool, timer wheel and router
+    std::atomic<uint64_t> http[HttpClasses];
+    std::atomic<uint64_t> cacheHits;    // EvResponseCache lookups served from the cache
+    std::atomic<uint64_t> cacheMisses;  // ... and rendered
+    std::atomic<uint64_t> deflateIn;    // Bytes compressed by EvHttpCompressor and EvCompressedReply
+    std::atomic<uint64_t> deflateOut;   // ... and what they compressed to
+    EvHistogram httpLatency;            // Routed request to response complete, microseconds
+    EvHistogram loopLag;                // EvLoopMonitor probe lateness, microseconds
+
+    EvLoopMetrics()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        accepts.store(0, std::memory_order_relaxed);
+        active.store(0, std::memory_order_relaxed);
+        bytesIn.store(0, std::memory_order_relaxed);
+        bytesOut.store(0, std::memory_order_relaxed);
+        events.store(0, std::memory_order_relaxed);
+        for (int i = 0; i < HttpClasses; i++)
+        {
+            http[i].store(0, std::memory_order_relaxed);
+        }
+        cacheHits.store(0, std::memory_order_relaxed);
+        cacheMisses.store(0, std::memory_order_relaxed);
+        deflateIn.store(0, std::memory_order_relaxed);
+        deflateOut.store(0, std::memory_order_relaxed);
+        httpLatency.clear();
+        loopLag.clear();
+    }
+
+    static inline
+    void inc(std::atomic<uint64_t>& c, uint64_t n = 1)
+    {
+        EvCounter::inc(c, n);
+    }
+    static inline
+    void dec(std::atomic<uint64_t>& c)
+    {
+        EvCounter::dec(c);
+    }
+
+    inline int64_t activeCount() const
+    {
+        // A connection closed on another thread than it was accepted on leaves one thread's
+        // gauge negative; the sum over threads is still right
+        return (int64_t)active.load(std::memory_order_relaxed);
+    }
+
+    inline void countHttp(int status)
+    {
+        int cls = status / 100;
+        inc(http[(cls >= 1 && cls < HttpClasses) ? cls : 0]);
+    }
+
+private:
+    EvLoopMetrics(const EvLoopMetrics&);
+    EvLoopMetrics& operator=(const EvLoopMetrics&);
+};
+
+
+class EvMetrics
+{
+public:
+    // Process wide access to the per-thread EvLoopMetrics.  lev's pool, timer wheel and router
+    // update the calling thread's metrics; applications can add their own counts the same way:
+    //
+    //      EvLoopMetrics& m = EvMetrics::local();
+    //      EvLoopMetrics::inc(m.events);
+    //
+    // EvHttpRouter::addMetrics() serves the totals in Prometheus text format.
+
+    static inline
+    EvLoopMetrics& local()
+    {
+        static thread_local EvLoopMetrics* tl = NULL;
+        if (tl == NULL)
+        {
+            tl = new EvLoopMetrics();
+            Registry& reg = registry();
+            pthread_mutex_lock(&reg.lock);
+            reg.loops.push_back(tl);
+            pthread_mutex_unlock(&reg.lock);
+        }
+        return *tl;
+    }
+
+    static
+    int collect(EvLoopMetrics& out)
+    {
+        // Sums every thread's metrics into out (approximate while running); returns the number
+        // of threads.  Threads that exited keep their last counts.
+        out.clear();
+
+        Registry& reg = registry();
+        pthread_mutex_lock(&reg.lock);
+        for (size_t i = 0; i < reg.loops.size(); i++)
+        {
+            EvLoopMetrics* m = reg.loops[i];
+            EvLoopMetrics::inc(out.accepts, m->accepts.load(std::memory_order_relaxed));
+            EvLoopMetrics::inc(out.active, m->active.load(std::memory_order_relaxed));
+            EvLoopMetrics::inc(out.bytesIn, m->bytesIn.load(std::memory_order_relaxed));
+            EvLoopMetrics::inc(out.bytesOut, m->bytesOut.load(std::memory_order_relaxed));
+            EvLoopMetrics::inc(out.events, m->events.load(std::memory_order_relaxed));
+            for (int c = 0; c < EvLoopMetrics::HttpClasses; c++)
+            {
+                EvLoopMetrics::inc(out.http[c], m->http[c].load(std::memory_order_relaxed));
+            }
+            EvLoopMetrics::inc(out.cacheHits, m->cacheHits.load(std::memory_order_relaxed));
+            EvLoopMetrics::inc(out.cacheMisses, m->cacheMisses.load(std::memory_order_relaxed));
+            EvLoopMetrics::inc(out.deflateIn, m->deflateIn.load(std::memory_order_relaxed));
+            EvLoopMetrics::inc(out.deflateOut, m->deflateOut.load(std::memory_order_relaxed));
+            out.httpLatency.merge(m->httpLatency);
+            out.loopLag.merge(m->loopLag);
+        }
+        int count = (int)reg.loops.size();
+        pthread_mutex_unlock(&reg.lock);
+        return count;
+    }
+
+    static
+    void writePrometheus(EvBuffer& out)
+    {
+        // Text exposition format 0.0.4
+        EvLoopMetrics* m = new EvLoopMetrics();
+        int threads = collect(*m);
+
+        out.printf("# TYPE lev_threads gauge\nlev_threads %d\n", threads);
+        out.printf("# TYPE lev_accepts_total counter\nlev_accepts_total %lu\n",
+            (unsigned long)m->accepts.load(std::memory_order_relaxed));
+        out.printf("# TYPE lev_connections_active gauge\nlev_connections_active %ld\n",
+            (long)m->activeCount());
+        out.printf("# TYPE lev_bytes_in_total counter\nlev_bytes_in_total %lu\n",
+            (unsigned long)m->bytesIn.load(std::memory_order_relaxed));
+        out.printf("# TYPE lev_bytes_out_total counter\nlev_bytes_out_total %lu\n",
+            (unsigned long)m->bytesOut.load(std::memory_order_relaxed));
+        out.printf("# TYPE lev_events_total counter\nlev_events_total %lu\n",
+            (unsigned long)m->events.load(std::memory_order_relaxed));
+
+        static const char* classes[EvLoopMetrics::HttpClasses] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+        out.printf("# TYPE lev_http_requests_total counter\n");
+        for (int c = 0; c < EvLoopMetrics::HttpClasses; c++)
+        {
+            out.printf("lev_http_requests_total{class=\"%s\"} %lu\n", classes[c],
+                (unsigned long)m->http[c].load(std::memory_order_relaxed));
+        }
+        out.printf("# TYPE lev_http_cache_lookups_total counter\n");
+        out.printf("lev_http_cache_lookups_total{result=\"hit\"} %lu\n",
+            (unsigned long)m->cacheHits.load(std::memory_order_relaxed));
+        out.printf("lev_http_cache_lookups_total{result=\"miss\"} %lu\n",
+            (unsigned long)m->cacheMisses.load(std::memory_order_relaxed));
+        out.printf("# TYPE lev_http_deflate_bytes_total counter\n");
+        out.printf("lev_http_deflate_bytes_total{dir=\"in\"} %lu\n",
+            (unsigned long)m->deflateIn.load(std::memory_order_relaxed));
+        out.printf("lev_http_deflate_bytes_total{dir=\"out\"} %lu\n",
+            (unsigned long)m->deflateOut.load(std::memory_order_relaxed));
+
+        writeHistogram(out, "lev_http_request_duration_seconds", m->httpLatency);
+        writeHistogram(out, "lev_loop_lag_seconds", m->loopLag);
+        delete m;
+    }
+
+    static
+    void writeHistogram(EvBuffer& out, const char* name, const EvHistogram& hist)
+    {
+        // Microsecond histogram as a Prometheus histogram in seconds, bounds at powers of two
+        // from 16us to ~34s
+        out.printf("# TYPE %s histogram\n", name);
+        for (int shift = 4; shift <= 25; shift++)
+        {
+            uint64_t limit = (uint64_t)1 << shift;
+            out.printf("%s_bucket{le=\"%g\"} %lu\n", name, limit / 1e6, (unsigned long)hist.countBelow(limit));
+        }
+        out.printf("%s_bucket{le=\"+Inf\"} %lu\n", name, (unsigned long)hist.count());
+        out.printf("%s_sum %g\n", name, hist.sum() / 1e6);
+        out.printf("%s_count %lu\n", name, (unsigned long)hist.count());
+    }
+
+    static inline
+    uint64_t nowUsecs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+    static inline
+    uint64_t nowMsecs()
+    {
+        // Coarse (a tick, ie 4ms) and cheaper: for expiry times
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+protected:
+    struct Registry
+    {
+        // Metrics are kept after their thread exits
+        pthread_mutex_t lock;
+        std::vector<EvLoopMetrics*> loops;
+
+        Registry()
+        {
+            pthread_mutex_init(&lock, NULL);
+        }
+    };
+
+    static
+    Registry& registry()
+    {
+        static Registry* reg = new Registry();
+        return *reg;
+    }
+
+private:
+    EvMetrics();
+};
+
+} // namespace lev
+
+#endif // _LEVMETRICS_H
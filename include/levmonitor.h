@@ -0,0 +1,329 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVMONITOR_H
+#define _LEVMONITOR_H
+
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <time.h>
+
+#include "levmetrics.h"
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+#include <event2/watch.h>
+#endif
+
+namespace lev
+{
+
+class EvLoopMonitor;
+
+
+class EvLoopMonitor
+{
+public:
+    // Opt-in stall detection for one loop.  A probe timer measures how late it fires (loop
+    // lag: a blocked callback delays everything, the probe included) into a histogram.
+    // Callbacks wrapped with the timed templates are timed, and those over the slow threshold
+    // are kept with their function address in a ring buffer:
+    //
+    //      monitor.start(base, 10, 50);
+    //      ev.newTimer(EvLoopMonitor::timedEvent<onTick>, base);
+    //      bev.newForSocket(fd, EvLoopMonitor::timedData<onRead>, NULL,
+    //          EvLoopMonitor::timedBevEvent<onEvent>, arg, base);
+    //
+    // Start it on the loop's thread: the wrappers find the thread's monitor and cost nothing but
+    // a thread local read when there is none.  With libevent 2.2 the time each loop iteration
+    // spends running callbacks is recorded as well.  Read the results on the loop's thread (ie
+    // from a posted task).
+
+    struct SlowCall
+    {
+        const void* fn;         // Callback address (see symbol())
+        uint64_t usecs;         // How long it ran
+        uint64_t at;            // When it returned (EvMetrics::nowUsecs())
+    };
+
+    enum { RingSize = 64 };
+
+    EvLoopMonitor() :
+        mBase(NULL),
+        mProbeUsecs(0),
+        mSlowUsecs(0),
+        mExpected(0),
+        mSlowTotal(0),
+        mRingNext(0)
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+        ,
+        mCheck(NULL),
+        mPrepare(NULL),
+        mIterStart(0)
+#endif
+    {
+        memset(mRing, 0, sizeof(mRing));
+    }
+    ~EvLoopMonitor()
+    {
+        stop();
+    }
+
+    void start(struct event_base* base, int probemsecs = 10, int slowmsecs = 50)
+    {
+        stop();
+
+        mBase = base;
+        mProbeUsecs = (uint64_t)((probemsecs > 0) ? probemsecs : 10) * 1000;
+        mSlowUsecs = (uint64_t)((slowmsecs > 0) ? slowmsecs : 50) * 1000;
+
+        mProbe.newTimer(onProbe, base);
+        mProbe.setUserData(this);
+        mProbe.start((int)(mProbeUsecs / 1000));
+        mExpected = EvMetrics::nowUsecs() + mProbeUsecs;
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+        mCheck = evwatch_check_new(base, onCheck, this);
+        mPrepare = evwatch_prepare_new(base, onPrepare, this);
+#endif
+        current() = this;
+    }
+
+    void stop()
+    {
+        mProbe.free();
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+        if (mCheck)
+        {
+            evwatch_free(mCheck);
+            evwatch_free(mPrepare);
+            mCheck = NULL;
+            mPrepare = NULL;
+        }
+#endif
+        if (current() == this)
+        {
+            current() = NULL;
+        }
+    }
+
+    inline const EvHistogram& lag() const
+    {
+        // How late the probe fired, microseconds
+        return mLag;
+    }
+    inline const EvHistogram& iterations() const
+    {
+        // Time spent running callbacks per loop iteration, microseconds (libevent 2.2+)
+        return mIterations;
+    }
+    inline uint64_t slowTotal() const
+    {
+        return mSlowTotal;
+    }
+
+    int slowCalls(SlowCall* out, int max) const
+    {
+        // Copies the most recent slow calls, newest first
+        int n = 0;
+        for (int i = 1; i <= RingSize && n < max; i++)
+        {
+            const SlowCall& sc = mRing[(mRingNext - i + RingSize) % RingSize];
+            if (sc.fn == NULL)
+            {
+                break;
+            }
+            out[n++] = sc;
+        }
+        return n;
+    }
+
+    void printSlow(FILE* f) const
+    {
+        SlowCall calls[RingSize];
+        int n = slowCalls(calls, RingSize);
+        uint64_t now = EvMetrics::nowUsecs();
+
+        fprintf(f, "Loop lag: p50 %luus p99 %luus max %luus over %lu probes\n",
+            (unsigned long)mLag.percentile(50), (unsigned long)mLag.percentile(99),
+            (unsigned long)mLag.max(), (unsigned long)mLag.count());
+        fprintf(f, "Slow callbacks: %lu (last %d)\n", (unsigned long)mSlowTotal, n);
+        for (int i = 0; i < n; i++)
+        {
+            fprintf(f, "  %8.1fms  %s  (%.1fs ago)\n", calls[i].usecs / 1000.0, symbol(calls[i].fn).c_str(),
+                (now - calls[i].at) / 1e6);
+        }
+    }
+
+    void finish(const void* fn, uint64_t startusecs)
+    {
+        // Called by Timed; records the call if it was slow
+        uint64_t now = EvMetrics::nowUsecs();
+        uint64_t took = now - startusecs;
+        if (took >= mSlowUsecs)
+        {
+            SlowCall& sc = mRing[mRingNext];
+            sc.fn = fn;
+            sc.usecs = took;
+            sc.at = now;
+            mRingNext = (mRingNext + 1) % RingSize;
+            mSlowTotal++;
+        }
+    }
+
+    class Timed
+    {
+    public:
+        // Times the enclosing scope as a call of 'fn' when the thread has a monitor, ie at the
+        // top of an EvHttpRouter handler:
+        //
+        //      EvLoopMonitor::Timed t((const void*)onHttpUser);
+
+        Timed(const void* fn) :
+            mMon(current()),
+            mFn(fn),
+            mStart(mMon ? EvMetrics::nowUsecs() : 0)
+        {
+        }
+        ~Timed()
+        {
+            if (mMon)
+            {
+                mMon->finish(mFn, mStart);
+            }
+        }
+
+    protected:
+        EvLoopMonitor* mMon;
+        const void* mFn;
+        uint64_t mStart;
+
+    private:
+        Timed(const Timed&);
+        Timed& operator=(const Timed&);
+    };
+
+    // Callback wrappers, one per libevent callback signature
+
+    template <event_callback_fn F>
+    static
+    void timedEvent(evutil_socket_t fd, short what, void* arg)
+    {
+        Timed t((const void*)F);
+        F(fd, what, arg);
+    }
+
+    template <bufferevent_data_cb F>
+    static
+    void timedData(struct bufferevent* bev, void* arg)
+    {
+        Timed t((const void*)F);
+        F(bev, arg);
+    }
+
+    template <bufferevent_event_cb F>
+    static
+    void timedBevEvent(struct bufferevent* bev, short events, void* arg)
+    {
+        Timed t((const void*)F);
+        F(bev, events, arg);
+    }
+
+    template <void (*F)(struct evhttp_request*, void*)>
+    static
+    void timedHttp(struct evhttp_request* req, void* arg)
+    {
+        Timed t((const void*)F);
+        F(req, arg);
+    }
+
+    static
+    std::string symbol(const void* fn)
+    {
+        // Symbol name when the binary exports it (link with -rdynamic), else the address
+        char buf[64];
+        Dl_info info;
+        if (dladdr(fn, &info) && info.dli_sname)
+        {
+            int status = 0;
+            char* name = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+            std::string str(name ? name : info.dli_sname);
+            ::free(name);
+            return str;
+        }
+        snprintf(buf, sizeof(buf), "%p", fn);
+        return std::string(buf);
+    }
+
+    static inline
+    EvLoopMonitor*& current()
+    {
+        static thread_local EvLoopMonitor* mon = NULL;
+        return mon;
+    }
+
+protected:
+    struct event_base* mBase;
+    EvEvent mProbe;
+    uint64_t mProbeUsecs;
+    uint64_t mSlowUsecs;
+    uint64_t mExpected;
+    EvHistogram mLag;
+    EvHistogram mIterations;
+    SlowCall mRing[RingSize];
+    uint64_t mSlowTotal;
+    int mRingNext;
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+    struct evwatch* mCheck;
+    struct evwatch* mPrepare;
+    uint64_t mIterStart;
+#endif
+
+    static
+    void onProbe(evutil_socket_t fd, short what, void* arg)
+    {
+        EvEvent* ev = (EvEvent*)arg;
+        EvLoopMonitor* self = (EvLoopMonitor*)ev->userData();
+
+        // Monotonic like libevent's timers: the loop's cached time is wall clock time, which an
+        // NTP step would turn into huge or negative lag
+        uint64_t now = EvMetrics::nowUsecs();
+        uint64_t lag = (now > self->mExpected) ? now - self->mExpected : 0;
+        self->mLag.record(lag);
+        EvMetrics::local().loopLag.record(lag);
+
+        // libevent schedules a persistent timer from its previous deadline unless that has
+        // already passed
+        self->mExpected += self->mProbeUsecs;
+        if (self->mExpected < now)
+        {
+            self->mExpected = now + self->mProbeUsecs;
+        }
+    }
+
+#if LIBEVENT_VERSION_NUMBER >= 0x02020000
+    static
+    void onCheck(struct evwatch* watcher, const struct evwatch_check_cb_info* info, void* arg)
+    {
+        // Poll returned: callbacks are about to run
+        ((EvLoopMonitor*)arg)->mIterStart = EvMetrics::nowUsecs();
+    }
+
+    static
+    void onPrepare(struct evwatch* watcher, const struct evwatch_prepare_cb_info* info, void* arg)
+    {
+        EvLoopMonitor* self = (EvLoopMonitor*)arg;
+        if (self->mIterStart)
+        {
+            self->mIterations.record(EvMetrics::nowUsecs() - self->mIterStart);
+        }
+    }
+#endif
+
+private:
+    EvLoopMonitor(const EvLoopMonitor&);
+    EvLoopMonitor& operator=(const EvLoopMonitor&);
+};
+
+} // namespace lev
+
+#endif // _LEVMONITOR_H
@@ -0,0 +1,410 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVPOOL_H
+#define _LEVPOOL_H
+
+#include <new>
+#include <vector>
+
+#include "levmetrics.h"
+
+namespace lev
+{
+
+template <class T> class EvSlabPool;
+template <class State> class EvConnection;
+template <class State> class EvConnectionPool;
+
+
+template <class T>
+class EvSlabPool
+{
+public:
+    // Pool of T carved out of slabs of 'slabcount' objects.  Freed objects go on a freelist and
+    // are reused before a new slab is allocated; slabs are only released with the pool.  Not
+    // thread safe: use one pool per loop.
+
+    EvSlabPool(size_t slabcount = 256) :
+        mFree(NULL),
+        mSlabCount(slabcount ? slabcount : 1),
+        mUsed(0),
+        mHighWater(0),
+        mAllocs(0)
+    {
+    }
+    ~EvSlabPool()
+    {
+        // Objects still in use are not destructed
+        for (size_t i = 0; i < mSlabs.size(); i++)
+        {
+            ::operator delete(mSlabs[i]);
+        }
+    }
+
+    T* alloc()
+    {
+        if (mFree == NULL)
+        {
+            newSlab();
+        }
+        Slot* slot = mFree;
+        mFree = slot->next;
+
+        mUsed++;
+        mAllocs++;
+        if (mUsed > mHighWater)
+        {
+            mHighWater = mUsed;
+        }
+        return new (slot->storage) T();
+    }
+
+    void free(T* obj)
+    {
+        if (obj == NULL)
+        {
+            return;
+        }
+        obj->~T();
+        Slot* slot = (Slot*)obj;
+        slot->next = mFree;
+        mFree = slot;
+        mUsed--;
+    }
+
+    inline size_t used() const
+    {
+        return mUsed;
+    }
+    inline size_t highWater() const
+    {
+        return mHighWater;
+    }
+    inline size_t capacity() const
+    {
+        return mSlabs.size() * mSlabCount;
+    }
+    inline size_t slabs() const
+    {
+        return mSlabs.size();
+    }
+    inline uint64_t allocs() const
+    {
+        // Total allocations over the life of the pool
+        return mAllocs;
+    }
+
+protected:
+    union Slot
+    {
+        Slot* next;
+        alignas(T) char storage[sizeof(T)];
+    };
+
+    std::vector<Slot*> mSlabs;
+    Slot* mFree;
+    size_t mSlabCount;
+    size_t mUsed;
+    size_t mHighWater;
+    uint64_t mAllocs;
+
+    void newSlab()
+    {
+        Slot* slab = (Slot*)::operator new(sizeof(Slot) * mSlabCount);
+        mSlabs.push_back(slab);
+
+        // Thread the new slots onto the freelist in address order
+        for (size_t i = mSlabCount; i > 0; i--)
+        {
+            slab[i - 1].next = mFree;
+            mFree = &slab[i - 1];
+        }
+    }
+
+private:
+    EvSlabPool(const EvSlabPool&);
+    EvSlabPool& operator=(const EvSlabPool&);
+};
+
+
+template <class State>
+class EvConnection
+{
+public:
+    // An accepted socket's bufferevent plus the user's State, allocated from the
+    // EvConnectionPool of the loop.  State is default constructed on accept and destructed when
+    // the connection is recycled.
+
+    EvConnection() :
+        mPool(NULL),
+        mPrev(NULL),
+        mNext(NULL)
+    {
+    }
+
+    inline State& state()
+    {
+        return mState;
+    }
+    inline EvBufferEvent& bev()
+    {
+        return mBev;
+    }
+    inline EvBuffer input()
+    {
+        return mBev.input();
+    }
+    inline EvBuffer output()
+    {
+        return mBev.output();
+    }
+    inline EvConnectionPool<State>* pool()
+    {
+        return mPool;
+    }
+
+    inline void close()
+    {
+        // Frees the socket and recycles the connection; don't touch it after this
+        mPool->release(this);
+    }
+
+protected:
+    EvBufferEvent mBev;
+    State mState;
+    EvConnectionPool<State>* mPool;
+    EvConnection* mPrev;        // Pool's list of live connections
+    EvConnection* mNext;
+
+    friend class EvConnectionPool<State>;
+
+private:
+    EvConnection(const EvConnection&);
+    EvConnection& operator=(const EvConnection&);
+};
+
+
+template <class State>
+class EvConnectionPool
+{
+public:
+    // Accepts sockets into pooled EvConnection<State> objects so that connection churn doesn't
+    // go to the global allocator.  Connections are recycled on BEV_EVENT_EOF or BEV_EVENT_ERROR
+    // (after the event callback; don't close() from it for those) or by EvConnection::close(),
+    // and those still open are closed with the pool.  One pool per loop:
+    //
+    //      pool.setCallbacks(onRead, NULL, NULL, NULL);
+    //      pool.setAcceptCallback(onAccepted);     // Optional, to set up the new State
+    //      listener.newListener(sa, EvConnectionPool<State>::onAccept, &pool, base);
+
+    typedef void (*DataCallback)(EvConnection<State>* conn, void* arg);
+    typedef void (*EventCallback)(EvConnection<State>* conn, short events, void* arg);
+
+    EvConnectionPool(size_t slabcount = 256) :
+        mConns(slabcount),
+        mReadCb(NULL),
+        mWriteCb(NULL),
+        mEventCb(NULL),
+        mAcceptCb(NULL),
+        mCbArg(NULL),
+        mLive(NULL),
+        mGroup(NULL),
+        mConnLimit(NULL),
+        mAccepted(0)
+    {
+    }
+    ~EvConnectionPool()
+    {
+        while (mLive)
+        {
+            release(mLive);
+        }
+    }
+
+    void setCallbacks(DataCallback onread, DataCallback onwrite, EventCallback onevent, void* arg)
+    {
+        mReadCb = onread;
+        mWriteCb = onwrite;
+        mEventCb = onevent;
+        mCbArg = arg;
+    }
+    void setAcceptCallback(DataCallback onaccept)
+    {
+        // Called with the callbacks' arg once a connection is set up and enabled
+        mAcceptCb = onaccept;
+    }
+    void setRateLimits(EvRateLimitGroup* group, const EvRateLimit* perconn)
+    {
+        // Applied to connections accepted from now on; either may be NULL.  Both must outlive
+        // the pool's connections (declare them before the pool).
+        mGroup = group;
+        mConnLimit = perconn;
+    }
+
+    EvConnection<State>* accept(evutil_socket_t fd, struct event_base* base)
+    {
+        EvConnection<State>* conn = mConns.alloc();
+        conn->mPool = this;
+
+        if (!conn->mBev.newForSocket(fd, onRead, onWrite, onEvent, conn, base))
+        {
+            mConns.free(conn);
+            evutil_closesocket(fd);
+            return NULL;
+        }
+        if (mConnLimit && mConnLimit->valid())
+        {
+            conn->mBev.setRateLimit(*mConnLimit);
+        }
+        if (mGroup && mGroup->valid())
+        {
+            mGroup->add(conn->mBev);
+        }
+
+        // Socket bytes are counted as they enter the input and leave the output
+        EvLoopMetrics* m = &EvMetrics::local();
+        evbuffer_add_cb(bufferevent_get_input(conn->mBev.ptr()), onInputChange, m);
+        evbuffer_add_cb(bufferevent_get_output(conn->mBev.ptr()), onOutputChange, m);
+        EvLoopMetrics::inc(m->accepts);
+        EvLoopMetrics::inc(m->active);
+
+        conn->mBev.enable(EV_READ | EV_WRITE);
+        mAccepted++;
+
+        conn->mNext = mLive;
+        if (mLive)
+        {
+            mLive->mPrev = conn;
+        }
+        mLive = conn;
+
+        if (mAcceptCb)
+        {
+            mAcceptCb(conn, mCbArg);
+        }
+        return conn;
+    }
+
+    void release(EvConnection<State>* conn)
+    {
+        // Destructing the connection frees its bufferevent (and closes the socket)
+        if (conn->mPrev)
+        {
+            conn->mPrev->mNext = conn->mNext;
+        }
+        else
+        {
+            mLive = conn->mNext;
+        }
+        if (conn->mNext)
+        {
+            conn->mNext->mPrev = conn->mPrev;
+        }
+        EvLoopMetrics::dec(EvMetrics::local().active);
+        mConns.free(conn);
+    }
+
+    // Stats
+
+    inline size_t active() const
+    {
+        return mConns.used();
+    }
+    inline size_t highWater() const
+    {
+        return mConns.highWater();
+    }
+    inline size_t capacity() const
+    {
+        return mConns.capacity();
+    }
+    inline uint64_t accepted() const
+    {
+        return mAccepted;
+    }
+
+    static
+    void onAccept(struct evconnlistener* listener, evutil_socket_t fd, struct sockaddr* address,
+        int socklen, void* cbarg)
+    {
+        // Pass as the listener callback with the pool as cbarg
+        EvConnectionPool<State>* self = (EvConnectionPool<State>*)cbarg;
+        EvConnListener evlis(listener);
+
+        evlis.setTcpNoDelay(fd);
+        self->accept(fd, evlis.base());
+    }
+
+protected:
+    EvSlabPool<EvConnection<State> > mConns;
+    DataCallback mReadCb;
+    DataCallback mWriteCb;
+    EventCallback mEventCb;
+    DataCallback mAcceptCb;
+    void* mCbArg;
+    EvConnection<State>* mLive;
+    EvRateLimitGroup* mGroup;
+    const EvRateLimit* mConnLimit;
+    uint64_t mAccepted;
+
+    static
+    void onRead(struct bufferevent* bev, void* cbarg)
+    {
+        EvConnection<State>* conn = (EvConnection<State>*)cbarg;
+        EvConnectionPool<State>* self = conn->mPool;
+        EvLoopMetrics::inc(EvMetrics::local().events);
+        if (self->mReadCb)
+        {
+            self->mReadCb(conn, self->mCbArg);
+        }
+    }
+
+    static
+    void onWrite(struct bufferevent* bev, void* cbarg)
+    {
+        EvConnection<State>* conn = (EvConnection<State>*)cbarg;
+        EvConnectionPool<State>* self = conn->mPool;
+        EvLoopMetrics::inc(EvMetrics::local().events);
+        if (self->mWriteCb)
+        {
+            self->mWriteCb(conn, self->mCbArg);
+        }
+    }
+
+    static
+    void onEvent(struct bufferevent* bev, short events, void* cbarg)
+    {
+        EvConnection<State>* conn = (EvConnection<State>*)cbarg;
+        EvConnectionPool<State>* self = conn->mPool;
+        EvLoopMetrics::inc(EvMetrics::local().events);
+        if (self->mEventCb)
+        {
+            self->mEventCb(conn, events, self->mCbArg);
+        }
+        if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+        {
+            self->release(conn);
+        }
+    }
+
+    static
+    void onInputChange(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg)
+    {
+        EvLoopMetrics::inc(((EvLoopMetrics*)arg)->bytesIn, info->n_added);
+    }
+
+    static
+    void onOutputChange(struct evbuffer* buf, const struct evbuffer_cb_info* info, void* arg)
+    {
+        EvLoopMetrics::inc(((EvLoopMetrics*)arg)->bytesOut, info->n_deleted);
+    }
+
+private:
+    EvConnectionPool(const EvConnectionPool&);
+    EvConnectionPool& operator=(const EvConnectionPool&);
+};
+
+} // namespace lev
+
+#endif // _LEVPOOL_H
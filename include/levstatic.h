@@ -0,0 +1,449 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVSTATIC_H
+#define _LEVSTATIC_H
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <map>
+
+#include "levhttp.h"
+
+namespace lev
+{
+
+class EvStaticFiles;
+
+
+class EvStaticFiles
+{
+public:
+    // Serves the files under a root directory without copying them: a response references a
+    // file segment, which libevent writes to the socket with sendfile() (over TLS or a filter,
+    // from an mmap of the file instead).  Handles HEAD, a single byte range (Range, If-Range)
+    // and conditional requests (ETag with If-None-Match, Last-Modified with If-Modified-Since).
+    // Open fds and their stat results stay in an LRU cache and are only checked again (one
+    // stat) after 'revalidatemsecs', so a hot file costs no open or fstat per request:
+    //
+    //      EvStaticFiles files("/var/www", 256);
+    //      router.add(EVHTTP_REQ_GET | EVHTTP_REQ_HEAD, "/static/*path", EvStaticFiles::onRoute,
+    //          &files);
+    //
+    // Thread safe: one instance can serve the routes of every loop thread (the cache is behind
+    // a mutex, responses share the segments).  Sharing it across loops needs
+    // EvBaseLoop::enableThreads() before the first base is created: libevent drops a segment's
+    // references on the thread that wrote the response, under the segment's own lock, which
+    // only exists with threading enabled.  Paths with '..' components are refused and only
+    // regular files are served.
+
+    EvStaticFiles(const char* root, size_t maxopen = 256, int revalidatemsecs = 1000) :
+        mRoot(root ? root : "."),
+        mMaxOpen(maxopen ? maxopen : 1),
+        mRevalidateMsecs(revalidatemsecs)
+    {
+        while (mRoot.size() > 1 && mRoot[mRoot.size() - 1] == '/')
+        {
+            mRoot.erase(mRoot.size() - 1);
+        }
+        pthread_mutex_init(&mLock, NULL);
+        mHits.store(0);
+        mOpens.store(0);
+    }
+    ~EvStaticFiles()
+    {
+        // Responses still being sent hold their own references to the segments
+        while (mLru.head())
+        {
+            evict(mLru.head());
+        }
+        pthread_mutex_destroy(&mLock);
+    }
+
+    static
+    void onRoute(struct evhttp_request* req, const EvRouteParams& params, void* arg)
+    {
+        // EvHttpRouter handler: serves the '*path' capture, or the request's path without one
+        EvStaticFiles* self = (EvStaticFiles*)arg;
+        EvStrView path = params.find("path");
+        if (!path.valid())
+        {
+            path = EvStrView(evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)));
+        }
+        self->serve(req, path);
+    }
+
+    void serve(struct evhttp_request* req, const EvStrView& rawpath)
+    {
+        // Replies to req with the file at rawpath (percent-encoded, relative to the root)
+        char path[PATH_MAX];
+        char full[PATH_MAX];
+        ssize_t len = EvQueryView::decode(rawpath, path, sizeof(path), false);
+        if (len < 0 || !safePath(path, len) ||
+            snprintf(full, sizeof(full), "%s/%s", mRoot.c_str(), path) >= (int)sizeof(full))
+        {
+            evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+            return;
+        }
+
+        enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+        if (cmd != EVHTTP_REQ_GET && cmd != EVHTTP_REQ_HEAD)
+        {
+            evhttp_send_error(req, 405, NULL);
+            return;
+        }
+
+        struct evkeyvalq* in = evhttp_request_get_input_headers(req);
+        struct evkeyvalq* out = evhttp_request_get_output_headers(req);
+        int status = 200;
+        off_t start = 0;
+        off_t length = 0;
+        char lastmod[64];
+        char buf[96];
+
+        pthread_mutex_lock(&mLock);
+        Entry* e = find(path, full);
+        if (e == NULL)
+        {
+            pthread_mutex_unlock(&mLock);
+            evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+            return;
+        }
+
+        httpDate(e->mtime, lastmod, sizeof(lastmod));
+        evhttp_add_header(out, "Content-Type", e->type);
+        evhttp_add_header(out, "Last-Modified", lastmod);
+        evhttp_add_header(out, "ETag", e->etag);
+        evhttp_add_header(out, "Accept-Ranges", "bytes");
+
+        length = e->size;
+        if (notModified(in, e))
+        {
+            status = HTTP_NOTMODIFIED;
+        }
+        else
+        {
+            const char* range = evhttp_find_header(in, "Range");
+            const char* ifrange = evhttp_find_header(in, "If-Range");
+            if (range && (ifrange == NULL || strcmp(ifrange, e->etag) == 0 || strcmp(ifrange, lastmod) == 0))
+            {
+                int r = parseRange(range, e->size, start, length);
+                if (r > 0)
+                {
+                    status = 206;
+                    snprintf(buf, sizeof(buf), "bytes %lld-%lld/%lld", (long long)start,
+                        (long long)(start + length - 1), (long long)e->size);
+                    evhttp_add_header(out, "Content-Range", buf);
+                }
+                else if (r < 0)
+                {
+                    status = 416;
+                    snprintf(buf, sizeof(buf), "bytes */%lld", (long long)e->size);
+                    evhttp_add_header(out, "Content-Range", buf);
+                }
+            }
+
+            if (status != 416)
+            {
+                snprintf(buf, sizeof(buf), "%lld", (long long)length);
+                evhttp_add_header(out, "Content-Length", buf);
+                if (cmd == EVHTTP_REQ_GET && length > 0)
+                {
+                    // Adds a reference to the segment; it outlives an eviction.  The body only
+                    // gets a sendfile() chain if it is marked as draining to an fd.
+                    struct evbuffer* body = evhttp_request_get_output_buffer(req);
+                    if (EvHttpServer::drainsToSocket(req))
+                    {
+                        evbuffer_set_flags(body, EVBUFFER_FLAG_DRAINS_TO_FD);
+                    }
+                    evbuffer_add_file_segment(body, e->seg.ptr(), start, length);
+                }
+            }
+        }
+        pthread_mutex_unlock(&mLock);
+
+        switch (status)
+        {
+            case 206:
+                evhttp_send_reply(req, 206, "Partial Content", NULL);
+                break;
+            case 416:
+                evhttp_send_reply(req, 416, "Range Not Satisfiable", NULL);
+                break;
+            case HTTP_NOTMODIFIED:
+                evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+                break;
+            default:
+                evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+                break;
+        }
+    }
+
+    inline uint64_t hits() const
+    {
+        // Requests served from a cached fd
+        return mHits.load(std::memory_order_relaxed);
+    }
+    inline uint64_t opens() const
+    {
+        return mOpens.load(std::memory_order_relaxed);
+    }
+
+    static
+    int parseRange(const char* hdr, off_t size, off_t& start, off_t& length)
+    {
+        // 'bytes=first-last', 'bytes=first-' or 'bytes=-suffix'.  Returns 1 with the range, -1
+        // when unsatisfiable, 0 to ignore it and send the whole file (malformed, or several
+        // ranges, which we don't do multipart for).
+        if (strncmp(hdr, "bytes=", 6) != 0 || strchr(hdr, ',') != NULL)
+        {
+            return 0;
+        }
+        const char* p = hdr + 6;
+        char* end;
+        if (*p == '-')
+        {
+            long long suffix = strtoll(p + 1, &end, 10);
+            if (end == p + 1 || *end != '\0' || suffix < 0)
+            {
+                return 0;
+            }
+            if (suffix == 0 || size == 0)
+            {
+                return -1;
+            }
+            start = (suffix < size) ? size - suffix : 0;
+            length = size - start;
+            return 1;
+        }
+
+        long long first = strtoll(p, &end, 10);
+        if (end == p || *end != '-' || first < 0)
+        {
+            return 0;
+        }
+        p = end + 1;
+        long long last = size - 1;
+        if (*p != '\0')
+        {
+            last = strtoll(p, &end, 10);
+            if (*end != '\0' || last < first)
+            {
+                return 0;
+            }
+        }
+        if (first >= size)
+        {
+            return -1;
+        }
+        if (last >= size)
+        {
+            last = size - 1;
+        }
+        start = first;
+        length = last - first + 1;
+        return 1;
+    }
+
+protected:
+    struct Entry
+    {
+        std::string path;
+        EvFileSegment seg;
+        off_t size;
+        time_t mtime;
+        long mtimeNsecs;
+        ino_t ino;
+        char etag[48];
+        const char* type;
+        uint64_t checked;               // Last stat, msecs
+        Entry* prev;                    // LRU list, most recent first
+        Entry* next;
+    };
+
+    std::string mRoot;
+    size_t mMaxOpen;
+    int mRevalidateMsecs;
+    pthread_mutex_t mLock;
+    std::map<std::string, Entry*> mFiles;
+    EvLruList<Entry> mLru;
+    std::atomic<uint64_t> mHits;        // Written under mLock (EvCounter::inc())
+    std::atomic<uint64_t> mOpens;
+
+    static
+    bool safePath(const char* path, size_t len)
+    {
+        // No NULs (from %00) and no '..' components
+        if (strlen(path) != len)
+        {
+            return false;
+        }
+        for (const char* p = path; *p; p++)
+        {
+            bool segstart = (p == path || p[-1] == '/');
+            if (segstart && p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0'))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Entry* find(const char* path, const char* full)
+    {
+        // Cached entry for path, opened if needed (under mLock)
+        uint64_t now = EvMetrics::nowMsecs();
+        std::map<std::string, Entry*>::iterator it = mFiles.find(path);
+        if (it != mFiles.end())
+        {
+            Entry* e = it->second;
+            if (now - e->checked < (uint64_t)mRevalidateMsecs)
+            {
+                mLru.touch(e);
+                EvCounter::inc(mHits);
+                return e;
+            }
+
+            struct stat st;
+            if (stat(full, &st) == 0 && st.st_ino == e->ino && st.st_size == e->size &&
+                st.st_mtim.tv_sec == e->mtime && st.st_mtim.tv_nsec == e->mtimeNsecs)
+            {
+                e->checked = now;
+                mLru.touch(e);
+                EvCounter::inc(mHits);
+                return e;
+            }
+            evict(e);
+        }
+        return open(path, full, now);
+    }
+
+    Entry* open(const char* path, const char* full, uint64_t now)
+    {
+        int fd = ::open(full, O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return NULL;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            close(fd);
+            return NULL;
+        }
+
+        Entry* e = new Entry();
+        if (!e->seg.newSegment(fd, 0, st.st_size, EVBUF_FS_CLOSE_ON_FREE))
+        {
+            close(fd);
+            delete e;
+            return NULL;
+        }
+        EvCounter::inc(mOpens);
+
+        e->path = path;
+        e->size = st.st_size;
+        e->mtime = st.st_mtim.tv_sec;
+        e->mtimeNsecs = st.st_mtim.tv_nsec;
+        e->ino = st.st_ino;
+        snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx%05lx\"", (unsigned long long)st.st_size,
+            (unsigned long long)st.st_mtim.tv_sec, (unsigned long)(st.st_mtim.tv_nsec / 10000));
+        e->type = contentType(path);
+        e->checked = now;
+
+        mLru.pushFront(e);
+        mFiles[e->path] = e;
+
+        while (mFiles.size() > mMaxOpen && mLru.tail() != e)
+        {
+            evict(mLru.tail());
+        }
+        return e;
+    }
+
+    void evict(Entry* e)
+    {
+        // Drops our reference to the segment (the fd closes once no response uses it)
+        mLru.unlink(e);
+        mFiles.erase(e->path);
+        delete e;
+    }
+
+    bool notModified(struct evkeyvalq* in, const Entry* e)
+    {
+        // If-None-Match wins over If-Modified-Since (RFC 7232)
+        const char* inm = evhttp_find_header(in, "If-None-Match");
+        if (inm)
+        {
+            return strcmp(inm, "*") == 0 || strstr(inm, e->etag) != NULL;
+        }
+        const char* ims = evhttp_find_header(in, "If-Modified-Since");
+        if (ims)
+        {
+            struct tm tm;
+            memset(&tm, 0, sizeof(tm));
+            const char* end = strptime(ims, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+            return end && *end == '\0' && e->mtime <= timegm(&tm);
+        }
+        return false;
+    }
+
+    static
+    void httpDate(time_t t, char* buf, size_t size)
+    {
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    }
+
+    static
+    const char* contentType(const char* path)
+    {
+        static const struct { const char* ext; const char* type; } types[] =
+        {
+            { "html", "text/html; charset=utf-8" },
+            { "htm", "text/html; charset=utf-8" },
+            { "css", "text/css; charset=utf-8" },
+            { "js", "application/javascript" },
+            { "json", "application/json" },
+            { "txt", "text/plain; charset=utf-8" },
+            { "xml", "application/xml" },
+            { "svg", "image/svg+xml" },
+            { "png", "image/png" },
+            { "jpg", "image/jpeg" },
+            { "jpeg", "image/jpeg" },
+            { "gif", "image/gif" },
+            { "webp", "image/webp" },
+            { "ico", "image/x-icon" },
+            { "woff2", "font/woff2" },
+            { "wasm", "application/wasm" },
+            { "pdf", "application/pdf" },
+            { "mp4", "video/mp4" },
+            { "gz", "application/gzip" }
+        };
+        const char* dot = strrchr(path, '.');
+        if (dot && strchr(dot, '/') == NULL)
+        {
+            for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+            {
+                if (evutil_ascii_strcasecmp(dot + 1, types[i].ext) == 0)
+                {
+                    return types[i].type;
+                }
+            }
+        }
+        return "application/octet-stream";
+    }
+
+private:
+    EvStaticFiles(const EvStaticFiles&);
+    EvStaticFiles& operator=(const EvStaticFiles&);
+};
+
+} // namespace lev
+
+#endif // _LEVSTATIC_H
@@ -0,0 +1,294 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVTHREAD_H
+#define _LEVTHREAD_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace lev
+{
+
+class EvLoopThread;
+class EvServerGroup;
+
+
+class EvLoopThread
+{
+public:
+    // Called on the loop thread: init before the loop starts (create listeners, http servers,
+    // etc. on thread->loop()), exit after the loop has stopped (free them).
+    typedef void (*ThreadCallback)(EvLoopThread* thread, void* arg);
+
+    EvLoopThread() :
+        mLoop(NULL),
+        mRunning(false),
+        mReady(false),
+        mIndex(0),
+        mCpu(-1),
+        mInitCb(NULL),
+        mExitCb(NULL),
+        mCbArg(NULL),
+        mUserData(NULL)
+    {
+        pthread_mutex_init(&mLock, NULL);
+        pthread_cond_init(&mCond, NULL);
+    }
+    ~EvLoopThread()
+    {
+        stop();
+        join();
+        pthread_cond_destroy(&mCond);
+        pthread_mutex_destroy(&mLock);
+    }
+
+    bool start(ThreadCallback initcb, ThreadCallback exitcb, void* arg, int index = 0, int cpu = -1)
+    {
+        // Returns once initcb has completed on the new thread.  'cpu' >= 0 pins the thread.
+
+        if (mRunning)
+        {
+            return false;
+        }
+
+        mLoop = new EvBaseLoop();
+        mLoop->enableTasks();
+        mInitCb = initcb;
+        mExitCb = exitcb;
+        mCbArg = arg;
+        mIndex = index;
+        mCpu = cpu;
+        mReady = false;
+
+        if (pthread_create(&mThread, NULL, threadMain, this) != 0)
+        {
+            dbgerr("Failed to create loop thread\n");
+            delete mLoop;
+            mLoop = NULL;
+            return false;
+        }
+        mRunning = true;
+
+        pthread_mutex_lock(&mLock);
+        while (!mReady)
+        {
+            pthread_cond_wait(&mCond, &mLock);
+        }
+        pthread_mutex_unlock(&mLock);
+
+        return true;
+    }
+
+    void stop()
+    {
+        // Safe to call from any thread
+        if (mRunning && mLoop)
+        {
+            mLoop->post(onStop, mLoop);
+        }
+    }
+
+    inline void post(EvTask* task)
+    {
+        // Runs the task on this thread's loop; callable from any thread
+        mLoop->post(task);
+    }
+    template <class F>
+    inline typename std::enable_if<!std::is_convertible<F, EvTask*>::value>::type post(const F& fn)
+    {
+        mLoop->post(fn);
+    }
+
+    void join()
+    {
+        if (mRunning)
+        {
+            pthread_join(mThread, NULL);
+            mRunning = false;
+
+            delete mLoop;
+            mLoop = NULL;
+        }
+    }
+
+    inline EvBaseLoop& loop()
+    {
+        return *mLoop;
+    }
+    inline int index() const
+    {
+        return mIndex;
+    }
+    inline int cpu() const
+    {
+        return mCpu;
+    }
+    inline bool running() const
+    {
+        return mRunning;
+    }
+
+    inline void* userData()
+    {
+        return mUserData;
+    }
+    inline void setUserData(void* userdata)
+    {
+        mUserData = userdata;
+    }
+
+    static
+    int cpuCount()
+    {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return (n > 0) ? (int)n : 1;
+    }
+
+protected:
+    EvBaseLoop* mLoop;
+    pthread_t mThread;
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    bool mRunning;
+    bool mReady;
+    int mIndex;
+    int mCpu;
+    ThreadCallback mInitCb;
+    ThreadCallback mExitCb;
+    void* mCbArg;
+    void* mUserData;
+
+    static
+    void onStop(void* arg)
+    {
+        ((EvBaseLoop*)arg)->breakLoop();
+    }
+
+    static
+    void* threadMain(void* arg)
+    {
+        EvLoopThread* self = (EvLoopThread*)arg;
+
+        if (self->mCpu >= 0)
+        {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(self->mCpu % cpuCount(), &cpus);
+            if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            {
+                dbgerr("Failed to pin loop thread to cpu %d\n", self->mCpu);
+            }
+        }
+
+        if (self->mInitCb)
+        {
+            self->mInitCb(self, self->mCbArg);
+        }
+
+        pthread_mutex_lock(&self->mLock);
+        self->mReady = true;
+        pthread_cond_signal(&self->mCond);
+        pthread_mutex_unlock(&self->mLock);
+
+        self->mLoop->loop(EVLOOP_NO_EXIT_ON_EMPTY);
+
+        if (self->mExitCb)
+        {
+            self->mExitCb(self, self->mCbArg);
+        }
+        return NULL;
+    }
+
+private:
+    EvLoopThread(const EvLoopThread&);
+    EvLoopThread& operator=(const EvLoopThread&);
+};
+
+
+class EvServerGroup
+{
+public:
+    // Runs one EvBaseLoop per thread (by default one per core).  Each thread's init callback
+    // typically binds its own listener with LEV_OPT_REUSEABLE_PORT (or
+    // EvHttpServer::bindReusePort) so the kernel spreads connections across the loops and no
+    // state is shared between them.
+
+    EvServerGroup()
+    {
+    }
+    ~EvServerGroup()
+    {
+        stop();
+        join();
+    }
+
+    bool start(int count, EvLoopThread::ThreadCallback initcb, EvLoopThread::ThreadCallback exitcb,
+        void* arg, bool pincpus = false)
+    {
+        // count <= 0 starts one loop per online cpu
+
+        if (!mThreads.empty())
+        {
+            return false;
+        }
+        if (count <= 0)
+        {
+            count = EvLoopThread::cpuCount();
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            EvLoopThread* t = new EvLoopThread();
+            mThreads.push_back(t);
+            if (!t->start(initcb, exitcb, arg, i, pincpus ? i : -1))
+            {
+                stop();
+                join();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void stop()
+    {
+        for (size_t i = 0; i < mThreads.size(); i++)
+        {
+            mThreads[i]->stop();
+        }
+    }
+
+    void join()
+    {
+        for (size_t i = 0; i < mThreads.size(); i++)
+        {
+            mThreads[i]->join();
+            delete mThreads[i];
+        }
+        mThreads.clear();
+    }
+
+    inline int size() const
+    {
+        return (int)mThreads.size();
+    }
+    inline EvLoopThread* thread(int i)
+    {
+        return mThreads[i];
+    }
+
+protected:
+    std::vector<EvLoopThread*> mThreads;
+
+private:
+    EvServerGroup(const EvServerGroup&);
+    EvServerGroup& operator=(const EvServerGroup&);
+};
+
+} // namespace lev
+
+#endif // _LEVTHREAD_H
@@ -0,0 +1,388 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVTIMER_H
+#define _LEVTIMER_H
+
+#include <time.h>
+
+#include "levmetrics.h"
+
+namespace lev
+{
+
+class EvTimerNode;
+class EvTimerWheel;
+
+
+class EvTimerNode
+{
+public:
+    // Intrusive timer, meant to be embedded in per-connection state.  Arm it on an EvTimerWheel;
+    // arming an armed node moves it (re-arm), which is what an idle timeout does on every read.
+
+    typedef void (*TimerCallback)(EvTimerNode* node, void* arg);
+
+    EvTimerNode() :
+        mPrev(NULL),
+        mNext(NULL),
+        mExpire(0),
+        mWheel(NULL),
+        mCallback(NULL),
+        mArg(NULL)
+    {
+    }
+    EvTimerNode(TimerCallback callback, void* arg) :
+        mPrev(NULL),
+        mNext(NULL),
+        mExpire(0),
+        mWheel(NULL),
+        mCallback(callback),
+        mArg(arg)
+    {
+    }
+    ~EvTimerNode()
+    {
+        cancel();
+    }
+
+    inline void setCallback(TimerCallback callback, void* arg)
+    {
+        mCallback = callback;
+        mArg = arg;
+    }
+
+    inline bool active() const
+    {
+        return mNext != NULL;
+    }
+
+    inline void* arg()
+    {
+        return mArg;
+    }
+
+    void cancel();
+
+protected:
+    EvTimerNode* mPrev;
+    EvTimerNode* mNext;
+    uint64_t mExpire;
+    EvTimerWheel* mWheel;
+    TimerCallback mCallback;
+    void* mArg;
+
+    inline void unlink()
+    {
+        mPrev->mNext = mNext;
+        mNext->mPrev = mPrev;
+        mPrev = NULL;
+        mNext = NULL;
+    }
+    inline void linkBefore(EvTimerNode* head)
+    {
+        // Appends to the circular list whose sentinel is 'head'
+        mNext = head;
+        mPrev = head->mPrev;
+        head->mPrev->mNext = this;
+        head->mPrev = this;
+    }
+    inline void initHead()
+    {
+        mPrev = this;
+        mNext = this;
+    }
+    inline bool emptyHead() const
+    {
+        return mNext == this;
+    }
+
+    friend class EvTimerWheel;
+
+private:
+    EvTimerNode(const EvTimerNode&);
+    EvTimerNode& operator=(const EvTimerNode&);
+};
+
+
+class EvTimerWheel
+{
+public:
+    // Hierarchical timing wheel (256 + 3 x 64 slots) driven by one persistent EvEvent tick.  Arm,
+    // re-arm and cancel are O(1) whatever the number of live timers; expiry is accurate to one
+    // tick.  Timeouts longer than 2^26 ticks are clamped.  Single threaded: use it from the loop
+    // it was started on.
+    //
+    // For a handful of distinct fixed durations, EvBaseLoop::commonTimeout() gives O(1) adds
+    // inside libevent itself without a wheel.
+
+    EvTimerWheel() :
+        mCurrent(0),
+        mTickMsecs(10),
+        mStartMsecs(0),
+        mCount(0)
+    {
+        for (int i = 0; i < RootSize; i++)
+        {
+            mRoot[i].initHead();
+        }
+        for (int l = 0; l < Levels; l++)
+        {
+            for (int i = 0; i < LevelSize; i++)
+            {
+                mLevels[l][i].initHead();
+            }
+        }
+    }
+    ~EvTimerWheel()
+    {
+        stop();
+        clear();
+    }
+
+    void start(struct event_base* base, int tickmsecs = 10)
+    {
+        mTickMsecs = (tickmsecs > 0) ? tickmsecs : 1;
+        mStartMsecs = monoMsecs() - mCurrent * mTickMsecs;
+
+        mTick.newTimer(onTick, base);
+        mTick.setUserData(this);
+        mTick.start(mTickMsecs);
+    }
+    void stop()
+    {
+        mTick.free();
+    }
+
+    void arm(EvTimerNode& node, uint64_t msecs)
+    {
+        // (Re)arms node to fire in msecs, rounded up to the tick
+        if (node.mNext)
+        {
+            node.unlink();
+            mCount--;
+        }
+        // mCurrent is the next tick to process, so a 1 tick timer goes in the current slot
+        uint64_t ticks = (msecs + mTickMsecs - 1) / mTickMsecs;
+        node.mExpire = mCurrent + (ticks ? ticks : 1) - 1;
+        node.mWheel = this;
+        add(&node);
+        mCount++;
+    }
+
+    inline void cancel(EvTimerNode& node)
+    {
+        node.cancel();
+    }
+
+    void advance(uint64_t ticks)
+    {
+        // Runs 'ticks' ticks worth of expirations; normally called by the tick event
+        EvLoopMetrics& m = EvMetrics::local();
+        while (ticks-- > 0)
+        {
+            int index = (int)(mCurrent & RootMask);
+            if (index == 0)
+            {
+                for (int l = 0; l < Levels; l++)
+                {
+                    if (cascade(l, levelIndex(l)) != 0)
+                    {
+                        break;
+                    }
+                }
+            }
+            mCurrent++;
+
+            // Detach the slot first: callbacks may arm or cancel any node, including these
+            EvTimerNode work;
+            work.initHead();
+            spliceAll(&mRoot[index], &work);
+            while (!work.emptyHead())
+            {
+                EvTimerNode* n = work.mNext;
+                n->unlink();
+                mCount--;
+                EvLoopMetrics::inc(m.events);
+                if (n->mCallback)
+                {
+                    n->mCallback(n, n->mArg);
+                }
+            }
+            work.mPrev = NULL;
+            work.mNext = NULL;
+        }
+    }
+
+    inline uint64_t ticks() const
+    {
+        return mCurrent;
+    }
+    inline int tickMsecs() const
+    {
+        return mTickMsecs;
+    }
+    inline size_t size() const
+    {
+        return mCount;
+    }
+
+protected:
+    enum
+    {
+        RootBits = 8,
+        RootSize = 1 << RootBits,
+        RootMask = RootSize - 1,
+        LevelBits = 6,
+        LevelSize = 1 << LevelBits,
+        LevelMask = LevelSize - 1,
+        Levels = 3
+    };
+
+    EvTimerNode mRoot[RootSize];
+    EvTimerNode mLevels[Levels][LevelSize];
+    uint64_t mCurrent;
+    int mTickMsecs;
+    uint64_t mStartMsecs;
+    size_t mCount;
+    EvEvent mTick;
+
+    friend class EvTimerNode;
+
+    inline int levelIndex(int level) const
+    {
+        return (int)((mCurrent >> (RootBits + level * LevelBits)) & LevelMask);
+    }
+
+    void add(EvTimerNode* node)
+    {
+        uint64_t expire = node->mExpire;
+        uint64_t delta = expire - mCurrent;
+        EvTimerNode* head;
+
+        if (delta < (1 << RootBits))
+        {
+            head = &mRoot[expire & RootMask];
+        }
+        else if (delta < (1 << (RootBits + LevelBits)))
+        {
+            head = &mLevels[0][(expire >> RootBits) & LevelMask];
+        }
+        else if (delta < (1 << (RootBits + 2 * LevelBits)))
+        {
+            head = &mLevels[1][(expire >> (RootBits + LevelBits)) & LevelMask];
+        }
+        else
+        {
+            const uint64_t maxdelta = (1 << (RootBits + 3 * LevelBits)) - 1;
+            if (delta > maxdelta)
+            {
+                expire = mCurrent + maxdelta;
+                node->mExpire = expire;
+            }
+            head = &mLevels[2][(expire >> (RootBits + 2 * LevelBits)) & LevelMask];
+        }
+        node->linkBefore(head);
+    }
+
+    int cascade(int level, int index)
+    {
+        // Redistributes one slot of a higher level into the lower levels
+        EvTimerNode work;
+        work.initHead();
+        spliceAll(&mLevels[level][index], &work);
+        while (!work.emptyHead())
+        {
+            EvTimerNode* n = work.mNext;
+            n->unlink();
+            add(n);
+        }
+        work.mPrev = NULL;
+        work.mNext = NULL;
+        return index;
+    }
+
+    static
+    void spliceAll(EvTimerNode* from, EvTimerNode* to)
+    {
+        // Moves every node of list 'from' to the empty list 'to'
+        if (from->emptyHead())
+        {
+            return;
+        }
+        to->mNext = from->mNext;
+        to->mPrev = from->mPrev;
+        to->mNext->mPrev = to;
+        to->mPrev->mNext = to;
+        from->initHead();
+    }
+
+    void clear()
+    {
+        for (int i = 0; i < RootSize; i++)
+        {
+            clearList(&mRoot[i]);
+        }
+        for (int l = 0; l < Levels; l++)
+        {
+            for (int i = 0; i < LevelSize; i++)
+            {
+                clearList(&mLevels[l][i]);
+            }
+        }
+        mCount = 0;
+    }
+
+    static
+    void clearList(EvTimerNode* head)
+    {
+        while (!head->emptyHead())
+        {
+            EvTimerNode* n = head->mNext;
+            n->unlink();
+            n->mWheel = NULL;
+        }
+        head->mPrev = NULL;
+        head->mNext = NULL;
+    }
+
+    static
+    uint64_t monoMsecs()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    static
+    void onTick(evutil_socket_t fd, short what, void* arg)
+    {
+        // Catches up on ticks from the clock so a late tick event doesn't make timers drift
+        EvEvent* ev = (EvEvent*)arg;
+        EvTimerWheel* self = (EvTimerWheel*)ev->userData();
+
+        uint64_t target = (monoMsecs() - self->mStartMsecs) / self->mTickMsecs;
+        if (target > self->mCurrent)
+        {
+            self->advance(target - self->mCurrent);
+        }
+    }
+
+private:
+    EvTimerWheel(const EvTimerWheel&);
+    EvTimerWheel& operator=(const EvTimerWheel&);
+};
+
+
+inline void EvTimerNode::cancel()
+{
+    if (mNext)
+    {
+        unlink();
+        mWheel->mCount--;
+    }
+}
+
+} // namespace lev
+
+#endif // _LEVTIMER_H
@@ -0,0 +1,392 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVTLS_H
+#define _LEVTLS_H
+
+#include <pthread.h>
+
+#include <map>
+#include <string>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <event2/bufferevent_ssl.h>
+
+#include "levhttp.h"
+
+namespace lev
+{
+
+class EvTlsContext;
+
+
+class EvTlsContext
+{
+public:
+    // OpenSSL context for EvBufferEvent::newForTlsSocket() and EvHttpServer::setTls().  A full
+    // handshake costs a signature and a key exchange, a resumed one only the key exchange, so
+    // both sides keep sessions:
+    //
+    //  - servers issue session tickets (stateless, so they also work across SO_REUSEPORT loop
+    //    threads sharing the context) and keep a session cache for clients without tickets
+    //  - clients remember the last session per peer name and offer it on the next connect
+    //
+    //      EvTlsContext tls;
+    //      tls.newServer();
+    //      tls.loadCertificate("server.pem", "server.key");
+    //      http.setTls(tls);
+    //
+    // An ECDSA P-256 certificate signs several times faster than RSA 2048, which shows
+    // directly in full handshakes per second (tlsbench).  One context can be shared by every
+    // loop thread; it must outlive the connections.  Link with -levent_openssl -lssl -lcrypto.
+
+    EvTlsContext() :
+        mCtx(NULL),
+        mServer(false)
+    {
+        pthread_mutex_init(&mLock, NULL);
+    }
+    ~EvTlsContext()
+    {
+        free();
+        pthread_mutex_destroy(&mLock);
+    }
+
+    bool newServer(size_t cachesize = 20000, long timeoutsecs = 300)
+    {
+        if (!newContext(TLS_server_method()))
+        {
+            return false;
+        }
+        mServer = true;
+        SSL_CTX_set_session_id_context(mCtx, (const unsigned char*)"lev", 3);
+        SSL_CTX_set_session_cache_mode(mCtx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(mCtx, (long)cachesize);
+        SSL_CTX_set_timeout(mCtx, timeoutsecs);
+#ifdef TLS1_3_VERSION
+        // One TLS 1.3 ticket per handshake (default 2): clients here keep one per peer
+        SSL_CTX_set_num_tickets(mCtx, 1);
+#endif
+        return true;
+    }
+
+    bool newClient(bool verifypeer = false, const char* cafile = NULL)
+    {
+        if (!newContext(TLS_client_method()))
+        {
+            return false;
+        }
+        mServer = false;
+        if (verifypeer)
+        {
+            SSL_CTX_set_verify(mCtx, SSL_VERIFY_PEER, NULL);
+            if ((cafile ? SSL_CTX_load_verify_locations(mCtx, cafile, NULL) :
+                SSL_CTX_set_default_verify_paths(mCtx)) != 1)
+            {
+                dbgerr("Failed to load CA certificates\n");
+                return false;
+            }
+        }
+        // Sessions (and TLS 1.3 tickets, which arrive after the handshake) go to onNewSession()
+        SSL_CTX_set_session_cache_mode(mCtx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(mCtx, onNewSession);
+        return true;
+    }
+
+    void free()
+    {
+        clearSessions();
+        if (mCtx)
+        {
+            SSL_CTX_free(mCtx);
+            mCtx = NULL;
+        }
+    }
+
+    bool loadCertificate(const char* certfile, const char* keyfile)
+    {
+        // PEM; certfile may hold the chain
+        if (SSL_CTX_use_certificate_chain_file(mCtx, certfile) != 1 ||
+            SSL_CTX_use_PrivateKey_file(mCtx, keyfile, SSL_FILETYPE_PEM) != 1 ||
+            SSL_CTX_check_private_key(mCtx) != 1)
+        {
+            dbgerr("Failed to load certificate %s / key %s\n", certfile, keyfile);
+            return false;
+        }
+        return true;
+    }
+
+    bool useSelfSigned(const char* cn = "localhost", int days = 30)
+    {
+        // Throwaway P-256 certificate for tests and benchmarks; clients must not verify
+        EVP_PKEY* pkey = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        pkey = EVP_EC_gen("P-256");
+#else
+        EVP_PKEY_CTX* kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+        if (kctx && EVP_PKEY_keygen_init(kctx) == 1 &&
+            EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) == 1)
+        {
+            EVP_PKEY_keygen(kctx, &pkey);
+        }
+        EVP_PKEY_CTX_free(kctx);
+#endif
+        X509* x = X509_new();
+        bool ok = (pkey != NULL && x != NULL);
+        if (ok)
+        {
+            X509_set_version(x, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+            X509_gmtime_adj(X509_getm_notBefore(x), 0);
+            X509_gmtime_adj(X509_getm_notAfter(x), (long)days * 24 * 3600);
+            X509_set_pubkey(x, pkey);
+            X509_NAME* name = X509_get_subject_name(x);
+            X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)cn, -1, -1, 0);
+            X509_set_issuer_name(x, name);
+            ok = X509_sign(x, pkey, EVP_sha256()) > 0 && SSL_CTX_use_certificate(mCtx, x) == 1 &&
+                SSL_CTX_use_PrivateKey(mCtx, pkey) == 1;
+        }
+        if (!ok)
+        {
+            dbgerr("Failed to create a self-signed certificate\n");
+        }
+        X509_free(x);
+        EVP_PKEY_free(pkey);
+        return ok;
+    }
+
+    inline void setTickets(bool on)
+    {
+        // Server: off falls back to the session cache (stateful TLS 1.3 tickets).  OpenSSL
+        // drops a cached session when its connection is freed without sending close_notify,
+        // which is how evhttp closes, so without tickets few sessions resume.
+        if (on)
+        {
+            SSL_CTX_clear_options(mCtx, SSL_OP_NO_TICKET);
+        }
+        else
+        {
+            SSL_CTX_set_options(mCtx, SSL_OP_NO_TICKET);
+        }
+    }
+    inline void setResumption(bool on)
+    {
+        // Client: offer remembered sessions (on by default)
+        SSL_CTX_set_session_cache_mode(mCtx, on ? (SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE) :
+            SSL_SESS_CACHE_OFF);
+        if (!on)
+        {
+            clearSessions();
+        }
+    }
+
+    SSL* newSsl(const char* peer = NULL)
+    {
+        // Client: 'peer' is sent as SNI and names the session to resume
+        SSL* ssl = SSL_new(mCtx);
+        if (ssl == NULL)
+        {
+            dbgerr("SSL_new failed\n");
+            return NULL;
+        }
+        if (!mServer && peer)
+        {
+            SSL_set_tlsext_host_name(ssl, peer);
+            pthread_mutex_lock(&mLock);
+            std::map<std::string, SSL_SESSION*>::iterator it = mSessions.find(peer);
+            if (it != mSessions.end())
+            {
+                // A copy per connection: OpenSSL marks a session not resumable when a connection
+                // resumed from it gets its replacement ticket, which would spoil concurrent offers
+                SSL_SESSION* dup = SSL_SESSION_dup(it->second);
+                SSL_set_session(ssl, dup ? dup : it->second);
+                SSL_SESSION_free(dup);
+            }
+            pthread_mutex_unlock(&mLock);
+        }
+        return ssl;
+    }
+
+    // Server stats (OpenSSL's own counters)
+
+    inline long handshakes() const
+    {
+        return SSL_CTX_sess_accept_good(mCtx);
+    }
+    inline long resumed() const
+    {
+        // From a ticket or the session cache
+        return SSL_CTX_sess_hits(mCtx);
+    }
+
+    static
+    void shutdown(struct bufferevent* bev)
+    {
+        // Before freeing a client connection.  OpenSSL marks the session of a connection freed
+        // without a close_notify as not resumable, which would throw away the session kept
+        // for the peer.  Sends close_notify if the socket takes it; doesn't wait for the peer's.
+        SSL* ssl = bufferevent_openssl_get_ssl(bev);
+        if (ssl && SSL_is_init_finished(ssl))
+        {
+            if (SSL_shutdown(ssl) < 0)
+            {
+                ERR_clear_error();
+            }
+            SSL_set_shutdown(ssl, SSL_get_shutdown(ssl) | SSL_SENT_SHUTDOWN);
+        }
+    }
+
+    static inline
+    bool isTls(struct bufferevent* bev)
+    {
+        return bufferevent_openssl_get_ssl(bev) != NULL;
+    }
+
+    static inline
+    bool isResumed(struct bufferevent* bev)
+    {
+        // After BEV_EVENT_CONNECTED
+        SSL* ssl = bufferevent_openssl_get_ssl(bev);
+        return ssl && SSL_session_reused(ssl);
+    }
+
+    inline SSL_CTX* ptr()
+    {
+        return mCtx;
+    }
+
+    static
+    struct bufferevent* onHttpBev(struct event_base* base, void* arg)
+    {
+        // evhttp_set_bevcb(): a TLS bufferevent for each accepted connection; evhttp sets the fd
+        EvTlsContext* tls = (EvTlsContext*)arg;
+        SSL* ssl = tls->newSsl();
+        if (ssl == NULL)
+        {
+            return NULL;
+        }
+        struct bufferevent* bev = bufferevent_openssl_socket_new(base, -1, ssl, BUFFEREVENT_SSL_ACCEPTING,
+            BEV_OPT_CLOSE_ON_FREE);
+        if (bev == NULL)
+        {
+            // libevent has freed the SSL (BEV_OPT_CLOSE_ON_FREE)
+            return NULL;
+        }
+        // Most clients close without a close_notify
+        bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+        return bev;
+    }
+
+protected:
+    SSL_CTX* mCtx;
+    bool mServer;
+    pthread_mutex_t mLock;
+    std::map<std::string, SSL_SESSION*> mSessions;  // Client: last session per peer
+
+    bool newContext(const SSL_METHOD* method)
+    {
+        free();
+        mCtx = SSL_CTX_new(method);
+        if (mCtx == NULL)
+        {
+            dbgerr("SSL_CTX_new failed\n");
+            return false;
+        }
+        SSL_CTX_set_min_proto_version(mCtx, TLS1_2_VERSION);
+        SSL_CTX_set_options(mCtx, SSL_OP_NO_COMPRESSION);
+        SSL_CTX_set_ex_data(mCtx, exIndex(), this);
+        return true;
+    }
+
+    void clearSessions()
+    {
+        pthread_mutex_lock(&mLock);
+        std::map<std::string, SSL_SESSION*>::iterator it;
+        for (it = mSessions.begin(); it != mSessions.end(); ++it)
+        {
+            SSL_SESSION_free(it->second);
+        }
+        mSessions.clear();
+        pthread_mutex_unlock(&mLock);
+    }
+
+    static
+    int exIndex()
+    {
+        static int index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+        return index;
+    }
+
+    static
+    int onNewSession(SSL* ssl, SSL_SESSION* sess)
+    {
+        // Keeps the reference (returns 1) as the peer's session to resume
+        EvTlsContext* tls = (EvTlsContext*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), exIndex());
+        const char* peer = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+        if (tls == NULL || peer == NULL || !SSL_SESSION_is_resumable(sess))
+        {
+            return 0;
+        }
+        pthread_mutex_lock(&tls->mLock);
+        SSL_SESSION*& slot = tls->mSessions[peer];
+        if (slot)
+        {
+            SSL_SESSION_free(slot);
+        }
+        slot = sess;
+        pthread_mutex_unlock(&tls->mLock);
+        return 1;
+    }
+
+private:
+    EvTlsContext(const EvTlsContext&);
+    EvTlsContext& operator=(const EvTlsContext&);
+};
+
+
+inline bool EvBufferEvent::newForTlsSocket(int fd, EvTlsContext& tls, bool accepting, bufferevent_data_cb readcb,
+    bufferevent_data_cb writecb, bufferevent_event_cb eventcb, void* cbarg, struct event_base* base,
+    const char* peer)
+{
+    // TLS over a socket (fd -1 to connect() later).  The handshake runs first; connecting
+    // sides get BEV_EVENT_CONNECTED once it is done, failures come as BEV_EVENT_ERROR.
+    free();
+
+    SSL* ssl = tls.newSsl(accepting ? NULL : peer);
+    if (ssl == NULL)
+    {
+        return false;
+    }
+    struct bufferevent* be = bufferevent_openssl_socket_new(base, fd, ssl,
+        accepting ? BUFFEREVENT_SSL_ACCEPTING : BUFFEREVENT_SSL_CONNECTING, BEV_OPT_CLOSE_ON_FREE);
+    if (be == NULL)
+    {
+        // libevent has freed the SSL (BEV_OPT_CLOSE_ON_FREE)
+        dbgerr("Failed to create libevent TLS buffer event\n");
+        return false;
+    }
+    bufferevent_openssl_set_allow_dirty_shutdown(be, 1);
+    bufferevent_setcb(be, readcb, writecb, eventcb, cbarg);
+
+    mPtr = be;
+    mOwner = true;
+    return true;
+}
+
+inline bool EvHttpServer::setTls(EvTlsContext& tls)
+{
+    // Every connection accepted from now on is HTTPS
+    if (tls.ptr() == NULL)
+    {
+        return false;
+    }
+    tlsCheck().store(EvTlsContext::isTls, std::memory_order_relaxed);
+    evhttp_set_bevcb(mServer, EvTlsContext::onHttpBev, &tls);
+    return true;
+}
+
+} // namespace lev
+
+#endif // _LEVTLS_H
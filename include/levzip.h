@@ -0,0 +1,748 @@
+// Copyright (c) 2014 Yasser Asmi
+// Released under the MIT License (http://opensource.org/licenses/MIT)
+
+#ifndef _LEVZIP_H
+#define _LEVZIP_H
+
+#include <zlib.h>
+
+#include "levhttp.h"
+#include "levfilter.h"
+#include "levcache.h"
+
+namespace lev
+{
+
+class EvDeflate;
+class EvInflate;
+class EvHttpCompressor;
+class EvCompressedReply;
+class EvDeflateFilter;
+
+
+class EvDeflate
+{
+public:
+    // Streaming zlib compression from one EvBuffer to another.  Input is read extent by
+    // extent with peek() and output is deflated straight into reserved space, so neither side
+    // is linearised or copied through a temporary:
+    //
+    //      EvDeflate z;
+    //      z.init(EvDeflate::Gzip, 6);
+    //      z.write(chunk, out);        // drains chunk
+    //      z.finish(out);
+    //
+    // Link with -lz.
+
+    enum Format
+    {
+        Deflate = 15,                   // zlib wrapper, what HTTP calls "deflate"
+        Gzip = 15 + 16
+    };
+
+    EvDeflate() :
+        mInit(false),
+        mFormat(Gzip),
+        mLevel(Z_DEFAULT_COMPRESSION)
+    {
+        memset(&mZ, 0, sizeof(mZ));
+    }
+    ~EvDeflate()
+    {
+        end();
+    }
+
+    bool init(Format format, int level = Z_DEFAULT_COMPRESSION)
+    {
+        end();
+        memset(&mZ, 0, sizeof(mZ));
+        if (deflateInit2(&mZ, level, Z_DEFLATED, (int)format, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            dbgerr("deflateInit2 failed\n");
+            return false;
+        }
+        mInit = true;
+        mFormat = format;
+        mLevel = level;
+        return true;
+    }
+    bool reset()
+    {
+        // Start a new stream with the same settings (cheaper than init())
+        return mInit && deflateReset(&mZ) == Z_OK;
+    }
+    void end()
+    {
+        if (mInit)
+        {
+            deflateEnd(&mZ);
+            mInit = false;
+        }
+    }
+
+    inline bool write(EvBuffer& in, EvBuffer& out)
+    {
+        // Compresses and drains all of 'in'.  zlib may hold on to some of it until flush() or
+        // finish().
+        return feed(in, 0, out, Z_NO_FLUSH, true);
+    }
+    inline bool flush(EvBuffer& out)
+    {
+        // Everything written so far becomes decodable by the peer (costs a few bytes)
+        return run(NULL, 0, out, Z_SYNC_FLUSH);
+    }
+    inline bool finish(EvBuffer& out)
+    {
+        // Ends the stream; reset() before writing another
+        return run(NULL, 0, out, Z_FINISH);
+    }
+
+    inline uint64_t totalIn() const
+    {
+        return mZ.total_in;
+    }
+    inline uint64_t totalOut() const
+    {
+        return mZ.total_out;
+    }
+
+    static
+    bool compress(EvBuffer& in, EvBuffer& out, Format format, int level = Z_DEFAULT_COMPRESSION)
+    {
+        // One shot; 'in' is left as it is (ie a cached body).  deflateInit2() allocates and
+        // clears ~256KB, which costs more than compressing a small reply, so each thread keeps
+        // a stream and resets it.
+        static thread_local EvDeflate z;
+        bool ok = (z.mInit && z.mFormat == format && z.mLevel == level) ? z.reset() : z.init(format, level);
+        return ok && z.feed(in, 0, out, Z_FINISH, false);
+    }
+
+protected:
+    enum { OutChunk = 16 * 1024 };
+
+    z_stream mZ;
+    bool mInit;
+    Format mFormat;
+    int mLevel;
+
+    bool feed(EvBuffer& in, size_t offset, EvBuffer& out, int flush, bool drain)
+    {
+        struct evbuffer_iovec vec[16];
+        size_t total = in.length();
+        size_t pos = offset;
+        while (pos < total)
+        {
+            int n = in.peek(pos, -1, vec, 16);
+            if (n <= 0)
+            {
+                break;
+            }
+            n = (n > 16) ? 16 : n;
+            for (int i = 0; i < n; i++)
+            {
+                if (!run(vec[i].iov_base, vec[i].iov_len, out, Z_NO_FLUSH))
+                {
+                    return false;
+                }
+                pos += vec[i].iov_len;
+            }
+        }
+        if (drain)
+        {
+            in.drain(pos);
+        }
+        return (flush == Z_NO_FLUSH) || run(NULL, 0, out, flush);
+    }
+
+    bool run(const void* data, size_t len, EvBuffer& out, int flush)
+    {
+        if (!mInit)
+        {
+            return false;
+        }
+        mZ.next_in = (Bytef*)data;
+        mZ.avail_in = (uInt)len;
+        for (;;)
+        {
+            struct evbuffer_iovec vec;
+            if (out.reserve(OutChunk, vec) == NULL)
+            {
+                return false;
+            }
+            mZ.next_out = (Bytef*)vec.iov_base;
+            mZ.avail_out = (uInt)vec.iov_len;
+            int ret = ::deflate(&mZ, flush);
+            out.commit(vec, vec.iov_len - mZ.avail_out);
+
+            if (ret == Z_STREAM_ERROR)
+            {
+                dbgerr("deflate failed\n");
+                return false;
+            }
+            if (ret == Z_STREAM_END)
+            {
+                return true;
+            }
+            if (mZ.avail_in == 0 && mZ.avail_out != 0)
+            {
+                // Input consumed and, for a flush, all of the output produced
+                return true;
+            }
+        }
+    }
+
+private:
+    EvDeflate(const EvDeflate&);
+    EvDeflate& operator=(const EvDeflate&);
+};
+
+
+class EvInflate
+{
+public:
+    // Streaming zlib decompression, the reverse of EvDeflate.  Takes zlib and gzip streams.
+
+    EvInflate() :
+        mInit(false),
+        mDone(false)
+    {
+        memset(&mZ, 0, sizeof(mZ));
+    }
+    ~EvInflate()
+    {
+        end();
+    }
+
+    bool init()
+    {
+        end();
+        memset(&mZ, 0, sizeof(mZ));
+        if (inflateInit2(&mZ, 15 + 32) != Z_OK)
+        {
+            dbgerr("inflateInit2 failed\n");
+            return false;
+        }
+        mInit = true;
+        mDone = false;
+        return true;
+    }
+    void end()
+    {
+        if (mInit)
+        {
+            inflateEnd(&mZ);
+            mInit = false;
+        }
+    }
+
+    bool write(EvBuffer& in, EvBuffer& out)
+    {
+        // Decompresses and drains 'in'.  Anything after the end of the stream is left in it.
+        // False on corrupt data.
+        struct evbuffer_iovec vec[16];
+        size_t consumed = 0;
+        bool ok = mInit;
+        while (ok && !mDone && consumed < in.length())
+        {
+            int n = in.peek(consumed, -1, vec, 16);
+            if (n <= 0)
+            {
+                break;
+            }
+            n = (n > 16) ? 16 : n;
+            for (int i = 0; ok && !mDone && i < n; i++)
+            {
+                size_t left = 0;
+                ok = run(vec[i].iov_base, vec[i].iov_len, out, &left);
+                consumed += vec[i].iov_len - left;
+            }
+        }
+        in.drain(consumed);
+        return ok;
+    }
+
+    inline bool finished() const
+    {
+        return mDone;
+    }
+    inline uint64_t totalIn() const
+    {
+        return mZ.total_in;
+    }
+    inline uint64_t totalOut() const
+    {
+        return mZ.total_out;
+    }
+
+protected:
+    enum { OutChunk = 64 * 1024 };
+
+    z_stream mZ;
+    bool mInit;
+    bool mDone;
+
+    bool run(const void* data, size_t len, EvBuffer& out, size_t* left)
+    {
+        mZ.next_in = (Bytef*)data;
+        mZ.avail_in = (uInt)len;
+        for (;;)
+        {
+            struct evbuffer_iovec vec;
+            if (out.reserve(OutChunk, vec) == NULL)
+            {
+                return false;
+            }
+            mZ.next_out = (Bytef*)vec.iov_base;
+            mZ.avail_out = (uInt)vec.iov_len;
+            int ret = ::inflate(&mZ, Z_NO_FLUSH);
+            out.commit(vec, vec.iov_len - mZ.avail_out);
+            *left = mZ.avail_in;
+
+            if (ret == Z_STREAM_END)
+            {
+                mDone = true;
+                return true;
+            }
+            if (ret != Z_OK && ret != Z_BUF_ERROR)
+            {
+                dbgerr("inflate failed: %s\n", mZ.msg ? mZ.msg : "?");
+                return false;
+            }
+            if (mZ.avail_in == 0 && mZ.avail_out != 0)
+            {
+                return true;
+            }
+        }
+    }
+
+private:
+    EvInflate(const EvInflate&);
+    EvInflate& operator=(const EvInflate&);
+};
+
+
+class EvHttpCompressor
+{
+public:
+    // Content-Encoding negotiation for replies.  A reply is compressed when the client's
+    // Accept-Encoding allows gzip or deflate, the body is at least 'minsize' bytes, its
+    // Content-Type is text-like and the handler hasn't encoded it already:
+    //
+    //      static EvHttpCompressor zip(1024, 6);
+    //      ...
+    //      zip.sendReply(req, 200, "OK", body);
+    //
+    // On JSON, level 6 shrinks 16KB to about a fifth for ~200us of CPU; level 1 takes half
+    // that for 10-30% more output (microbench -z).  Bytes fed to and produced by deflate are
+    // counted in EvMetrics (lev_http_deflate_bytes_total).
+
+    enum Coding
+    {
+        Identity,
+        Gzip,
+        Deflate
+    };
+
+    EvHttpCompressor(size_t minsize = 1024, int level = 6) :
+        mMinSize(minsize),
+        mLevel(level)
+    {
+    }
+
+    inline void setMinSize(size_t minsize)
+    {
+        mMinSize = minsize;
+    }
+    inline size_t minSize() const
+    {
+        return mMinSize;
+    }
+    inline void setLevel(int level)
+    {
+        mLevel = level;
+    }
+    inline int level() const
+    {
+        return mLevel;
+    }
+
+    Coding select(struct evhttp_request* req, size_t len)
+    {
+        // Coding for a reply with a 'len' byte body whose output headers are set.  Adds
+        // "Vary: Accept-Encoding" whenever the answer depends on the request.
+        struct evkeyvalq* out = evhttp_request_get_output_headers(req);
+        if (len < mMinSize || evhttp_find_header(out, "Content-Encoding") != NULL ||
+            !compressible(evhttp_find_header(out, "Content-Type")))
+        {
+            return Identity;
+        }
+        evhttp_add_header(out, "Vary", "Accept-Encoding");
+        return negotiate(req);
+    }
+
+    void sendReply(struct evhttp_request* req, int code, const char* reason, EvBuffer& body)
+    {
+        Coding c = (code == HTTP_OK) ? select(req, body.length()) : Identity;
+        if (c == Identity)
+        {
+            evhttp_send_reply(req, code, reason, body.ptr());
+            return;
+        }
+
+        EvBuffer z;
+        z.newBuffer();
+        size_t len = body.length();
+        if (!EvDeflate::compress(body, z, format(c), mLevel))
+        {
+            evhttp_send_reply(req, code, reason, body.ptr());
+            return;
+        }
+        count(len, z.length());
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Encoding", name(c));
+        evhttp_send_reply(req, code, reason, z.ptr());
+    }
+
+    static
+    Coding negotiate(struct evhttp_request* req)
+    {
+        return negotiate(evhttp_find_header(evhttp_request_get_input_headers(req), "Accept-Encoding"));
+    }
+
+    static
+    Coding negotiate(const char* accept)
+    {
+        // Highest q wins, gzip on a tie.  "*" covers codings not listed; q=0 refuses one.
+        float gzip = -1.0f;
+        float deflate = -1.0f;
+        float star = -1.0f;
+        for (const char* p = accept; p && *p;)
+        {
+            while (*p == ' ' || *p == ',')
+            {
+                p++;
+            }
+            size_t len = strcspn(p, " ;,");
+            float* q = NULL;
+            if (len == 4 && evutil_ascii_strncasecmp(p, "gzip", 4) == 0)
+            {
+                q = &gzip;
+            }
+            else if (len == 7 && evutil_ascii_strncasecmp(p, "deflate", 7) == 0)
+            {
+                q = &deflate;
+            }
+            else if (len == 1 && *p == '*')
+            {
+                q = &star;
+            }
+            p += len;
+
+            float val = 1.0f;
+            size_t plen = strcspn(p, ",");
+            const char* qp = (const char*)memchr(p, ';', plen);
+            if (qp)
+            {
+                qp++;
+                while (*qp == ' ')
+                {
+                    qp++;
+                }
+                if ((*qp == 'q' || *qp == 'Q') && qp[1] == '=')
+                {
+                    val = (float)atof(qp + 2);
+                }
+            }
+            if (q)
+            {
+                *q = val;
+            }
+            p += plen;
+        }
+
+        gzip = (gzip < 0.0f) ? star : gzip;
+        deflate = (deflate < 0.0f) ? star : deflate;
+        if (gzip > 0.0f && gzip >= deflate)
+        {
+            return Gzip;
+        }
+        return (deflate > 0.0f) ? Deflate : Identity;
+    }
+
+    static
+    bool compressible(const char* ctype)
+    {
+        // Text and structured text; images, video and archives are compressed already.
+        // evhttp sends text/html when there is no Content-Type.
+        if (ctype == NULL || evutil_ascii_strncasecmp(ctype, "text/", 5) == 0)
+        {
+            return true;
+        }
+        size_t len = strcspn(ctype, "; ");
+        static const char* const types[] =
+        {
+            "application/json", "application/javascript", "application/xml", "application/xhtml+xml",
+            "application/x-www-form-urlencoded", "image/svg+xml", NULL
+        };
+        for (int i = 0; types[i]; i++)
+        {
+            if (strlen(types[i]) == len && evutil_ascii_strncasecmp(ctype, types[i], len) == 0)
+            {
+                return true;
+            }
+        }
+        // Structured syntax suffixes (application/problem+json, application/atom+xml, ...)
+        return (len > 5 && evutil_ascii_strncasecmp(ctype + len - 5, "+json", 5) == 0) ||
+            (len > 4 && evutil_ascii_strncasecmp(ctype + len - 4, "+xml", 4) == 0);
+    }
+
+    static inline
+    const char* name(Coding c)
+    {
+        return (c == Gzip) ? "gzip" : (c == Deflate) ? "deflate" : "identity";
+    }
+    static inline
+    EvDeflate::Format format(Coding c)
+    {
+        return (c == Deflate) ? EvDeflate::Deflate : EvDeflate::Gzip;
+    }
+
+    static inline
+    void count(uint64_t in, uint64_t out)
+    {
+        EvLoopMetrics& m = EvMetrics::local();
+        EvLoopMetrics::inc(m.deflateIn, in);
+        EvLoopMetrics::inc(m.deflateOut, out);
+    }
+
+    static
+    bool compressCopy(EvHttpCompressor* zip, const char* ctype, EvBuffer& body, EvBuffer& gzip)
+    {
+        // A gzip copy of a whole body into a new buffer, if it is worth sending (EvResponseCache)
+        if (body.length() < zip->minSize() || !compressible(ctype))
+        {
+            return false;
+        }
+        gzip.newBuffer();
+        if (!EvDeflate::compress(body, gzip, EvDeflate::Gzip, zip->level()) || gzip.length() >= body.length())
+        {
+            gzip.drain(gzip.length());
+            return false;
+        }
+        count(body.length(), gzip.length());
+        return true;
+    }
+    static inline
+    bool acceptsGzip(struct evhttp_request* req)
+    {
+        return negotiate(req) == Gzip;
+    }
+
+protected:
+    size_t mMinSize;
+    int mLevel;
+};
+
+
+class EvCompressedReply
+{
+public:
+    // Streamed reply (EvHttpRequest::sendReplyStart() and friends) with the body compressed on
+    // the way out.  The length isn't known up front so the size threshold doesn't apply.  Each
+    // chunk() is flushed so the client can decode it on arrival; pass flush = false for small
+    // pieces to let deflate see more context.
+    //
+    //      EvCompressedReply* zr = new EvCompressedReply(zip);
+    //      zr->start(req, 200, "OK");
+    //      zr->chunk(data);
+    //      ...
+    //      zr->end();                   // then delete zr
+
+    EvCompressedReply(EvHttpCompressor& zip) :
+        mZip(zip),
+        mReq(NULL),
+        mCoding(EvHttpCompressor::Identity),
+        mIn(0),
+        mOut(0)
+    {
+        mBuf.newBuffer();
+    }
+    ~EvCompressedReply()
+    {
+    }
+
+    void start(struct evhttp_request* req, int code, const char* reason)
+    {
+        mReq = req;
+        mCoding = EvHttpCompressor::Identity;
+        struct evkeyvalq* out = evhttp_request_get_output_headers(req);
+        if (evhttp_find_header(out, "Content-Encoding") == NULL &&
+            EvHttpCompressor::compressible(evhttp_find_header(out, "Content-Type")))
+        {
+            evhttp_add_header(out, "Vary", "Accept-Encoding");
+            mCoding = EvHttpCompressor::negotiate(req);
+        }
+        if (mCoding != EvHttpCompressor::Identity)
+        {
+            if (mZ.init(EvHttpCompressor::format(mCoding), mZip.level()))
+            {
+                evhttp_add_header(out, "Content-Encoding", EvHttpCompressor::name(mCoding));
+            }
+            else
+            {
+                mCoding = EvHttpCompressor::Identity;
+            }
+        }
+        evhttp_send_reply_start(req, code, reason);
+    }
+
+    void chunk(EvBuffer& data, bool flush = true)
+    {
+        EvHttpRequest evreq(mReq);
+        if (!compress(data, flush, false))
+        {
+            evreq.sendReplyChunk(data);
+            return;
+        }
+        if (mBuf.length() > 0)
+        {
+            evreq.sendReplyChunk(mBuf);
+        }
+    }
+    void chunk(EvBuffer& data, EvHttpRequest::ConnCallback ondrain, void* arg, size_t lowwatermark = 0)
+    {
+        // With backpressure, as EvHttpRequest::sendReplyChunk()
+        EvHttpRequest evreq(mReq);
+        if (!compress(data, true, false))
+        {
+            evreq.sendReplyChunk(data, ondrain, arg, lowwatermark);
+            return;
+        }
+        evreq.sendReplyChunk(mBuf, ondrain, arg, lowwatermark);
+    }
+
+    void end()
+    {
+        // The request is freed once the reply is written
+        EvHttpRequest evreq(mReq);
+        EvBuffer empty;
+        empty.newBuffer();
+        if (compress(empty, false, true) && mBuf.length() > 0)
+        {
+            evreq.sendReplyChunk(mBuf);
+        }
+        evreq.sendReplyEnd();
+        mReq = NULL;
+    }
+
+    inline EvHttpCompressor::Coding coding() const
+    {
+        return mCoding;
+    }
+    inline uint64_t bytesIn() const
+    {
+        return mIn;
+    }
+    inline uint64_t bytesOut() const
+    {
+        return mOut;
+    }
+
+protected:
+    EvHttpCompressor& mZip;
+    struct evhttp_request* mReq;
+    EvHttpCompressor::Coding mCoding;
+    EvDeflate mZ;
+    EvBuffer mBuf;
+    uint64_t mIn;
+    uint64_t mOut;
+
+    bool compress(EvBuffer& data, bool flush, bool finish)
+    {
+        // Deflates 'data' into mBuf; false when the reply isn't compressed
+        if (mCoding == EvHttpCompressor::Identity)
+        {
+            return false;
+        }
+        uint64_t in = mZ.totalIn();
+        uint64_t out = mZ.totalOut();
+        mZ.write(data, mBuf);
+        if (finish)
+        {
+            mZ.finish(mBuf);
+        }
+        else if (flush)
+        {
+            mZ.flush(mBuf);
+        }
+        mIn += mZ.totalIn() - in;
+        mOut += mZ.totalOut() - out;
+        EvHttpCompressor::count(mZ.totalIn() - in, mZ.totalOut() - out);
+        return true;
+    }
+
+private:
+    EvCompressedReply(const EvCompressedReply&);
+    EvCompressedReply& operator=(const EvCompressedReply&);
+};
+
+
+
+class EvDeflateFilter : public EvFilter
+{
+public:
+    // EvFilterStack stage compressing everything written and decompressing everything read,
+    // for links where both ends run one.  Each output call ends in a sync flush so whatever
+    // was written can be decoded by the peer straight away (5 bytes each); BEV_FINISHED ends
+    // the stream.
+
+    EvDeflateFilter(int level = 1)
+    {
+        mZ.init(EvDeflate::Deflate, level);
+        mUnz.init();
+    }
+
+    virtual const char* name() const
+    {
+        return "deflate";
+    }
+
+    virtual enum bufferevent_filter_result input(EvBuffer& src, EvBuffer& dst, ssize_t limit,
+        enum bufferevent_flush_mode mode)
+    {
+        size_t before = dst.length();
+        if (!mUnz.write(src, dst))
+        {
+            return BEV_ERROR;
+        }
+        return (dst.length() > before) ? BEV_OK : BEV_NEED_MORE;
+    }
+
+    virtual enum bufferevent_filter_result output(EvBuffer& src, EvBuffer& dst, ssize_t limit,
+        enum bufferevent_flush_mode mode)
+    {
+        if (src.length() == 0 && mode == BEV_NORMAL)
+        {
+            return BEV_NEED_MORE;
+        }
+        bool ok = mZ.write(src, dst);
+        ok = ok && ((mode == BEV_FINISHED) ? mZ.finish(dst) : mZ.flush(dst));
+        return ok ? BEV_OK : BEV_ERROR;
+    }
+
+protected:
+    EvDeflate mZ;
+    EvInflate mUnz;
+};
+
+
+inline void EvResponseCache::setCompressor(EvHttpCompressor* zip)
+{
+    // Before serving; its size threshold and level apply to the stored gzip copies
+    mZip = zip;
+    mCompress = EvHttpCompressor::compressCopy;
+    mAcceptsGzip = EvHttpCompressor::acceptsGzip;
+}
+
+} // namespace lev
+
+#endif // _LEVZIP_H